@@ -0,0 +1,919 @@
+/*
+	MIT License
+
+	Copyright (c) 2023 Julian Scheffers
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy
+	of this software and associated documentation files (the "Software"), to deal
+	in the Software without restriction, including without limitation the rights
+	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+	copies of the Software, and to permit persons to whom the Software is
+	furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+
+
+#include "elfwriter.hpp"
+#include "elfloader.hpp"
+#include "relocation.hpp"
+#include "mpu.hpp"
+#include "fastload.hpp"
+#include "snapshot.hpp"
+#include "depgraph.hpp"
+#include "addrindex.hpp"
+#include "callprofile.hpp"
+#include "relobject.hpp"
+
+#ifdef ELFLOADER_PERFMAP
+#include "perfmap.hpp"
+#include <unistd.h>
+#endif
+
+#ifdef ELFLOADER_PMP_SIM
+#include "mpu/pmp_sim.hpp"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include <functional>
+#include <string>
+
+using namespace elf;
+
+// Minimum time to spend on each benchmark.
+static const auto MIN_TIME = std::chrono::milliseconds(100);
+// Only benchmarks whose name contains this are run.
+static const char *filter = "";
+
+// Run `func` repeatedly and print the average time per call.
+static void bench(const char *name, size_t scale, const std::function<bool()> &func) {
+	if (!strstr(name, filter)) return;
+	using Clock = std::chrono::steady_clock;
+	
+	// Warm up and check the benchmark works at all.
+	if (!func()) {
+		printf("%-24s %8zu  FAILED\n", name, scale);
+		return;
+	}
+	
+	// Double the iteration count until enough time has passed.
+	size_t iter = 1;
+	Clock::duration time;
+	while (1) {
+		auto start = Clock::now();
+		for (size_t i = 0; i < iter; i++) func();
+		time = Clock::now() - start;
+		if (time >= MIN_TIME) break;
+		iter *= 2;
+	}
+	
+	double ns = std::chrono::duration<double, std::nano>(time).count() / iter;
+	printf("%-24s %8zu  %12.0f ns/op  %10zu iter\n", name, scale, ns, iter);
+}
+
+// Allocator for `ELFFile::load`, backed by `aligned_alloc`.
+static std::pair<size_t, size_t> allocate(size_t, size_t len, size_t align) {
+	if (align < sizeof(void *)) align = sizeof(void *);
+	void *mem = aligned_alloc(align, (len + align - 1) / align * align);
+	return {(size_t) mem, (size_t) mem};
+}
+
+// Release memory allocated by `allocate`.
+static void release(Program &program) {
+	free(program.memory_cookie);
+	program = Program();
+}
+
+// Read the dynamic information of an image, rewinding the stream first.
+static bool parse(FILE *fd, ELFFile &out) {
+	fseek(fd, 0, SEEK_SET);
+	out = ELFFile(fd);
+	return out.readDyn();
+}
+
+
+
+// Benchmark reading the headers and dynamic symbols.
+static void benchParse() {
+	for (bool hash: {false, true}) {
+		for (size_t symbols: {16, 256, 4096}) {
+			elfgen::Options opt;
+			opt.symbols = symbols;
+			opt.gnuHash = hash;
+			auto image  = elfgen::generate(opt);
+			FILE *fd    = elfgen::open(image);
+			
+			bench(hash ? "parse/gnu_hash" : "parse", symbols, [&] {
+				ELFFile file;
+				return parse(fd, file);
+			});
+			fclose(fd);
+		}
+	}
+}
+
+// Benchmark restoring parsed metadata from a cache blob, and hashing the file to key it.
+static void benchCache() {
+	for (size_t symbols: {16, 256, 4096}) {
+		elfgen::Options opt;
+		opt.symbols = symbols;
+		opt.relocs  = symbols;
+		auto image  = elfgen::generate(opt);
+		FILE *fd    = elfgen::open(image);
+		ELFFile file;
+		parse(fd, file);
+		uint64_t key = contentHash(fd);
+		auto blob    = file.saveMetadata(key);
+		
+		bench("parse/cached", symbols, [&] {
+			ELFFile file(fd);
+			return file.loadMetadata(blob.data(), blob.size(), key) && file.getDynSym().size() == symbols + 1;
+		});
+		bench("parse/content_hash", symbols, [&] {
+			return contentHash(fd) == key;
+		});
+		
+		// Check that relocation works from the cache alone.
+		ELFFile cached(fd);
+		cached.loadMetadata(blob.data(), blob.size(), key);
+		Program program = cached.load(allocate);
+		if (!program || !relocate(cached, program, {})) printf("parse/cached: relocation FAILED\n");
+		release(program);
+		fclose(fd);
+	}
+}
+
+// Benchmark loading, relocating and exporting a converted fast-load image, against the same steps on the ELF file.
+static void benchFastload() {
+	for (size_t relocs: {64, 1024, 16384}) {
+		elfgen::Options opt;
+		opt.segmentSize = 64 * 1024;
+		opt.symbols     = relocs / 4;
+		opt.imports     = 64;
+		opt.relocs      = relocs;
+		opt.relocTypes  = { elfgen::R_RELATIVE, elfgen::R_RELATIVE, elfgen::R_RELATIVE, elfgen::R_JUMP_SLOT };
+		auto image      = elfgen::generate(opt);
+		FILE *fd        = elfgen::open(image);
+		ELFFile file;
+		parse(fd, file);
+		std::vector<uint8_t> fast;
+		fastload::convert(file, fast);
+		FILE *fastFd    = elfgen::open(fast);
+		
+		SymMap imports;
+		for (size_t i = 0; i < opt.imports; i++) imports[elfgen::importName(i)] = 0x1000 + i * 16;
+		
+		bench("fastload/elf", relocs, [&] {
+			fseek(fd, 0, SEEK_SET);
+			ELFFile file(fd);
+			Program program = file.loadDyn(allocate);
+			SymMap map = imports;
+			bool ok = program && file.isValid() && relocate(file, program, map) && exportSymbols(file, program, map);
+			release(program);
+			return ok;
+		});
+		bench("fastload/image", relocs, [&] {
+			fastload::Image fast(fastFd);
+			Program program = fast.load(allocate);
+			SymMap map = imports;
+			bool ok = program && fast.relocate(program, map) && fast.exportSymbols(program, map);
+			release(program);
+			return ok;
+		});
+		
+		// The same, prelinked for a fixed address.
+		fastload::Image conv(fastFd);
+		auto fixed     = allocate(0, conv.getHeader().memSize, conv.getHeader().align);
+		auto prelinked = fast;
+		fastload::prelink(prelinked, fixed.first, imports);
+		FILE *prelinkedFd = elfgen::open(prelinked);
+		auto atFixed   = [&](size_t, size_t, size_t) { return fixed; };
+		bench("fastload/prelinked", relocs, [&] {
+			fastload::Image fast(prelinkedFd);
+			Program program = fast.load(atFixed);
+			SymMap map = imports;
+			return program && fast.relocate(program, map) && fast.exportSymbols(program, map);
+		});
+		
+		// Check that all of them produce the same memory and exports, including the prelinked image loaded elsewhere.
+		fastload::Image pre(prelinkedFd);
+		Program a = file.load(allocate);
+		Program b = conv.load(allocate);
+		Program c = pre.load(atFixed);
+		Program d = pre.load(allocate);
+		SymMap mapA = imports, mapB = imports;
+		bool ok = a && b && c && d && a.size == b.size && relocate(file, a, mapA) && conv.relocate(b, mapB);
+		ok = ok && pre.relocate(c, imports) && pre.relocate(d, imports);
+		ok = ok && exportSymbols(file, a, mapA) && conv.exportSymbols(b, mapB) && mapA.size() == mapB.size();
+		// Relocated words differ by the difference in load address; gaps between segments are not compared.
+		auto same = [&](const Program &x, const Program &y) {
+			for (const auto &prog: file.getProg()) {
+				if (prog.type != (int) PT::LOAD) continue;
+				for (Addr off = prog.vaddr - a.vaddr_req; off < prog.vaddr - a.vaddr_req + prog.mem_size; off += sizeof(Addr)) {
+					auto wx = *(const Addr *) ((const uint8_t *) x.memory + off);
+					auto wy = *(const Addr *) ((const uint8_t *) y.memory + off);
+					if (wx != wy && wx - x.vaddr_real != wy - y.vaddr_real) return false;
+				}
+			}
+			return true;
+		};
+		if (ok) {
+			ok = same(a, b) && same(b, c) && same(b, d);
+			for (const auto &[name, addr]: mapA) {
+				if (!imports.count(name)) ok = ok && addr - a.vaddr_real == mapB[name] - b.vaddr_real;
+			}
+			for (size_t i = 0; ok && i < opt.symbols; i++) {
+				auto name = elfgen::symbolName(i);
+				ok = conv.findExport(name, b) == mapB[name] && pre.findExport(name, d) == mapB[name] - b.vaddr_real + d.vaddr_real;
+			}
+		}
+		if (!ok) printf("fastload: conversion mismatch\n");
+		release(a);
+		release(b);
+		release(d);
+		free((void *) fixed.second);
+		fclose(prelinkedFd);
+		fclose(fastFd);
+		fclose(fd);
+	}
+}
+
+// Benchmark restoring a snapshot of a loaded program, against loading it from the ELF file at the same address.
+static void benchSnapshot() {
+	for (size_t relocs: {64, 1024, 16384}) {
+		elfgen::Options opt;
+		opt.segmentSize = 64 * 1024;
+		opt.symbols     = relocs / 4;
+		opt.imports     = 64;
+		opt.relocs      = relocs;
+		opt.relocTypes  = { elfgen::R_RELATIVE, elfgen::R_RELATIVE, elfgen::R_RELATIVE, elfgen::R_JUMP_SLOT };
+		auto image      = elfgen::generate(opt);
+		FILE *fd        = elfgen::open(image);
+		ELFFile file;
+		parse(fd, file);
+		uint64_t key    = contentHash(fd);
+		
+		SymMap imports;
+		for (size_t i = 0; i < opt.imports; i++) imports[elfgen::importName(i)] = 0x1000 + i * 16;
+		
+		// Both load into the same memory, as a device restarting would.
+		Program loaded  = file.load(allocate);
+		auto fixed      = std::make_pair((size_t) loaded.memory, (size_t) loaded.memory_cookie);
+		auto atFixed    = [&](size_t, size_t, size_t) { return fixed; };
+		SymMap exported = imports;
+		relocate(file, loaded, exported);
+		exportSymbols(file, loaded, exported);
+		auto snap = snapshot::save(file, loaded, imports, key);
+		std::vector<uint8_t> expect((uint8_t *) loaded.memory, (uint8_t *) loaded.memory + loaded.size);
+		
+		bench("snapshot/elf", relocs, [&] {
+			fseek(fd, 0, SEEK_SET);
+			ELFFile file(fd);
+			Program program = file.loadDyn(atFixed);
+			SymMap map = imports;
+			return program && file.isValid() && relocate(file, program, map) && exportSymbols(file, program, map);
+		});
+		bench("snapshot/restore", relocs, [&] {
+			snapshot::Snapshot snapshot(snap.data(), snap.size(), key);
+			Program program;
+			SymMap map = imports;
+			return snapshot.restore(atFixed, map, program) && snapshot.exportSymbols(program, map);
+		});
+		
+		// Check the restored program, and that stale snapshots are refused.
+		snapshot::Snapshot restored(snap.data(), snap.size(), key);
+		Program program;
+		SymMap map = imports;
+		bool ok = restored.restore(atFixed, map, program) && restored.exportSymbols(program, map);
+		ok = ok && map == exported && !memcmp(program.memory, expect.data(), expect.size());
+		ok = ok && restored.regions(program).size() == opt.segments + 1;
+		SymMap moved = imports;
+		moved.begin()->second++;
+		Program other;
+		ok = ok && !restored.restore(atFixed, moved, other) && !restored.restore(allocate, imports, other);
+		release(other);
+		ok = ok && !snapshot::Snapshot(snap.data(), snap.size(), key + 1).isValid();
+		if (!ok) printf("snapshot: restore mismatch\n");
+		release(loaded);
+		fclose(fd);
+	}
+}
+
+// Benchmark loading a program that needs several libraries, which in turn need a common base library.
+static void benchDeps() {
+	for (size_t libs: {2, 8}) {
+		// Files, so that loading can use positional reads.
+		std::map<std::string, FILE *> files;
+		auto add = [&](const std::string &name, const elfgen::Options &opt) {
+			auto image = elfgen::generate(opt);
+			FILE *tmp  = tmpfile();
+			fwrite(image.data(), 1, image.size(), tmp);
+			fflush(tmp);
+			files[name] = tmp;
+		};
+		elfgen::Options opt;
+		opt.segments     = 4;
+		opt.segmentSize  = 256 * 1024;
+		opt.symbols      = 256;
+		opt.relocs       = 4096;
+		opt.relocTypes   = { elfgen::R_RELATIVE, elfgen::R_JUMP_SLOT };
+		opt.symbolPrefix = "base_";
+		add("libbase.so", opt);
+		opt.imports      = 64;
+		opt.importPrefix = "base_";
+		for (size_t i = 0; i < libs; i++) {
+			opt.symbolPrefix = "lib" + std::to_string(i) + "_";
+			opt.needed       = { "libbase.so" };
+			add("lib" + std::to_string(i) + ".so", opt);
+		}
+		opt.symbolPrefix = "main_";
+		opt.importPrefix = "lib0_";
+		opt.needed.clear();
+		for (size_t i = 0; i < libs; i++) opt.needed.push_back("lib" + std::to_string(i) + ".so");
+		add("main", opt);
+		
+		auto run = [&](bool parallel) {
+			DepGraph graph([&](const std::string &name) { return files.count(name) ? files[name] : nullptr; }, allocate);
+			graph.parallel = parallel;
+			SymMap map;
+			bool ok = graph.load(files["main"], map);
+			ok = ok && graph.modules.size() == libs + 2 && graph.modules.back().name.empty();
+			ok = ok && map.size() == (libs + 2) * opt.symbols;
+			graph.unload(release);
+			return ok;
+		};
+		bench("deps/serial", libs, [&] { return run(false); });
+#ifdef ELFLOADER_ASYNC
+		bench("deps/parallel", libs, [&] { return run(true); });
+#endif
+		
+		// A second program needing the same libraries, while the first is loaded.
+		opt.symbolPrefix = "second_";
+		add("second", opt);
+		Registry registry(release);
+		DepGraph first([&](const std::string &name) { return files.count(name) ? files[name] : nullptr; }, allocate);
+		first.registry = &registry;
+		SymMap firstMap;
+		bool ok = first.load(files["main"], firstMap) && registry.size() == libs + 1;
+		bench("deps/shared", libs, [&] {
+			DepGraph graph([&](const std::string &name) { return files.count(name) ? files[name] : nullptr; }, allocate);
+			graph.registry = &registry;
+			SymMap map;
+			bool ok = graph.load(files["second"], map) && map.size() == (libs + 2) * opt.symbols;
+			graph.unload(release);
+			return ok && registry.size() == libs + 1;
+		});
+		first.unload(release);
+		if (!ok || registry.size()) printf("deps/shared: registry FAILED\n");
+		for (auto &[name, fd]: files) fclose(fd);
+	}
+}
+
+// Benchmark looking up dynamic symbols by name.
+static void benchLookup() {
+	for (size_t symbols: {16, 256, 4096}) {
+		elfgen::Options opt;
+		opt.symbols = symbols;
+		opt.gnuHash = true;
+		auto image  = elfgen::generate(opt);
+		FILE *fd    = elfgen::open(image);
+		ELFFile file;
+		parse(fd, file);
+		
+		std::vector<std::string> names;
+		for (size_t i = 0; i < symbols; i++) names.push_back(elfgen::symbolName(i));
+		size_t i = 0;
+		bench("lookup", symbols, [&] {
+			return file.findDynSym(names[i++ % names.size()]) != nullptr;
+		});
+		fclose(fd);
+	}
+}
+
+// Benchmark finding the program and symbol an address is in, compared to scanning every program's symbols.
+static void benchAddr() {
+	for (size_t symbols: {256, 4096}) {
+		elfgen::Options opt;
+		opt.symbols     = symbols;
+		opt.segmentSize = symbols * 16;
+		auto image      = elfgen::generate(opt);
+		FILE *fd        = elfgen::open(image);
+		ELFFile file;
+		parse(fd, file);
+		
+		AddrIndex index;
+		std::vector<Program> programs;
+		for (size_t i = 0; i < 16; i++) {
+			programs.push_back(file.load(allocate));
+			index.add("lib" + std::to_string(i) + ".so", file, programs.back());
+		}
+		
+		// Addresses inside every symbol of every program, visited in a scattered order.
+		std::vector<std::pair<size_t, std::string>> addrs;
+		for (const auto &program: programs) {
+			for (const auto &sym: file.getDynSym()) {
+				if (sym.section) addrs.push_back({sym.value + program.vaddr_offset() + 4, sym.name});
+			}
+		}
+		size_t i = 0;
+		auto next = [&]() -> const auto & { i = (i + 7919) % addrs.size(); return addrs[i]; };
+		
+		bench("addr/index", symbols, [&] {
+			auto &[addr, name] = next();
+			AddrIndex::Location loc;
+			return index.lookup(addr, loc) && loc.symbol && name == loc.symbol->name;
+		});
+		bench("addr/linear", symbols, [&] {
+			auto &[addr, name] = next();
+			for (const auto &program: programs) {
+				if (addr < (size_t) program.memory || addr >= (size_t) program.memory + program.size) continue;
+				for (const auto &sym: file.getDynSym()) {
+					size_t start = sym.value + program.vaddr_offset();
+					if (sym.section && addr >= start && addr < start + sym.size) return name == sym.name;
+				}
+			}
+			return false;
+		});
+		
+		for (auto &program: programs) {
+			if (!index.remove(program)) printf("addr: remove FAILED\n");
+			release(program);
+		}
+		if (index.size()) printf("addr: index FAILED\n");
+		fclose(fd);
+	}
+}
+
+#ifdef ELFLOADER_PERFMAP
+// Benchmark adding and removing a program in a perf map, which rewrites the file each time.
+static void benchPerfMap() {
+	for (size_t symbols: {256, 4096}) {
+		elfgen::Options opt;
+		opt.symbols     = symbols;
+		opt.segmentSize = symbols * 16;
+		auto image      = elfgen::generate(opt);
+		FILE *fd        = elfgen::open(image);
+		ELFFile file;
+		parse(fd, file);
+		Program program = file.load(allocate);
+		
+		PerfMap perf("/tmp/elfloader-bench-" + std::to_string(getpid()) + ".map");
+		size_t lines = 0;
+		if (perf.add(file, program)) {
+			FILE *map = fopen(perf.getPath().c_str(), "r");
+			for (int c; map && (c = fgetc(map)) != EOF; ) lines += c == '\n';
+			if (map) fclose(map);
+			perf.remove(program);
+		}
+		bench("perfmap", symbols, [&] {
+			return lines == symbols && perf.add(file, program) && perf.remove(program);
+		});
+		unlink(perf.getPath().c_str());
+		release(program);
+		fclose(fd);
+	}
+}
+#endif
+
+// Benchmark applying dynamic relocations.
+static void benchRelocate() {
+	for (uint32_t type: {elfgen::R_RELATIVE, elfgen::R_JUMP_SLOT}) {
+		for (size_t relocs: {64, 1024, 16384}) {
+			elfgen::Options opt;
+			opt.segmentSize = 64 * 1024;
+			opt.relocs      = relocs;
+			opt.relocTypes  = { type };
+			opt.imports     = type == elfgen::R_RELATIVE ? 0 : 64;
+			auto image      = elfgen::generate(opt);
+			FILE *fd        = elfgen::open(image);
+			ELFFile file;
+			parse(fd, file);
+			Program program = file.load(allocate);
+			
+			SymMap map;
+			for (size_t i = 0; i < opt.imports; i++) map[elfgen::importName(i)] = 0x1000 + i * 16;
+			bench(type == elfgen::R_RELATIVE ? "relocate/relative" : "relocate/jump_slot", relocs, [&] {
+				return program && relocate(file, program, map);
+			});
+			release(program);
+			fclose(fd);
+		}
+	}
+}
+
+// Benchmark applying PLT relocations through call-counting thunks.
+static void benchProfile() {
+	for (size_t relocs: {64, 1024, 16384}) {
+		elfgen::Options opt;
+		opt.segmentSize = 64 * 1024;
+		opt.relocs      = relocs;
+		opt.relocTypes  = { elfgen::R_JUMP_SLOT };
+		opt.imports     = 64;
+		auto image      = elfgen::generate(opt);
+		FILE *fd        = elfgen::open(image);
+		ELFFile file;
+		parse(fd, file);
+		Program program = file.load(allocate);
+		
+		SymMap map;
+		for (size_t i = 0; i < opt.imports; i++) map[elfgen::importName(i)] = 0x1000 + i * 16;
+		CallProfile profile;
+		bool ok = profile.prepare(file, map, allocate) && profile.getSlots()->size() == opt.imports;
+		
+		// Every thunk must count in a counter of its own and then jump to the function it stands in for:
+		// auipc t0, 0; l[wd] t1, counter(t0); ...; l[wd] t1, target(t0); jr t1
+		auto imm  = [](uint32_t insn) -> SAddr { return (int32_t) insn >> 20; };
+		auto load = [](uint32_t insn) { return (insn & 0xf8fff) == (0x03 | 6 << 7 | 5 << 15); };
+		std::map<std::string, Addr> expected;
+		for (const auto &[name, thunk]: *profile.getSlots()) {
+			auto code = (const uint32_t *) thunk;
+			ok &= code[0] == 0x00000297 && load(code[1]) && load(code[5]) && code[6] == 0x00030067;
+			if (!ok) break;
+			Addr calls = expected.size() + 1;
+			*(Addr *) *(const Addr *) (thunk + imm(code[1])) += calls;
+			expected[name] = calls;
+			ok &= *(const Addr *) (thunk + imm(code[5])) == map[name];
+		}
+		for (const auto &count: profile.counts()) ok &= count.calls == expected[count.name];
+		profile.reset();
+		
+		// Every `R_JUMP_SLOT` must then point at the thunk of its import.
+		auto rela = file.findSect(".rela.dyn");
+		ok = ok && rela && relocate(file, program, map, profile.getSlots());
+		for (size_t i = 0; ok && i < relocs; i++) {
+			RelaEntry entry;
+			memcpy(&entry, image.data() + rela->offset + i * sizeof(RelaEntry), sizeof(RelaEntry));
+			const auto &name = file.getDynSym()[entry.symIndex()].name;
+			ok = *(Addr *) (entry.offset + program.vaddr_offset()) == profile.getSlots()->at(name);
+		}
+		if (!ok) printf("relocate/profiled: thunk mismatch\n");
+		
+		bench("relocate/profiled", relocs, [&] {
+			return ok && program && relocate(file, program, map, profile.getSlots());
+		});
+		profile.release(release);
+		release(program);
+		fclose(fd);
+	}
+}
+
+// Memory for relocatable objects, which must be within reach of PC-relative code from the functions they import.
+alignas(4096) static uint8_t arena[4 << 20];
+
+// Decode a `jal` or an `auipc` + `jalr` pair at `pc` and move `pc` past it.
+// Returns the target, or 0 if there is no jump at `pc`.
+static size_t decodeJump(const uint8_t *&pc) {
+	auto imm = [](uint32_t insn) -> SAddr { return (int32_t) insn >> 20; };
+	uint32_t insn = *(const uint32_t *) pc, next = *(const uint32_t *) (pc + 4);
+	size_t target = 0;
+	if ((insn & 0x7f) == 0x6f) {
+		// jal
+		SAddr off = (insn >> 31 ? (SAddr) -1 << 20 : 0) | (SAddr) ((insn >> 12 & 0xff) << 12 | (insn >> 20 & 1) << 11 | (insn >> 21 & 0x3ff) << 1);
+		target = (size_t) pc + off;
+		pc += 4;
+	} else if ((insn & 0x7f) == 0x17 && (next & 0x7f) == 0x67) {
+		// auipc + jalr
+		target = (size_t) pc + (SAddr) (int32_t) (insn & 0xfffff000) + imm(next);
+		pc += 8;
+	}
+	return target;
+}
+
+// Check that a call to `target` ends up at `expected`, directly or through a veneer.
+static bool callsTo(size_t target, size_t expected) {
+	if (target == expected) return true;
+	// auipc t1, 0; l[wd] t1, 16(t1); jr t1; nop; target
+	auto veneer = (const uint32_t *) target;
+	return target && veneer[0] == 0x00000317 && *(const size_t *) (target + 16) == expected;
+}
+
+// Benchmark rewriting PLT entries into direct jumps after relocating.
+static void benchPlt() {
+	for (size_t imports: {64, 1024}) {
+		elfgen::Options opt;
+		opt.segmentSize = 64 * 1024;
+		opt.relocs      = imports;
+		opt.relocTypes  = { elfgen::R_JUMP_SLOT };
+		opt.imports     = imports;
+		opt.plt         = true;
+		auto image      = elfgen::generate(opt);
+		FILE *fd        = elfgen::open(image);
+		ELFFile file;
+		parse(fd, file);
+		size_t header, entry = pltEntrySize(header);
+		auto plt = file.findSect(".plt");
+		
+		// Imports in reach of `jal`, of `auipc` + `jr` and out of direct reach of the program; none are called.
+		auto target = [&](const Program &program, size_t i) -> size_t {
+			size_t base = (size_t) program.memory;
+			return base + (i % 3 == 0 ? 64 : i % 3 == 1 ? 16 << 20 : (size_t) 8 << 30) + i * 16;
+		};
+		for (bool patch: {false, true}) {
+			bench(patch ? "plt/patched" : "plt/relocate", imports, [&] {
+				Program program = file.load(allocate);
+				SymMap map;
+				for (size_t i = 0; i < opt.imports; i++) map[elfgen::importName(i)] = target(program, i);
+				bool ok = program && plt && relocate(file, program, map);
+				if (ok && patch) {
+					ok = patchPlt(file, program) == imports - imports / 3;
+					// Entry `i` uses the slot of relocation `i`, which imports `i`.
+					for (size_t i = 0; ok && i < imports; i++) {
+						auto pc = (const uint8_t *) (plt->vaddr + program.vaddr_offset() + header + i * entry);
+						ok = i % 3 == 2 || decodeJump(pc) == target(program, i);
+					}
+				}
+				release(program);
+				return ok;
+			});
+		}
+		fclose(fd);
+	}
+}
+
+// Check the calls and table references in a relocatable object made by `elfgen::generateObject`.
+// Only the functions in `map` are checked, since the others may not have been loaded.
+static bool checkObject(const elfgen::ObjectOptions &opt, const SymMap &map) {
+	auto imm = [](uint32_t insn) -> SAddr { return (int32_t) insn >> 20; };
+	for (size_t i = 0; i < opt.functions; i++) {
+		if (!map.count(elfgen::functionName(i))) continue;
+		auto pc = (const uint8_t *) map.at(elfgen::functionName(i));
+		for (size_t c = 0; c < opt.calls; c++) {
+			if (!callsTo(decodeJump(pc), map.at(elfgen::calleeName(opt, i, c)))) return false;
+		}
+		// auipc + addi
+		uint32_t insn = *(const uint32_t *) pc, next = *(const uint32_t *) (pc + 4);
+		size_t addr = (size_t) pc + (SAddr) (int32_t) (insn & 0xfffff000) + imm(next);
+		if (!opt.functionSections && addr != map.at("table") + i * sizeof(Addr)) return false;
+		if (*(const uint32_t *) (pc + 8) != 0x00008067) return false;
+		if (*(const size_t *) addr != map.at(elfgen::functionName(i))) return false;
+	}
+	return true;
+}
+
+// Benchmark loading relocatable objects, with and without relaxing calls.
+static void benchObject() {
+	for (size_t functions: {64, 1024}) {
+		elfgen::ObjectOptions opt;
+		opt.functions = functions;
+		opt.imports   = 8;
+		auto image    = elfgen::generateObject(opt);
+		FILE *fd      = elfgen::open(image);
+		ELFFile file(fd);
+		file.read();
+		
+		// Imports are out of reach of `jal`, calls within the object are not.
+		SymMap imports;
+		for (size_t i = 0; i < opt.imports; i++) imports[elfgen::importName(i)] = (size_t) arena + i * 16;
+		auto alloc = [](size_t, size_t len, size_t) {
+			return std::pair<size_t, size_t>(len <= sizeof(arena) / 2 ? (size_t) arena + sizeof(arena) / 2 : 0, 0);
+		};
+		
+		for (bool relax: {false, true}) {
+			bench(relax ? "object/relaxed" : "object/load", functions, [&] {
+				RelObject obj(file);
+				obj.relax   = relax;
+				Program out = obj.load(alloc, imports);
+				SymMap map  = imports;
+				return out && obj.exportSymbols(map) && checkObject(opt, map);
+			});
+		}
+		
+		// Imports too far away to call directly, which are never called here, so need not exist.
+		SymMap farImports;
+		for (size_t i = 0; i < opt.imports; i++) farImports[elfgen::importName(i)] = (size_t) arena + ((size_t) 8 << 30) + i * 16;
+		bench("object/veneers", functions, [&] {
+			RelObject obj(file);
+			Program out = obj.load(alloc, farImports);
+			SymMap map  = farImports;
+			return out && obj.veneers.size() == opt.imports && obj.exportSymbols(map) && checkObject(opt, map);
+		});
+		fclose(fd);
+		
+		// A quarter of the functions in sections of their own are used, by a single root.
+		opt.functionSections = true;
+		opt.used = functions / 4;
+		image    = elfgen::generateObject(opt);
+		fd       = elfgen::open(image);
+		ELFFile sectFile(fd);
+		sectFile.read();
+		size_t sizes[2] = {};
+		for (bool gc: {false, true}) {
+			bench(gc ? "object/gc" : "object/sections", functions, [&] {
+				RelObject obj(sectFile);
+				obj.gcSections = gc;
+				obj.roots      = {elfgen::functionName(0)};
+				Program out    = obj.load(alloc, imports);
+				SymMap map     = imports;
+				sizes[gc]      = out.size;
+				return out && obj.exportSymbols(map) && map.count(elfgen::functionName(0)) && checkObject(opt, map);
+			});
+		}
+		if (sizes[0]) printf("%-24s %8zu  %12zu of %zu bytes\n", "object/gc", functions, sizes[1], sizes[0]);
+		
+		// Every eighth function and what it calls are hot; ordering by profile puts them together.
+		std::vector<RelObject::CallEdge> profile;
+		for (size_t i = 0; i < functions; i += 8) {
+			for (size_t c = 0; c < opt.calls; c++) {
+				if (opt.imports && c % 4 == 3) continue;
+				profile.push_back({elfgen::functionName(i), elfgen::calleeName(opt, i, c), functions - i});
+			}
+		}
+		size_t spans[2] = {};
+		for (bool ordered: {false, true}) {
+			bench(ordered ? "object/ordered" : "object/unordered", functions, [&] {
+				RelObject obj(sectFile);
+				if (ordered) obj.profile = profile;
+				Program out = obj.load(alloc, imports);
+				SymMap map  = imports;
+				if (!out || !obj.exportSymbols(map) || !checkObject(opt, map)) return false;
+				size_t low = SIZE_MAX, high = 0;
+				for (const auto &edge: profile) {
+					for (auto name: {&edge.caller, &edge.callee}) {
+						low  = std::min(low, map.at(*name));
+						high = std::max(high, map.at(*name));
+					}
+				}
+				spans[ordered] = high - low;
+				return true;
+			});
+		}
+		if (spans[0]) printf("%-24s %8zu  %12zu of %zu bytes hot\n", "object/ordered", functions, spans[1], spans[0]);
+		fclose(fd);
+	}
+}
+
+// Benchmark loading segments into memory.
+static void benchLoad() {
+	for (size_t segments: {2, 8, 32}) {
+		elfgen::Options opt;
+		opt.segments = segments;
+		auto image   = elfgen::generate(opt);
+		FILE *fd     = elfgen::open(image);
+		ELFFile file;
+		parse(fd, file);
+		
+		bench("load", segments, [&] {
+			Program program = file.load(allocate);
+			bool ok = program;
+			release(program);
+			return ok;
+		});
+		
+		// Parsing and loading together, with and without coalesced reads.
+		bench("load/read_dyn", segments, [&] {
+			ELFFile file;
+			if (!parse(fd, file)) return false;
+			Program program = file.load(allocate);
+			bool ok = program && relocate(file, program, {});
+			release(program);
+			return ok;
+		});
+		bench("load/coalesced", segments, [&] {
+			fseek(fd, 0, SEEK_SET);
+			ELFFile file(fd);
+			Program program = file.loadDyn(allocate);
+			bool ok = program && file.isValid() && relocate(file, program, {});
+			release(program);
+			return ok;
+		});
+		fclose(fd);
+		
+#ifdef ELFLOADER_ASYNC
+		// Background loading needs a real file descriptor.
+		FILE *tmp = tmpfile();
+		fwrite(image.data(), 1, image.size(), tmp);
+		fflush(tmp);
+		bench("load/async", segments, [&] {
+			fseek(tmp, 0, SEEK_SET);
+			ELFFile file(tmp);
+			Program program = file.loadAsync(allocate).get();
+			bool ok = program && file.isValid() && relocate(file, program, {});
+			release(program);
+			return ok;
+		});
+		fclose(tmp);
+#endif
+	}
+}
+
+// Benchmark planning MPU regions for a fixed entry budget.
+static void benchPlan() {
+	for (size_t count: {16, 64, 256}) {
+		// Runs of three contiguous regions with alternating permissions.
+		std::vector<mpu::Region> regions;
+		uint64_t addr = 0x10000;
+		for (size_t i = 0; i < count; i++) {
+			mpu::Region region = {};
+			region.base  = addr;
+			region.size  = 0x1000 * (1 + i % 3);
+			region.read  = true;
+			region.write = i % 2;
+			region.exec  = !(i % 2);
+			regions.push_back(region);
+			addr += region.size + (i % 3 == 2) * 0x1000;
+		}
+		// Enough entries for one two-entry region per run, plus a few.
+		int budget = (count / 3 + 1) * 2 + 2;
+		bench("mpu/plan", count, [&] {
+			return !mpu::planRegions(regions, budget).empty();
+		});
+	}
+}
+
+#ifdef ELFLOADER_PMP_SIM
+// Benchmark programming the simulated PMP from section headers.
+static void benchApply() {
+	for (size_t segments: {2, 8, 32}) {
+		elfgen::Options opt;
+		opt.segments = segments;
+		auto image   = elfgen::generate(opt);
+		FILE *fd     = elfgen::open(image);
+		ELFFile file;
+		parse(fd, file);
+		Program program = file.load(allocate);
+		
+		bench("mpu/apply_sect", segments, [&] {
+			mpu::pmpsim::configure(16);
+			return program && mpu::applySect(file, program);
+		});
+		release(program);
+		fclose(fd);
+	}
+}
+#endif
+
+
+// Print the stdio calls made loading a typical image, with and without coalesced reads.
+static void ioReport() {
+	elfgen::Options opt;
+	opt.segments = 4;
+	opt.symbols  = 64;
+	opt.relocs   = 64;
+	auto image   = elfgen::generate(opt);
+	FILE *fd     = elfgen::open(image);
+	
+	for (bool coalesced: {false, true}) {
+		fseek(fd, 0, SEEK_SET);
+		LoadStats stats;
+		stats.recordIO = true;
+		ELFFile file(fd, &stats);
+		Program program;
+		if (coalesced) {
+			program = file.loadDyn(allocate);
+		} else {
+			file.readDyn();
+			program = file.load(allocate);
+		}
+		if (program) relocate(file, program, {});
+		
+		printf("%s%s:\n", coalesced ? "\n" : "", coalesced ? "loadDyn" : "readDyn + load");
+		stats.printIOReport();
+		release(program);
+	}
+	
+	fclose(fd);
+}
+
+
+int main(int argc, char **argv) {
+	if (argc > 1 && !strcmp(argv[1], "--io")) {
+		ioReport();
+		return 0;
+	}
+	if (argc > 1) filter = argv[1];
+	
+	benchParse();
+	benchCache();
+	benchFastload();
+	benchSnapshot();
+	benchLookup();
+	benchAddr();
+#ifdef ELFLOADER_PERFMAP
+	benchPerfMap();
+#endif
+	benchRelocate();
+	benchProfile();
+	benchPlt();
+	benchLoad();
+	benchObject();
+	benchDeps();
+	benchPlan();
+#ifdef ELFLOADER_PMP_SIM
+	benchApply();
+#endif
+	
+	return 0;
+}
@@ -0,0 +1,584 @@
+/*
+	MIT License
+
+	Copyright (c) 2023 Julian Scheffers
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy
+	of this software and associated documentation files (the "Software"), to deal
+	in the Software without restriction, including without limitation the rights
+	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+	copies of the Software, and to permit persons to whom the Software is
+	furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+
+
+#include "elfwriter.hpp"
+
+#include <algorithm>
+#include <map>
+
+using namespace elf;
+
+namespace elfgen {
+
+// Extension types used by the writer.
+static const uint32_t SHT_GNU_HASH = 0x6ffffff6;
+static const Addr     DT_GNU_HASH  = 0x6ffffef5;
+// Segment alignment.
+static const Addr     PAGE         = 0x1000;
+
+// Round up to a multiple of `align`.
+static size_t alignUp(size_t value, size_t align) {
+	return (value + align - 1) / align * align;
+}
+
+// Append the raw bytes of an object.
+template<typename T>
+static void put(std::vector<uint8_t> &out, const T &obj) {
+	auto ptr = (const uint8_t *) &obj;
+	out.insert(out.end(), ptr, ptr + sizeof(T));
+}
+
+// Pad with zeroes to a multiple of `align`.
+static void padTo(std::vector<uint8_t> &out, size_t align) {
+	out.resize(alignUp(out.size(), align), 0);
+}
+
+
+
+// Get the name of a defined symbol.
+std::string symbolName(size_t index, const std::string &prefix) {
+	return prefix + std::to_string(index);
+}
+
+// Get the name of an imported symbol.
+std::string importName(size_t index, const std::string &prefix) {
+	return prefix + std::to_string(index);
+}
+
+// Compute the GNU hash of a symbol name.
+uint32_t gnuHash(const char *name) {
+	uint32_t h = 5381;
+	for (; *name; name++) {
+		h = h * 33 + (uint8_t) *name;
+	}
+	return h;
+}
+
+
+
+// A dynamic symbol to be written.
+struct Sym {
+	std::string name;
+	uint32_t    hash;
+	// Index of the defined symbol, or SIZE_MAX for imports.
+	size_t      defined;
+};
+
+// A section header to be written, with its name.
+struct Sect {
+	std::string name;
+	SectHeader  header;
+};
+
+// Generate an ELF image.
+std::vector<uint8_t> generate(const Options &opt) {
+	size_t nseg    = opt.segments ? opt.segments : 1;
+	size_t segSize = alignUp(opt.segmentSize ? opt.segmentSize : sizeof(Addr), sizeof(Addr));
+	
+	// Symbol order: null, imports, then definitions grouped by hash bucket.
+	std::vector<Sym> syms;
+	syms.push_back({"", 0, SIZE_MAX});
+	for (size_t i = 0; i < opt.imports; i++) {
+		auto name = importName(i, opt.importPrefix);
+		syms.push_back({name, gnuHash(name.c_str()), SIZE_MAX});
+	}
+	size_t symOffset = syms.size();
+	uint32_t nbuckets = opt.symbols / 4 + 1;
+	for (size_t i = 0; i < opt.symbols; i++) {
+		auto name = symbolName(i, opt.symbolPrefix);
+		syms.push_back({name, gnuHash(name.c_str()), i});
+	}
+	if (opt.gnuHash) {
+		std::stable_sort(syms.begin() + symOffset, syms.end(), [&](const Sym &a, const Sym &b) {
+			return a.hash % nbuckets < b.hash % nbuckets;
+		});
+	}
+	
+	// Dynamic string table.
+	std::vector<char> dynstr(1, 0);
+	std::vector<uint32_t> nameIndex;
+	for (const auto &sym: syms) {
+		if (sym.name.empty()) {
+			nameIndex.push_back(0);
+			continue;
+		}
+		nameIndex.push_back(dynstr.size());
+		dynstr.insert(dynstr.end(), sym.name.begin(), sym.name.end());
+		dynstr.push_back(0);
+	}
+	std::vector<uint32_t> neededIndex;
+	for (const auto &lib: opt.needed) {
+		neededIndex.push_back(dynstr.size());
+		dynstr.insert(dynstr.end(), lib.begin(), lib.end());
+		dynstr.push_back(0);
+	}
+	
+	// GNU hash table.
+	std::vector<uint8_t> gnuHashData;
+	if (opt.gnuHash) {
+		const uint32_t bits  = sizeof(Addr) * 8;
+		uint32_t bloomSize   = 1;
+		while (bloomSize * bits < opt.symbols * 2) bloomSize <<= 1;
+		const uint32_t shift = 6;
+		
+		std::vector<Addr>     bloom(bloomSize, 0);
+		std::vector<uint32_t> buckets(nbuckets, 0);
+		std::vector<uint32_t> chain(syms.size() - symOffset, 0);
+		for (size_t i = symOffset; i < syms.size(); i++) {
+			uint32_t h = syms[i].hash;
+			bloom[(h / bits) % bloomSize] |= (Addr) 1 << (h % bits) | (Addr) 1 << ((h >> shift) % bits);
+			if (!buckets[h % nbuckets]) buckets[h % nbuckets] = i;
+			bool last = i + 1 == syms.size() || syms[i+1].hash % nbuckets != h % nbuckets;
+			chain[i - symOffset] = (h & ~1u) | last;
+		}
+		
+		put(gnuHashData, nbuckets);
+		put(gnuHashData, (uint32_t) symOffset);
+		put(gnuHashData, bloomSize);
+		put(gnuHashData, shift);
+		for (auto word: bloom) put(gnuHashData, word);
+		for (auto bucket: buckets) put(gnuHashData, bucket);
+		for (auto link: chain) put(gnuHashData, link);
+	}
+	
+	// Lay out the metadata segment.
+	size_t phnum     = nseg + 2;
+	size_t phOffset  = sizeof(Header);
+	size_t symOff    = alignUp(phOffset + phnum * sizeof(ProgHeader), 8);
+	size_t strOff    = symOff + syms.size() * sizeof(SymEntry);
+	size_t hashOff   = alignUp(strOff + dynstr.size(), 8);
+	size_t relaOff   = alignUp(hashOff + gnuHashData.size(), 8);
+	size_t dynOff    = alignUp(relaOff + opt.relocs * sizeof(RelaEntry), 8);
+	size_t dynCount  = (opt.gnuHash ? 9 : 8) + opt.needed.size();
+	size_t metaEnd   = dynOff + dynCount * sizeof(DynEntry);
+	
+	// Lay out the data segments; even ones are code, odd ones are data.
+	size_t dataOff   = alignUp(metaEnd, PAGE);
+	size_t segStride = alignUp(segSize, PAGE);
+	auto segAddr = [&](size_t i) -> Addr { return dataOff + i * segStride; };
+	size_t dataEnd   = dataOff + nseg * segStride;
+	
+	// Section indices.
+	size_t shDynsym  = 1;
+	size_t shDynstr  = 2;
+	size_t shHash    = 3;
+	size_t shRela    = opt.gnuHash ? 4 : 3;
+	size_t shDynamic = shRela + 1;
+	size_t shData    = shDynamic + 1;
+	
+	// Start writing the image after the headers; they are filled in last.
+	std::vector<uint8_t> out(symOff, 0);
+	
+	// `.dynsym`.
+	for (size_t i = 0; i < syms.size(); i++) {
+		SymEntry ent = {};
+		ent.name_index = nameIndex[i];
+		if (i) ent.info = (int) STB::GLOBAL << 4 | (int) STT::FUNC;
+		if (syms[i].defined != SIZE_MAX) {
+			ent.value   = segAddr(0) + syms[i].defined * 16 % segSize;
+			ent.size    = 16;
+			ent.section = shData;
+		}
+		put(out, ent);
+	}
+	
+	// `.dynstr`.
+	out.insert(out.end(), dynstr.begin(), dynstr.end());
+	padTo(out, 8);
+	
+	// `.gnu.hash`.
+	out.insert(out.end(), gnuHashData.begin(), gnuHashData.end());
+	padTo(out, 8);
+	
+	// `.rela.dyn`; relocations patch pointer-sized words in the data segments.
+	std::vector<Addr> pltSlots;
+	std::vector<size_t> rwSegs;
+	for (size_t i = 1; i < nseg; i += 2) rwSegs.push_back(i);
+	if (rwSegs.empty()) rwSegs.push_back(0);
+	size_t words = segSize / sizeof(Addr);
+	for (size_t i = 0; i < opt.relocs; i++) {
+		uint32_t type = opt.relocTypes.empty() ? R_RELATIVE : opt.relocTypes[i % opt.relocTypes.size()];
+		size_t   seg  = rwSegs[(i / words) % rwSegs.size()];
+		
+		// Pick a symbol; imports first, then definitions.
+		uint32_t sym = 0;
+		if (type != R_RELATIVE) {
+			if (opt.imports) sym = 1 + i % opt.imports;
+			else if (opt.symbols) sym = symOffset + i % opt.symbols;
+		}
+		
+		RelaEntry ent;
+		ent.offset = segAddr(seg) + (i % words) * sizeof(Addr);
+		#ifdef ELFLOADER_ELF_IS_ELF64
+		ent.info   = (Addr) sym << 32 | type;
+		#else
+		ent.info   = (Addr) sym << 8 | type;
+		#endif
+		ent.addend = type == R_RELATIVE ? segAddr(0) : 0;
+		put(out, ent);
+		if (type == R_JUMP_SLOT) pltSlots.push_back(ent.offset);
+	}
+	padTo(out, 8);
+	
+	// `.dynamic`.
+	auto putDyn = [&](Addr tag, Addr value) { put(out, DynEntry{tag, value}); };
+	for (auto index: neededIndex) putDyn((Addr) DT::NEEDED, index);
+	putDyn((Addr) DT::SYMTAB,  symOff);
+	putDyn((Addr) DT::STRTAB,  strOff);
+	putDyn((Addr) DT::STRSZ,   dynstr.size());
+	putDyn((Addr) DT::SYMENT,  sizeof(SymEntry));
+	putDyn((Addr) DT::RELA,    relaOff);
+	putDyn((Addr) DT::RELASZ,  opt.relocs * sizeof(RelaEntry));
+	putDyn((Addr) DT::RELAENT, sizeof(RelaEntry));
+	if (opt.gnuHash) putDyn(DT_GNU_HASH, hashOff);
+	putDyn((Addr) DT::DT_NULL, 0);
+	
+	// Data segments.
+	out.resize(dataOff, 0);
+	for (size_t i = 0; i < nseg; i++) {
+		out.resize(segAddr(i), 0);
+		out.resize(segAddr(i) + segSize, i % 2 ? 0x00 : 0x13);
+	}
+	out.resize(dataEnd, 0);
+	
+	// `.plt`: a header, then `auipc t3, slot; l[wd] t3, slot(t3); jalr t1, t3; nop` for every slot.
+	const size_t pltHeader = 32, pltEntry = 16;
+	size_t pltSize = 0;
+	if (opt.plt && segSize >= pltHeader) {
+		size_t entries = std::min(pltSlots.size(), (segSize - pltHeader) / pltEntry);
+		pltSize = pltHeader + entries * pltEntry;
+		for (size_t i = 0; i < entries; i++) {
+			Addr     pc     = segAddr(0) + pltHeader + i * pltEntry;
+			Addr     dist   = pltSlots[i] - pc;
+			uint32_t funct3 = sizeof(Addr) == 8 ? 3 : 2;
+			const uint32_t code[] = {
+				0x00000e17 | (uint32_t) ((dist + 0x800) & 0xfffff000),
+				0x000e0e03 | funct3 << 12 | (uint32_t) (dist & 0xfff) << 20,
+				0x000e0367,
+				0x00000013,
+			};
+			memcpy(out.data() + pc, code, sizeof(code));
+		}
+	}
+	
+	// Section headers.
+	std::vector<Sect> sects;
+	auto addSect = [&](std::string name, uint32_t type, Addr flags, Addr addr, Addr size, uint32_t link, uint32_t info, Addr align, Addr entsize) {
+		SectHeader sh = {};
+		sh.type       = type;
+		sh.flags      = flags;
+		sh.vaddr      = addr;
+		sh.offset     = addr;
+		sh.file_size  = size;
+		sh.link       = link;
+		sh.info       = info;
+		sh.alignment  = align;
+		sh.entry_size = entsize;
+		sects.push_back({name, sh});
+	};
+	Addr A  = (Addr) SHF::ALLOC;
+	Addr WA = (Addr) SHF::ALLOC | (Addr) SHF::WRITE;
+	Addr AX = (Addr) SHF::ALLOC | (Addr) SHF::EXECINSTR;
+	addSect("", 0, 0, 0, 0, 0, 0, 0, 0);
+	addSect(".dynsym", (uint32_t) SHT::DYNSYM, A, symOff, syms.size() * sizeof(SymEntry), shDynstr, symOffset, 8, sizeof(SymEntry));
+	addSect(".dynstr", (uint32_t) SHT::STRTAB, A, strOff, dynstr.size(), 0, 0, 1, 0);
+	if (opt.gnuHash) {
+		addSect(".gnu.hash", SHT_GNU_HASH, A, hashOff, gnuHashData.size(), shDynsym, 0, 8, 0);
+	}
+	addSect(".rela.dyn", (uint32_t) SHT::RELA, A, relaOff, opt.relocs * sizeof(RelaEntry), shDynsym, 0, 8, sizeof(RelaEntry));
+	addSect(".dynamic", (uint32_t) SHT::DYNAMIC, WA, dynOff, dynCount * sizeof(DynEntry), shDynstr, 0, 8, sizeof(DynEntry));
+	for (size_t i = 0; i < nseg; i++) {
+		auto name = (i % 2 ? ".data." : ".text.") + std::to_string(i);
+		addSect(name, (uint32_t) SHT::PROGBITS, i % 2 ? WA : AX, segAddr(i), segSize, 0, 0, 16, 0);
+	}
+	if (pltSize) {
+		addSect(".plt", (uint32_t) SHT::PROGBITS, AX, segAddr(0), pltSize, 0, 0, 16, 16);
+	}
+	(void) shHash;
+	
+	// Section name table.
+	size_t shstrOff = out.size();
+	addSect(".shstrtab", (uint32_t) SHT::STRTAB, 0, shstrOff, 0, 0, 0, 1, 0);
+	out.push_back(0);
+	for (auto &sect: sects) {
+		if (sect.name.empty()) continue;
+		sect.header.name_index = out.size() - shstrOff;
+		out.insert(out.end(), sect.name.begin(), sect.name.end());
+		out.push_back(0);
+	}
+	sects.back().header.vaddr     = 0;
+	sects.back().header.file_size = out.size() - shstrOff;
+	padTo(out, 8);
+	size_t shOffset = out.size();
+	for (const auto &sect: sects) put(out, sect.header);
+	
+	// Program headers.
+	std::vector<ProgHeader> progs;
+	auto addProg = [&](uint32_t type, uint32_t flags, Addr addr, Addr size, Addr align) {
+		ProgHeader ph = {};
+		ph.type      = type;
+		ph.flags     = flags;
+		ph.offset    = addr;
+		ph.vaddr     = addr;
+		ph.paddr     = addr;
+		ph.file_size = size;
+		ph.mem_size  = size;
+		ph.alignment = align;
+		progs.push_back(ph);
+	};
+	addProg((uint32_t) PT::LOAD, 0x4, 0, metaEnd, PAGE);
+	for (size_t i = 0; i < nseg; i++) {
+		addProg((uint32_t) PT::LOAD, i % 2 ? 0x6 : 0x5, segAddr(i), segSize, PAGE);
+	}
+	addProg((uint32_t) PT::DYNAMIC, 0x6, dynOff, dynCount * sizeof(DynEntry), 8);
+	memcpy(out.data() + phOffset, progs.data(), progs.size() * sizeof(ProgHeader));
+	
+	// ELF header.
+	Header hdr = {};
+	memcpy(hdr.magic, magic, 4);
+	#ifdef ELFLOADER_ELF_IS_ELF64
+	hdr.wordSize   = 2;
+	#else
+	hdr.wordSize   = 1;
+	#endif
+	hdr.endianness = 1;
+	hdr.version    = 1;
+	hdr.type       = (uint16_t) ET::DYN;
+	hdr.machine    = opt.machine;
+	hdr.version2   = 1;
+	hdr.entry      = segAddr(0);
+	hdr.phOffset   = phOffset;
+	hdr.shOffset   = shOffset;
+	hdr.size       = sizeof(Header);
+	hdr.phEntSize  = sizeof(ProgHeader);
+	hdr.phEntNum   = progs.size();
+	hdr.shEntSize  = sizeof(SectHeader);
+	hdr.shEntNum   = sects.size();
+	hdr.shStrIndex = sects.size() - 1;
+	memcpy(out.data(), &hdr, sizeof(Header));
+	
+	return out;
+}
+
+// Get the name of a function defined by a relocatable object.
+std::string functionName(size_t index) {
+	return "fn" + std::to_string(index);
+}
+
+// Get the name of the function that call `call` of function `index` goes to.
+std::string calleeName(const ObjectOptions &opt, size_t index, size_t call) {
+	if (opt.imports && call % 4 == 3) return importName((index + call / 4) % opt.imports);
+	size_t range = opt.used && index < opt.used ? opt.used : opt.functions;
+	return functionName((index * 7 + call + 1) % range);
+}
+
+// Generate a relocatable object.
+std::vector<uint8_t> generateObject(const ObjectOptions &opt) {
+	// Section indices: code sections, data sections, each followed by its relocations, then the symbol table.
+	const size_t   chunks   = opt.functionSections ? opt.functions : 1;
+	const uint32_t shSymtab = 1 + 4 * chunks, shStrtab = shSymtab + 1;
+	auto shText = [&](size_t fn) { return (uint16_t) (1 + 2 * (opt.functionSections ? fn : 0)); };
+	auto shData = [&](size_t fn) { return (uint16_t) (1 + 2 * chunks + 2 * (opt.functionSections ? fn : 0)); };
+	
+	// Symbols: null, local labels and table slots, then functions, the table and imports.
+	std::vector<SymEntry> syms(1 + opt.functions);
+	std::vector<std::string> names(1 + opt.functions);
+	for (size_t i = 0; i < opt.functions; i++) {
+		names[1 + i] = ".Lpcrel" + std::to_string(i);
+		syms[1 + i].section = shText(i);
+	}
+	// Symbol and addend the table entry of a function is referred to by.
+	std::vector<std::pair<uint32_t, Addr>> slots;
+	if (opt.functionSections) {
+		for (size_t i = 0; i < opt.functions; i++) {
+			SymEntry ent = {};
+			ent.info     = (int) STB::LOCAL << 4 | (int) STT::OBJECT;
+			ent.section  = shData(i);
+			ent.size     = sizeof(Addr);
+			slots.emplace_back(syms.size(), 0);
+			syms.push_back(ent);
+			names.push_back("slot" + std::to_string(i));
+		}
+	}
+	uint32_t firstGlobal = syms.size();
+	auto addGlobal = [&](std::string name, int type, uint16_t section) {
+		SymEntry ent = {};
+		ent.info     = (int) STB::GLOBAL << 4 | type;
+		ent.section  = section;
+		syms.push_back(ent);
+		names.push_back(std::move(name));
+		return (uint32_t) syms.size() - 1;
+	};
+	std::map<std::string, uint32_t> symIndex;
+	for (size_t i = 0; i < opt.functions; i++) {
+		symIndex[functionName(i)] = addGlobal(functionName(i), (int) STT::FUNC, shText(i));
+	}
+	if (!opt.functionSections) {
+		uint32_t table = addGlobal("table", (int) STT::OBJECT, shData(0));
+		syms[table].size = opt.functions * sizeof(Addr);
+		for (size_t i = 0; i < opt.functions; i++) slots.emplace_back(table, i * sizeof(Addr));
+	}
+	for (size_t i = 0; i < opt.imports; i++) {
+		symIndex[importName(i)] = addGlobal(importName(i), (int) STT::NOTYPE, 0);
+	}
+	
+	// Code and its relocations.
+	std::vector<std::vector<uint8_t>> texts(chunks);
+	std::vector<std::vector<RelaEntry>> textRelocs(chunks);
+	auto reloc = [&](std::vector<RelaEntry> &out, Addr offset, uint32_t sym, uint32_t type, SAddr addend) {
+		RelaEntry ent;
+		ent.offset = offset;
+		#ifdef ELFLOADER_ELF_IS_ELF64
+		ent.info   = (Addr) sym << 32 | type;
+		#else
+		ent.info   = (Addr) sym << 8 | type;
+		#endif
+		ent.addend = addend;
+		out.push_back(ent);
+	};
+	for (size_t i = 0; i < opt.functions; i++) {
+		auto &text   = texts[opt.functionSections ? i : 0];
+		auto &relocs = textRelocs[opt.functionSections ? i : 0];
+		auto insn    = [&](uint32_t value) { put(text, value); };
+		if (opt.align > 4) {
+			reloc(relocs, text.size(), 0, R_ALIGN, opt.align - 4);
+			for (size_t j = 0; j < opt.align - 4; j += 4) insn(0x00000013);
+		}
+		auto &fn = syms[symIndex[functionName(i)]];
+		fn.value = text.size();
+		for (size_t c = 0; c < opt.calls; c++) {
+			reloc(relocs, text.size(), symIndex[calleeName(opt, i, c)], R_CALL_PLT, 0);
+			reloc(relocs, text.size(), 0, R_RELAX, 0);
+			insn(0x00000097); // auipc ra, 0
+			insn(0x000080e7); // jalr  ra, 0(ra)
+		}
+		syms[1 + i].value = text.size();
+		reloc(relocs, text.size(), slots[i].first, R_PCREL_HI20, slots[i].second);
+		reloc(relocs, text.size(), 0, R_RELAX, 0);
+		insn(0x00000517); // auipc a0, 0
+		reloc(relocs, text.size(), 1 + i, R_PCREL_LO12_I, 0);
+		reloc(relocs, text.size(), 0, R_RELAX, 0);
+		insn(0x00050513); // addi  a0, a0, 0
+		insn(0x00008067); // ret
+		fn.size = text.size() - fn.value;
+	}
+	
+	// Data: the table of functions.
+	std::vector<std::vector<RelaEntry>> dataRelocs(chunks);
+	for (size_t i = 0; i < opt.functions; i++) {
+		auto &relocs = dataRelocs[opt.functionSections ? i : 0];
+		reloc(relocs, opt.functionSections ? 0 : i * sizeof(Addr), symIndex[functionName(i)], sizeof(Addr) == 8 ? R_ABS64 : R_ABS32, 0);
+	}
+	
+	// String tables.
+	std::vector<char> strtab(1, 0);
+	for (size_t i = 1; i < syms.size(); i++) {
+		syms[i].name_index = strtab.size();
+		strtab.insert(strtab.end(), names[i].begin(), names[i].end());
+		strtab.push_back(0);
+	}
+	
+	// Section contents, after the ELF header.
+	std::vector<uint8_t> out(sizeof(Header), 0);
+	std::vector<Sect> sects(1);
+	auto addSect = [&](std::string name, uint32_t type, Addr flags, const void *data, size_t size, uint32_t link, uint32_t info, Addr align, Addr entsize) {
+		padTo(out, align);
+		SectHeader sh = {};
+		sh.type       = type;
+		sh.flags      = flags;
+		sh.offset     = out.size();
+		sh.file_size  = size;
+		sh.link       = link;
+		sh.info       = info;
+		sh.alignment  = align;
+		sh.entry_size = entsize;
+		out.insert(out.end(), (const uint8_t *) data, (const uint8_t *) data + size);
+		sects.push_back({name, sh});
+	};
+	std::vector<uint8_t> data(opt.functions * sizeof(Addr) / chunks, 0);
+	Addr WA = (Addr) SHF::ALLOC | (Addr) SHF::WRITE;
+	Addr AX = (Addr) SHF::ALLOC | (Addr) SHF::EXECINSTR;
+	auto suffix = [&](size_t i) { return opt.functionSections ? "." + functionName(i) : std::string(); };
+	for (size_t i = 0; i < chunks; i++) {
+		addSect(".text" + suffix(i), (uint32_t) SHT::PROGBITS, AX, texts[i].data(), texts[i].size(), 0, 0, std::max<size_t>(opt.align, 4), 0);
+		addSect(".rela.text" + suffix(i), (uint32_t) SHT::RELA, 0, textRelocs[i].data(), textRelocs[i].size() * sizeof(RelaEntry), shSymtab, shText(i), 8, sizeof(RelaEntry));
+	}
+	for (size_t i = 0; i < chunks; i++) {
+		addSect(".data" + suffix(i), (uint32_t) SHT::PROGBITS, WA, data.data(), data.size(), 0, 0, sizeof(Addr), 0);
+		addSect(".rela.data" + suffix(i), (uint32_t) SHT::RELA, 0, dataRelocs[i].data(), dataRelocs[i].size() * sizeof(RelaEntry), shSymtab, shData(i), 8, sizeof(RelaEntry));
+	}
+	addSect(".symtab", (uint32_t) SHT::SYMTAB, 0, syms.data(), syms.size() * sizeof(SymEntry), shStrtab, firstGlobal, 8, sizeof(SymEntry));
+	addSect(".strtab", (uint32_t) SHT::STRTAB, 0, strtab.data(), strtab.size(), 0, 0, 1, 0);
+	
+	// Section name table.
+	std::vector<char> shstrtab(1, 0);
+	for (auto &sect: sects) {
+		if (sect.name.empty()) continue;
+		sect.header.name_index = shstrtab.size();
+		shstrtab.insert(shstrtab.end(), sect.name.begin(), sect.name.end());
+		shstrtab.push_back(0);
+	}
+	sects.push_back({".shstrtab", {}});
+	sects.back().header.name_index = shstrtab.size();
+	const char shstrName[] = ".shstrtab";
+	shstrtab.insert(shstrtab.end(), shstrName, shstrName + sizeof(shstrName));
+	sects.back().header.type       = (uint32_t) SHT::STRTAB;
+	sects.back().header.offset     = out.size();
+	sects.back().header.file_size  = shstrtab.size();
+	sects.back().header.alignment  = 1;
+	out.insert(out.end(), shstrtab.begin(), shstrtab.end());
+	padTo(out, 8);
+	size_t shOffset = out.size();
+	for (const auto &sect: sects) put(out, sect.header);
+	
+	// ELF header.
+	Header hdr = {};
+	memcpy(hdr.magic, magic, 4);
+	#ifdef ELFLOADER_ELF_IS_ELF64
+	hdr.wordSize   = 2;
+	#else
+	hdr.wordSize   = 1;
+	#endif
+	hdr.endianness = 1;
+	hdr.version    = 1;
+	hdr.type       = (uint16_t) ET::REL;
+	hdr.machine    = opt.machine;
+	hdr.version2   = 1;
+	hdr.shOffset   = shOffset;
+	hdr.size       = sizeof(Header);
+	hdr.shEntSize  = sizeof(SectHeader);
+	hdr.shEntNum   = sects.size();
+	hdr.shStrIndex = sects.size() - 1;
+	memcpy(out.data(), &hdr, sizeof(Header));
+	
+	return out;
+}
+
+// Open an ELF image as a read-only stream.
+FILE *open(const std::vector<uint8_t> &image) {
+	return fmemopen((void *) image.data(), image.size(), "rb");
+}
+
+} // namespace elfgen
@@ -0,0 +1,120 @@
+/*
+	MIT License
+
+	Copyright (c) 2023 Julian Scheffers
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy
+	of this software and associated documentation files (the "Software"), to deal
+	in the Software without restriction, including without limitation the rights
+	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+	copies of the Software, and to permit persons to whom the Software is
+	furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <vector>
+#include <string>
+
+#include "elfloader.hpp"
+
+// Writer for synthetic ELF shared objects, used to benchmark the loader.
+// Images are generated for the host's word size, endianness and machine type.
+namespace elfgen {
+
+// RISC-V relocation types, as understood by the loader's relocation backend.
+static const uint32_t R_ABS32     = 1;
+static const uint32_t R_ABS64     = 2;
+static const uint32_t R_RELATIVE  = 3;
+static const uint32_t R_JUMP_SLOT = 5;
+static const uint32_t R_CALL_PLT  = 19;
+static const uint32_t R_PCREL_HI20   = 23;
+static const uint32_t R_PCREL_LO12_I = 24;
+static const uint32_t R_ALIGN     = 43;
+static const uint32_t R_RELAX     = 51;
+
+// Parameters of a synthetic image.
+struct Options {
+	// Number of loadable data segments, alternating between RX and RW.
+	size_t segments = 2;
+	// Size of each data segment in bytes.
+	size_t segmentSize = 4096;
+	// Number of defined (exported) dynamic symbols.
+	size_t symbols = 16;
+	// Number of undefined (imported) dynamic symbols.
+	size_t imports = 0;
+	// Number of entries in `.rela.dyn`.
+	size_t relocs = 16;
+	// Relocation types, assigned to the entries round-robin.
+	std::vector<uint32_t> relocTypes = { R_RELATIVE };
+	// Prefix of the names of defined symbols; see `symbolName`.
+	std::string symbolPrefix = "sym";
+	// Prefix of the names of imported symbols; see `importName`.
+	std::string importPrefix = "imp";
+	// Libraries to list as `DT_NEEDED`.
+	std::vector<std::string> needed;
+	// Whether to emit a `.gnu.hash` section.
+	bool gnuHash = false;
+	// Whether the first code segment starts with a RISC-V `.plt` section, as linkers make it,
+	// with an entry for every `R_JUMP_SLOT` relocation that fits.
+	bool plt = false;
+	// ELF machine type.
+	uint16_t machine = ELFLOADER_MACHINE;
+};
+
+// Parameters of a synthetic relocatable object, whose code is RISC-V as emitted by an assembler with relaxation on.
+// Function `i` makes `calls` calls, then takes the address of its entry in a table of all functions and returns.
+struct ObjectOptions {
+	// Number of functions.
+	size_t functions = 16;
+	// Number of calls every function makes.
+	size_t calls = 4;
+	// Number of imported functions; every fourth call goes to one.
+	size_t imports = 0;
+	// Alignment of functions, padded with NOPs marked `R_RISCV_ALIGN`.
+	size_t align = 16;
+	// Whether every function and its table entry get sections of their own, as with `-ffunction-sections -fdata-sections`.
+	// The table entries are then local symbols named `slot<n>` instead of one global `table`.
+	bool functionSections = false;
+	// Number of functions, from the first, that only call each other; 0 for all of them.
+	size_t used = 0;
+	// ELF machine type.
+	uint16_t machine = ELFLOADER_MACHINE;
+};
+
+// Get the name of a function defined by a relocatable object.
+std::string functionName(size_t index);
+// Get the name of the function that call `call` of function `index` goes to.
+std::string calleeName(const ObjectOptions &options, size_t index, size_t call);
+
+// Get the name of a defined symbol.
+std::string symbolName(size_t index, const std::string &prefix = "sym");
+// Get the name of an imported symbol.
+std::string importName(size_t index, const std::string &prefix = "imp");
+// Compute the GNU hash of a symbol name.
+uint32_t gnuHash(const char *name);
+
+// Generate an ELF image.
+std::vector<uint8_t> generate(const Options &options);
+// Generate a relocatable object.
+std::vector<uint8_t> generateObject(const ObjectOptions &options);
+// Open an ELF image as a read-only stream.
+// The image must outlive the stream.
+FILE *open(const std::vector<uint8_t> &image);
+
+} // namespace elfgen
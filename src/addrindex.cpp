@@ -0,0 +1,157 @@
+/*
+	MIT License
+
+	Copyright (c) 2023 Julian Scheffers
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy
+	of this software and associated documentation files (the "Software"), to deal
+	in the Software without restriction, including without limitation the rights
+	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+	copies of the Software, and to permit persons to whom the Software is
+	furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+
+
+
+#include "addrindex.hpp"
+#include "elfloader_int.hpp"
+
+#include <algorithm>
+
+namespace elf {
+
+// Build from the symbols of `ctx` that `read` or `readDyn` found, at the addresses `program` has them.
+SymbolTable::SymbolTable(const ELFFile &ctx, const Program &program) {
+	// Defined functions and objects, from both symbol tables.
+	std::vector<const SymInfo *> syms;
+	for (const auto *table: {&ctx.getSym(), &ctx.getDynSym()}) {
+		for (const auto &sym: *table) {
+			if (sym.section == 0 || sym.section >= 0xff00 || (!sym.isFunction() && !sym.isObject())) continue;
+			syms.push_back(&sym);
+		}
+	}
+	std::sort(syms.begin(), syms.end(), [](const SymInfo *a, const SymInfo *b) {
+		return a->value != b->value ? a->value < b->value : a->name < b->name;
+	});
+	
+	// Most symbols are in both tables.
+	auto end = std::unique(syms.begin(), syms.end(), [](const SymInfo *a, const SymInfo *b) {
+		return a->value == b->value && a->name == b->name;
+	});
+	syms.erase(end, syms.end());
+	
+	size_t length = 0;
+	for (auto sym: syms) length += sym->name.size() + 1;
+	names.reserve(length);
+	entries.reserve(syms.size());
+	for (auto sym: syms) {
+		entries.push_back({(size_t) (sym->value + program.vaddr_offset()), (size_t) sym->size, names.data() + names.size()});
+		names.insert(names.end(), sym->name.begin(), sym->name.end());
+		names.push_back(0);
+	}
+}
+
+// Find the symbol at or nearest below `addr`.
+const SymbolTable::Entry *SymbolTable::lookup(size_t addr) const {
+	auto iter = std::upper_bound(entries.begin(), entries.end(), addr, [](size_t addr, const Entry &ent) { return addr < ent.addr; });
+	if (iter == entries.begin()) return nullptr;
+	--iter;
+	
+	// Of several symbols at the same address, prefer one that contains `addr`.
+	for (auto probe = iter; ; --probe) {
+		if (addr - probe->addr < probe->size) return &*probe;
+		if (probe == entries.begin() || (probe - 1)->addr != iter->addr) break;
+	}
+	return iter->size ? nullptr : &*iter;
+}
+
+
+
+// Publish a table of the modules in `owned` and retire the previous one with `removed`, if any.
+// Frees retired tables if no lookups are in progress.
+void AddrIndex::publish(std::unique_ptr<Owned> removed) {
+	auto table = new Table();
+	table->modules.reserve(owned.size());
+	for (const auto &own: owned) {
+		size_t start = (size_t) own->program.memory;
+		table->modules.push_back({start, start + own->program.size, own->name.c_str(), &own->program, &own->symbols});
+	}
+	
+	auto old = current.exchange(table);
+	if (removed) old->removed.push_back(std::move(removed));
+	retired.push_back(old);
+	
+	// Lookups that started before the exchange may still be reading retired tables;
+	// any that start after it read the new one.
+	if (readers.load()) return;
+	for (auto table: retired) delete table;
+	retired.clear();
+}
+
+// Find the module containing `addr` in `table`.
+const AddrIndex::Module *AddrIndex::find(const Table *table, size_t addr) {
+	const auto &mods = table->modules;
+	auto iter = std::upper_bound(mods.begin(), mods.end(), addr, [](size_t addr, const Module &mod) { return addr < mod.start; });
+	if (iter == mods.begin() || addr >= (iter - 1)->end) return nullptr;
+	return &*(iter - 1);
+}
+
+// Add a program loaded from `ctx`, with its symbols.
+bool AddrIndex::add(const std::string &name, const ELFFile &ctx, const Program &program) {
+	size_t start = (size_t) program.memory;
+	size_t end   = start + program.size;
+	auto   pos   = std::upper_bound(owned.begin(), owned.end(), start, [](size_t start, const std::unique_ptr<Owned> &own) {
+		return start < (size_t) own->program.memory;
+	});
+	if (pos != owned.end() && end > (size_t) (*pos)->program.memory) {
+		LOGE("'%s' overlaps '%s'", name.c_str(), (*pos)->name.c_str());
+		return false;
+	}
+	if (pos != owned.begin()) {
+		const auto &prev = (*(pos - 1))->program;
+		if ((size_t) prev.memory + prev.size > start) {
+			LOGE("'%s' overlaps '%s'", name.c_str(), (*(pos - 1))->name.c_str());
+			return false;
+		}
+	}
+	
+	owned.insert(pos, std::unique_ptr<Owned>(new Owned{name, program, SymbolTable(ctx, program)}));
+	publish();
+	return true;
+}
+
+// Remove a program from the index.
+bool AddrIndex::remove(const Program &program) {
+	for (auto iter = owned.begin(); iter != owned.end(); iter++) {
+		if ((*iter)->program.memory != program.memory) continue;
+		
+		// Unpublish before freeing, so that no lookup can find it any more.
+		auto own = std::move(*iter);
+		owned.erase(iter);
+		publish(std::move(own));
+		return true;
+	}
+	return false;
+}
+
+// Find the program and symbol `addr` is in.
+bool AddrIndex::lookup(size_t addr, Location &out) const {
+	readers.fetch_add(1);
+	auto mod = find(current.load(), addr);
+	if (mod) out = {*mod, mod->symbols->lookup(addr)};
+	readers.fetch_sub(1);
+	return mod;
+}
+
+} // namespace elf
@@ -0,0 +1,171 @@
+/*
+	MIT License
+
+	Copyright (c) 2023 Julian Scheffers
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy
+	of this software and associated documentation files (the "Software"), to deal
+	in the Software without restriction, including without limitation the rights
+	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+	copies of the Software, and to permit persons to whom the Software is
+	furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "elfloader.hpp"
+
+namespace elf {
+
+// Symbols of a loaded program, sorted by address to find the symbol an address is in.
+class SymbolTable {
+	public:
+		// A function or object.
+		struct Entry {
+			// Address in the loaded program.
+			size_t      addr;
+			// Size in bytes, 0 if unknown.
+			size_t      size;
+			// Name, owned by the table.
+			const char *name;
+		};
+		
+	protected:
+		// Symbols sorted by address.
+		std::vector<Entry> entries;
+		// Names of the symbols, NUL terminated.
+		std::vector<char>  names;
+		
+	public:
+		SymbolTable() {}
+		// Build from the symbols of `ctx` that `read` or `readDyn` found, at the addresses `program` has them.
+		SymbolTable(const ELFFile &ctx, const Program &program);
+		SymbolTable(const SymbolTable &) = delete;
+		SymbolTable &operator=(const SymbolTable &) = delete;
+		SymbolTable(SymbolTable &&) = default;
+		SymbolTable &operator=(SymbolTable &&) = default;
+		
+		// Find the symbol at or nearest below `addr`, like `dladdr` does.
+		// Returns null if there is none, or if that symbol has a size and `addr` is past its end.
+		// Does not allocate or lock.
+		const Entry *lookup(size_t addr) const;
+		// Get the symbols, sorted by address.
+		const std::vector<Entry> &getEntries() const { return entries; }
+};
+
+// Index of the address ranges of loaded programs, to find the program and symbol an address is in,
+// like `dl_iterate_phdr` and `dladdr`.
+// Lookups do not allocate or lock, so they can be made from interrupt or signal handlers,
+// including while the index is being changed.
+// Changes must not be made concurrently with each other;
+// replaced data is freed by a later change made while no lookups are in progress, or with the index.
+class AddrIndex {
+	public:
+		// A program in the index.
+		struct Module {
+			// First address of the program's memory.
+			size_t             start;
+			// Address after the end of the program's memory.
+			size_t             end;
+			// Name, owned by the index.
+			const char        *name;
+			// Copy of the loaded program.
+			const Program     *program;
+			// Its symbols.
+			const SymbolTable *symbols;
+		};
+		
+		// The result of looking up an address.
+		struct Location {
+			// The program the address is in.
+			Module                    module;
+			// The symbol the address is in, or null if not found.
+			const SymbolTable::Entry *symbol;
+		};
+		
+	protected:
+		// Data for one program, owned by the index.
+		struct Owned {
+			std::string name;
+			Program     program;
+			SymbolTable symbols;
+		};
+		// A published, immutable list of modules sorted by address.
+		struct Table {
+			std::vector<Module> modules;
+			// Programs removed when this table was replaced, freed with it.
+			std::vector<std::unique_ptr<Owned>> removed;
+		};
+		
+		// The table lookups use.
+		std::atomic<Table *> current;
+		// Number of lookups in progress.
+		mutable std::atomic<size_t> readers;
+		// Lookups from interrupt and signal handlers rely on these not falling back to a lock.
+		static_assert(std::atomic<Table *>::is_always_lock_free, "elf::AddrIndex needs a lock-free std::atomic<Table *>.");
+		static_assert(std::atomic<size_t>::is_always_lock_free, "elf::AddrIndex needs a lock-free std::atomic<size_t>.");
+		// Data of the programs in the index.
+		std::vector<std::unique_ptr<Owned>> owned;
+		// Replaced tables that lookups in progress may still be reading.
+		std::vector<Table *> retired;
+		
+		// Publish a table of the modules in `owned` and retire the previous one with `removed`, if any.
+		// Frees retired tables if no lookups are in progress.
+		void publish(std::unique_ptr<Owned> removed = nullptr);
+		
+		// Find the module containing `addr` in `table`.
+		static const Module *find(const Table *table, size_t addr);
+		
+	public:
+		AddrIndex(): current(new Table()), readers(0) {}
+		~AddrIndex() {
+			delete current.load();
+			for (auto table: retired) delete table;
+		}
+		AddrIndex(const AddrIndex &) = delete;
+		AddrIndex &operator=(const AddrIndex &) = delete;
+		
+		// Add a program loaded from `ctx`, with its symbols.
+		// Returns success status; fails if it overlaps a program already in the index.
+		bool add(const std::string &name, const ELFFile &ctx, const Program &program);
+		// Remove a program from the index.
+		// Returns success status; fails if it was not in the index.
+		bool remove(const Program &program);
+		
+		// Find the program and symbol `addr` is in.
+		// The result is valid until the program is removed.
+		// Returns success status; fails if no program contains `addr`.
+		bool lookup(size_t addr, Location &out) const;
+		// Call `func` with every program in the index, in order of address.
+		// `func` must not change the index.
+		template<typename Func>
+		void forEach(Func func) const {
+			readers.fetch_add(1);
+			for (const auto &mod: current.load()->modules) func(mod);
+			readers.fetch_sub(1);
+		}
+		// Get the number of programs in the index.
+		size_t size() const { return owned.size(); }
+};
+
+} // namespace elf
@@ -0,0 +1,103 @@
+/*
+	MIT License
+
+	Copyright (c) 2023 Julian Scheffers
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy
+	of this software and associated documentation files (the "Software"), to deal
+	in the Software without restriction, including without limitation the rights
+	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+	copies of the Software, and to permit persons to whom the Software is
+	furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+
+
+
+#include "callprofile.hpp"
+#include "relocation.hpp"
+#include "elfloader_int.hpp"
+
+#include <algorithm>
+
+namespace elf {
+
+// Make thunks for the functions `ctx` imports that are found in `map`.
+bool CallProfile::prepare(const ELFFile &ctx, const SymMap &map, ELFFile::Allocator alloc) {
+	size_t thunkSize = callThunkSize();
+	if (!thunkSize) {
+		LOGE("No call thunks for this machine");
+		return false;
+	}
+	
+	if (thunks) {
+		LOGE("Call thunks already made");
+		return false;
+	}
+	
+	std::vector<Addr> targets;
+	for (const auto &sym: ctx.getDynSym()) {
+		if (sym.section != 0 || sym.name.empty() || sym.isObject()) continue;
+		auto iter = map.find(sym.name);
+		if (iter == map.end()) continue;
+		names.push_back(sym.name);
+		targets.push_back(iter->second);
+	}
+	
+	if (names.empty()) return true;
+	
+	auto allocation = alloc(0, names.size() * thunkSize, sizeof(Addr));
+	if (!allocation.first) {
+		LOGE("Out of memory for %zu call thunks", names.size());
+		names.clear();
+		return false;
+	}
+	thunks.memory        = (void *) allocation.first;
+	thunks.memory_cookie = (void *) allocation.second;
+	thunks.vaddr_real    = allocation.first;
+	thunks.size          = names.size() * thunkSize;
+	thunks.align         = sizeof(Addr);
+	
+	counters = std::unique_ptr<Addr[]>(new Addr[names.size()]());
+	for (size_t i = 0; i < names.size(); i++) {
+		Addr thunk = thunks.vaddr_real + i * thunkSize;
+		if (!makeCallThunk((uint8_t *) thunk, (Addr) &counters[i], targets[i])) return false;
+		slots[names[i]] = thunk;
+	}
+	LOGD("Made %zu call thunks", names.size());
+	return true;
+}
+
+// Release the memory of the thunks.
+void CallProfile::release(const Releaser &releaser) {
+	if (thunks) releaser(thunks);
+	thunks = Program();
+	names.clear();
+	slots.clear();
+	counters.reset();
+}
+
+// Get the number of calls to every imported function, most called first.
+std::vector<CallProfile::Count> CallProfile::counts() const {
+	std::vector<Count> out;
+	for (size_t i = 0; i < names.size(); i++) out.push_back({names[i], counters[i]});
+	std::stable_sort(out.begin(), out.end(), [](const Count &a, const Count &b) { return a.calls > b.calls; });
+	return out;
+}
+
+// Set all counters to zero.
+void CallProfile::reset() {
+	for (size_t i = 0; i < names.size(); i++) counters[i] = 0;
+}
+
+} // namespace elf
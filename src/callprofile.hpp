@@ -0,0 +1,88 @@
+/*
+	MIT License
+
+	Copyright (c) 2023 Julian Scheffers
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy
+	of this software and associated documentation files (the "Software"), to deal
+	in the Software without restriction, including without limitation the rights
+	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+	copies of the Software, and to permit persons to whom the Software is
+	furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "elfloader.hpp"
+
+namespace elf {
+
+// Counts the calls a program makes to each function it imports, without changing the program:
+// its PLT slots are pointed at thunks that add one to a counter and then jump to the real function.
+// Only calls through the PLT are counted; function pointers taken with other relocations point at the real function.
+// Thunks are machine code for the ELF machine type; like loaded programs, they are written as data,
+// so the instruction cache must be synchronised before they run.
+class CallProfile {
+	public:
+		// Releases the memory of the thunks.
+		using Releaser = std::function<void(Program &thunks)>;
+		
+		// Calls to an imported function.
+		struct Count {
+			// Name of the function.
+			std::string name;
+			// Number of calls so far.
+			Addr        calls;
+		};
+		
+	protected:
+		// Names of the imported functions, in the order of their thunks.
+		std::vector<std::string> names;
+		// Counters the thunks add to.
+		std::unique_ptr<Addr[]> counters;
+		// Memory holding the thunks.
+		Program thunks;
+		// Addresses of the thunks by name, for `relocate`.
+		SymMap slots;
+		
+	public:
+		CallProfile() {}
+		CallProfile(const CallProfile &) = delete;
+		CallProfile &operator=(const CallProfile &) = delete;
+		
+		// Make thunks for the functions `ctx` imports that are found in `map`, in memory from `alloc`.
+		// Then pass `getSlots` to `relocate` to make the program call them.
+		// Returns success status; fails if the machine has no thunks or memory is not available.
+		bool prepare(const ELFFile &ctx, const SymMap &map, ELFFile::Allocator alloc);
+		// Release the memory of the thunks; call after unloading the program.
+		void release(const Releaser &releaser);
+		
+		// Get the thunk addresses to pass to `relocate` for PLT slots.
+		const SymMap *getSlots() const { return &slots; }
+		// Get the number of calls to every imported function, most called first.
+		std::vector<Count> counts() const;
+		// Set all counters to zero.
+		void reset();
+};
+
+} // namespace elf
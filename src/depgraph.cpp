@@ -0,0 +1,260 @@
+/*
+	MIT License
+
+	Copyright (c) 2023 Julian Scheffers
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy
+	of this software and associated documentation files (the "Software"), to deal
+	in the Software without restriction, including without limitation the rights
+	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+	copies of the Software, and to permit persons to whom the Software is
+	furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+
+
+#include "depgraph.hpp"
+#include "relocation.hpp"
+#include "elfloader_int.hpp"
+
+#include <algorithm>
+#include <map>
+#include <mutex>
+#ifdef ELFLOADER_ASYNC
+#include <thread>
+#endif
+
+namespace elf {
+
+// Whether to load and relocate concurrently.
+bool DepGraph::concurrent() const {
+#ifdef ELFLOADER_ASYNC
+	return parallel && std::thread::hardware_concurrency() > 1;
+#else
+	return false;
+#endif
+}
+
+// Read and load modules until all needed libraries are found.
+bool DepGraph::loadAll() {
+	// Modules may be loaded on several threads; the allocator is only called by one at a time.
+	std::mutex allocMtx;
+	ELFFile::Allocator lockedAlloc = [&](size_t vaddr, size_t len, size_t align) {
+		std::lock_guard<std::mutex> lock(allocMtx);
+		return alloc(vaddr, len, align);
+	};
+	
+	// Modules by name.
+	std::map<std::string, size_t> byName;
+	byName[""] = 0;
+	
+	// Load the modules found so far, then look for the libraries they need.
+	std::vector<size_t> wave = { 0 };
+	while (!wave.empty()) {
+#ifdef ELFLOADER_ASYNC
+		if (concurrent() && wave.size() > 1) {
+			std::vector<std::future<Program>> loads;
+			for (auto index: wave) {
+				if (modules[index].shared) continue;
+				loads.push_back(modules[index].file.loadAsync(lockedAlloc, regionGranularity));
+			}
+			for (size_t i = 0, j = 0; i < wave.size(); i++) {
+				if (modules[wave[i]].shared) continue;
+				modules[wave[i]].program = loads[j++].get();
+			}
+		} else
+#endif
+		{
+			for (auto index: wave) {
+				if (modules[index].shared) continue;
+				modules[index].program = modules[index].file.loadDyn(lockedAlloc, regionGranularity);
+			}
+		}
+		
+		std::vector<size_t> next;
+		for (auto index: wave) {
+			// Shared libraries need what they needed when they were loaded.
+			std::vector<std::string> libs;
+			if (modules[index].shared) {
+				for (auto need: modules[index].shared->needs) libs.push_back(need->names[0]);
+			} else if (!modules[index].program || !modules[index].file.isValid()) {
+				LOGE("Unable to load '%s'", modules[index].name.c_str());
+				return false;
+			} else {
+				libs = modules[index].file.getDynLibs();
+			}
+			
+			for (const auto &lib: libs) {
+				auto iter = byName.find(lib);
+				if (iter == byName.end()) {
+					iter = byName.emplace(lib, modules.size()).first;
+					
+					// Libraries loaded for another program are shared.
+					auto shared = registry ? registry->acquire(lib) : nullptr;
+					next.push_back(modules.size());
+					if (shared) {
+						modules.push_back({lib, ELFFile(), shared->program, shared, shared->key, {}, 0});
+					} else {
+						FILE *fd = locate(lib);
+						if (!fd) {
+							LOGE("Library '%s' not found", lib.c_str());
+							return false;
+						}
+						LOGD("Found library '%s'", lib.c_str());
+						
+						// The same library may have been loaded by another name.
+						uint64_t key = 0;
+						if (registry && registry->matchContent) {
+							key    = contentHash(fd);
+							shared = registry->acquire(key, lib);
+						}
+						if (shared) {
+							modules.push_back({lib, ELFFile(), shared->program, shared, key, {}, 0});
+						} else {
+							modules.push_back({lib, ELFFile(fd), {}, nullptr, key, {}, 0});
+						}
+					}
+				}
+				modules[index].needs.push_back(iter->second);
+			}
+		}
+		wave = std::move(next);
+	}
+	
+	return true;
+}
+
+// Compute the height of every module and put them in relocation order.
+bool DepGraph::sort() {
+	// 0: not visited, 1: being visited, 2: done.
+	std::vector<uint8_t> state(modules.size(), 0);
+	std::function<bool(size_t)> visit = [&](size_t index) {
+		if (state[index] == 2) return true;
+		if (state[index] == 1) {
+			LOGE("Dependency cycle through '%s'", modules[index].name.c_str());
+			return false;
+		}
+		state[index] = 1;
+		modules[index].height = 0;
+		for (auto dep: modules[index].needs) {
+			if (!visit(dep)) return false;
+			modules[index].height = std::max(modules[index].height, modules[dep].height + 1);
+		}
+		state[index] = 2;
+		return true;
+	};
+	if (!visit(0)) return false;
+	
+	// Order by height, so that every module comes after the modules it needs.
+	std::vector<size_t> order(modules.size());
+	for (size_t i = 0; i < order.size(); i++) order[i] = i;
+	std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return modules[a].height < modules[b].height; });
+	std::vector<size_t> position(modules.size());
+	for (size_t i = 0; i < order.size(); i++) position[order[i]] = i;
+	
+	std::vector<Module> sorted;
+	for (auto index: order) {
+		sorted.push_back(std::move(modules[index]));
+		for (auto &dep: sorted.back().needs) dep = position[dep];
+	}
+	modules = std::move(sorted);
+	return true;
+}
+
+// Relocate the modules and export their symbols into `map`.
+bool DepGraph::link(SymMap &map) {
+	for (size_t start = 0, end; start < modules.size(); start = end) {
+		// Modules of the same height do not need each other, so they only read the map while relocating.
+		for (end = start; end < modules.size() && modules[end].height == modules[start].height; end++);
+		
+		bool ok = true;
+#ifdef ELFLOADER_ASYNC
+		if (concurrent() && end - start > 1) {
+			std::vector<std::future<bool>> jobs;
+			for (size_t i = start; i < end; i++) {
+				if (modules[i].shared) continue;
+				jobs.push_back(std::async(std::launch::async, [this, i, &map] {
+					return relocate(modules[i].file, modules[i].program, map);
+				}));
+			}
+			for (auto &job: jobs) ok &= job.get();
+		} else
+#endif
+		{
+			for (size_t i = start; ok && i < end; i++) {
+				ok = modules[i].shared || relocate(modules[i].file, modules[i].program, map);
+			}
+		}
+		if (!ok) return false;
+		
+		for (size_t i = start; i < end; i++) {
+			if (!modules[i].shared) {
+				if (!exportSymbols(modules[i].file, modules[i].program, map)) return false;
+				continue;
+			}
+			
+			// Shared libraries were already relocated; only their exports are added.
+			for (const auto &[name, value]: modules[i].shared->exports) {
+				auto existing = map.find(name);
+				if (existing != map.end() && existing->second != value) {
+					LOGE("Duplicate symbol '%s'", name.c_str());
+					return false;
+				}
+				map.emplace(name, value);
+			}
+		}
+	}
+	
+	return true;
+}
+
+// Add the libraries loaded for this program to the registry.
+void DepGraph::share(const SymMap &map) {
+	for (auto &mod: modules) {
+		if (mod.shared || mod.name.empty()) continue;
+		// Modules come after the modules they need, which are therefore already in the registry.
+		std::vector<Registry::Library *> needs;
+		for (auto dep: mod.needs) needs.push_back(modules[dep].shared);
+		auto exports = exportedSymbols(mod.file, mod.program, map);
+		mod.shared   = registry->add(mod.name, mod.key, std::move(mod.file), mod.program, std::move(exports), std::move(needs));
+		mod.file     = ELFFile();
+	}
+}
+
+// Load the program in `fd` and every library it needs.
+bool DepGraph::load(FILE *fd, SymMap &map) {
+	modules.clear();
+	modules.push_back({"", ELFFile(fd), {}, nullptr, 0, {}, 0});
+	if (!loadAll() || !sort() || !link(map)) return false;
+	if (registry) share(map);
+	return true;
+}
+
+// Release the memory of the modules owned by this graph and drop the references to shared ones.
+void DepGraph::unload(const Registry::Releaser &release) {
+	for (auto &mod: modules) {
+		if (mod.shared) registry->release(mod.shared);
+		else if (mod.program) release(mod.program);
+	}
+	modules.clear();
+}
+
+// Find a module by name.
+const DepGraph::Module *DepGraph::find(const std::string &name) const {
+	for (const auto &mod: modules) {
+		if (mod.name == name) return &mod;
+	}
+	return nullptr;
+}
+
+} // namespace elf
@@ -0,0 +1,117 @@
+/*
+	MIT License
+
+	Copyright (c) 2023 Julian Scheffers
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy
+	of this software and associated documentation files (the "Software"), to deal
+	in the Software without restriction, including without limitation the rights
+	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+	copies of the Software, and to permit persons to whom the Software is
+	furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <vector>
+#include <string>
+#include <functional>
+
+#include "elfloader.hpp"
+#include "registry.hpp"
+
+namespace elf {
+
+// Loads a program together with all the libraries it needs, following `DT_NEEDED` entries.
+// Libraries are relocated before the modules that need them, with their exports added to the symbol map in between.
+// With `ELFLOADER_ASYNC`, modules are read and loaded concurrently,
+// and modules whose dependencies are all relocated are relocated concurrently,
+// so that the time taken approaches that of the longest chain of dependencies.
+// With a `Registry`, libraries already loaded for another program are shared instead of loaded again,
+// and the libraries loaded for this program are added to it.
+class DepGraph {
+	public:
+		// Finds a library by the name it is needed by.
+		// Returns an open file, or null if not found; the file is not closed by this class.
+		using Locator = std::function<FILE *(const std::string &name)>;
+		
+		// A program or library in the graph.
+		struct Module {
+			// Name as needed by other modules, or empty for the program.
+			std::string name;
+			// The ELF file, as read while loading; empty once the module is shared.
+			ELFFile file;
+			// The loaded program.
+			Program program;
+			// The library in the registry, if the module is shared.
+			Registry::Library *shared;
+			// Hash of the contents, if computed to look the module up in the registry.
+			uint64_t key;
+			// Indices of the modules this one needs.
+			std::vector<size_t> needs;
+			// Length of the longest chain of modules this one needs, 0 if it needs none.
+			size_t height;
+		};
+		
+		// Callback that finds libraries.
+		Locator locate;
+		// Callback that allocates memory for modules.
+		// Called from one thread at a time.
+		ELFFile::Allocator alloc;
+		// Passed on to `ELFFile::load`.
+		size_t regionGranularity;
+		// Optional registry of shared libraries.
+		// Not owned by this class.
+		Registry *registry;
+		// Whether to load and relocate concurrently.
+		// Only has an effect with `ELFLOADER_ASYNC` on hosts with more than one core.
+		bool parallel;
+		
+		// Loaded modules, in the order they were relocated: every module comes after the modules it needs.
+		std::vector<Module> modules;
+		
+	protected:
+		// Whether to load and relocate concurrently.
+		bool concurrent() const;
+		// Read and load modules until all needed libraries are found.
+		// Returns success status.
+		bool loadAll();
+		// Compute the height of every module and put them in relocation order.
+		// Returns success status; fails if the dependencies have a cycle.
+		bool sort();
+		// Relocate the modules and export their symbols into `map`.
+		// Returns success status.
+		bool link(SymMap &map);
+		// Add the libraries loaded for this program to the registry.
+		void share(const SymMap &map);
+		
+	public:
+		DepGraph(Locator locate, ELFFile::Allocator alloc):
+			locate(locate), alloc(alloc), regionGranularity(0), registry(nullptr), parallel(true) {}
+		
+		// Load the program in `fd` and every library it needs, taking and adding symbols from and to `map`.
+		// On failure, `modules` still holds everything that was loaded so that it can be released with `unload`.
+		// Returns success status.
+		bool load(FILE *fd, SymMap &map);
+		// Release the memory of the modules owned by this graph and drop the references to shared ones.
+		void unload(const Registry::Releaser &release);
+		// Find a module by name; the program has an empty name.
+		const Module *find(const std::string &name) const;
+};
+
+} // namespace elf
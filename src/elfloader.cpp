@@ -25,6 +25,63 @@
 #include "elfloader.hpp"
 #include "elfloader_int.hpp"
 
+#include <mutex>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#define ELFLOADER_HAS_PREAD
+#endif
+
+// Statistics of the load phase running on this thread, if instrumented.
+thread_local elf::PhaseStats *_elf_phase = nullptr;
+// Statistics of the load running on this thread, if instrumented.
+thread_local elf::LoadStats *_elf_stats = nullptr;
+
+// Protects `LoadStats::io` from reads issued by several threads.
+static std::mutex recordMtx;
+#ifndef ELFLOADER_HAS_PREAD
+// Serialises seek and read pairs on streams without `flockfile`, striped by stream.
+static std::mutex streamMtx[8];
+#endif
+
+// Append a read made in the current load phase to `LoadStats::io`.
+void _elf_record_read(uint64_t offset, size_t len) {
+	elf::IORecord rec;
+	rec.phase  = (elf::Phase) (_elf_phase - _elf_stats->phases);
+	rec.offset = offset;
+	rec.size   = len;
+	std::lock_guard<std::mutex> lock(recordMtx);
+	_elf_stats->io.push_back(rec);
+}
+
+// Read `len` bytes at `offset` without using or moving a shared file position.
+size_t _elf_pread(FILE *fd, void *dest, size_t len, uint64_t offset) {
+	size_t total = 0;
+#ifdef ELFLOADER_HAS_PREAD
+	int fildes = fileno(fd);
+	if (fildes >= 0) {
+		while (total < len) {
+			ssize_t res = pread(fildes, (uint8_t *) dest + total, len - total, offset + total);
+			if (res < 0 && errno == EINTR) continue;
+			if (res <= 0) break;
+			total += res;
+		}
+		return total;
+	}
+#endif
+	
+	// Streams without a file descriptor, such as memory streams, share one position.
+	// Only readers of the same stream need to wait for each other.
+#ifdef ELFLOADER_HAS_PREAD
+	flockfile(fd);
+	if (!fseek(fd, offset, SEEK_SET)) total = fread(dest, 1, len, fd);
+	funlockfile(fd);
+#else
+	std::lock_guard<std::mutex> lock(streamMtx[((uintptr_t) fd / sizeof(void *)) % 8]);
+	if (!fseek(fd, offset, SEEK_SET)) total = fread(dest, 1, len, fd);
+#endif
+	return total;
+}
 
 namespace elf {
 
@@ -38,9 +95,110 @@ uint16_t machineType = 0;
 
 
 
+// Get the name of a load phase.
+const char *phaseName(Phase phase) {
+	switch (phase) {
+		case Phase::HEADER:   return "readHeader";
+		case Phase::PROG:     return "readProg";
+		case Phase::SECT:     return "readSect";
+		case Phase::SYM:      return "readSym";
+		case Phase::DYN_SYM:  return "readDynSym";
+		case Phase::DYN_SECT: return "readDynSect";
+		case Phase::LOAD:     return "load";
+		case Phase::RELOCATE: return "relocate";
+		case Phase::EXPORT:   return "exportSymbols";
+		case Phase::MPU:      return "mpu";
+		case Phase::PREFETCH: return "prefetch";
+		default:              return "?";
+	}
+}
+
+
+
+// Compute the GNU hash of a symbol name.
+uint32_t gnuHash(const char *name) {
+	uint32_t h = 5381;
+	for (; *name; name++) {
+		h = h * 33 + (uint8_t) *name;
+	}
+	return h;
+}
+
+// Get the histogram bucket of a size: 0 for 0, otherwise 1 + floor(log2(size)).
+static int sizeBucket(uint64_t size) {
+	int bucket = 0;
+	while (size) {
+		bucket++;
+		size >>= 1;
+	}
+	return bucket;
+}
+
+// Print the range of sizes in a histogram bucket.
+static void printBucket(FILE *to, const char *sign, int bucket) {
+	char tmp[48];
+	if (bucket <= 1) {
+		snprintf(tmp, sizeof(tmp), "%s%d", bucket ? sign : "", bucket);
+	} else {
+		snprintf(tmp, sizeof(tmp), "%s%llu..%s%llu", sign, 1llu << (bucket-1), sign, (1llu << bucket) - 1);
+	}
+	fprintf(to, "  %-24s", tmp);
+}
+
+// Print read counts per phase and, if reads were recorded, a read pattern report.
+void LoadStats::printIOReport(FILE *to) const {
+	// Per-phase read counts.
+	fprintf(to, "%-14s %8s %10s %10s\n", "phase", "reads", "bytes", "prefetched");
+	PhaseStats total = {};
+	for (size_t i = 0; i < (size_t) Phase::COUNT; i++) {
+		const auto &phase = phases[i];
+		if (!phase.reads && !phase.prefetched) continue;
+		fprintf(to, "%-14s %8zu %10zu %10zu\n", phaseName((Phase) i), phase.reads, phase.bytes_read, phase.prefetched);
+		total.reads      += phase.reads;
+		total.bytes_read += phase.bytes_read;
+		total.prefetched += phase.prefetched;
+	}
+	fprintf(to, "%-14s %8zu %10zu %10zu\n", "total", total.reads, total.bytes_read, total.prefetched);
+	
+	if (io.empty()) return;
+	
+	// Histograms of read sizes and of the distance from the end of the previous read.
+	const int buckets = 65;
+	size_t sizes[buckets] = {};
+	size_t back[buckets] = {}, forward[buckets] = {};
+	uint64_t lastEnd = 0;
+	for (const auto &rec: io) {
+		sizes[sizeBucket(rec.size)]++;
+		if (rec.offset < lastEnd) back[sizeBucket(lastEnd - rec.offset)]++;
+		else forward[sizeBucket(rec.offset - lastEnd)]++;
+		lastEnd = rec.offset + rec.size;
+	}
+	
+	fprintf(to, "\nread size (bytes)           reads\n");
+	for (int i = 0; i < buckets; i++) {
+		if (!sizes[i]) continue;
+		printBucket(to, "", i);
+		fprintf(to, " %8zu\n", sizes[i]);
+	}
+	
+	fprintf(to, "\ndistance from previous read (bytes)\n");
+	for (int i = buckets - 1; i > 0; i--) {
+		if (!back[i]) continue;
+		printBucket(to, "-", i);
+		fprintf(to, " %8zu\n", back[i]);
+	}
+	for (int i = 0; i < buckets; i++) {
+		if (!forward[i]) continue;
+		printBucket(to, "+", i);
+		fprintf(to, " %8zu\n", forward[i]);
+	}
+	fprintf(to, "sequential reads: %zu of %zu\n", forward[0], io.size());
+}
+
+
 // Load headers and validity-check ELF file.
 // File descriptor not closed by this class.
-ELFFile::ELFFile(FILE *fd): fd(fd) {
+ELFFile::ELFFile(FILE *fd, LoadStats *stats): fd(fd), stats(stats) {
 	valid = readHeader();
 }
 
@@ -74,6 +232,9 @@ void ELFFile::printDebugInfo() {
 // Read header information and check validity.
 // Returns success status.
 bool ELFFile::readHeader() {
+	PHASE(stats, HEADER);
+	_ElfReader io(fd, &plan);
+	
 	// Check magic.
 	SEEK(0);
 	EXPECT(4, magic);
@@ -146,6 +307,9 @@ bool ELFFile::readHeader() {
 // Returns success status.
 bool ELFFile::readSect() {
 	if (!valid) return false;
+	PHASE(stats, SECT);
+	_ElfReader io(fd, &plan);
+	sectHeaders.clear();
 	
 	// Start reading some data.
 	for (auto i = 0; i < header.shEntNum; i++) {
@@ -166,7 +330,7 @@ bool ELFFile::readSect() {
 	// Read raw name strings.
 	auto &nameSect = sectHeaders[header.shStrIndex];
 	std::vector<char> cache;
-	cache.reserve(nameSect.file_size);
+	cache.resize(nameSect.file_size);
 	SEEK(nameSect.offset);
 	READ(cache.data(), nameSect.file_size);
 	
@@ -193,6 +357,9 @@ bool ELFFile::readSect() {
 // Returns success status.
 bool ELFFile::readProg() {
 	if (!valid) return false;
+	PHASE(stats, PROG);
+	_ElfReader io(fd, &plan);
+	progHeaders.clear();
 	
 	// Start reading some data.
 	for (size_t i = 0; i < header.phEntNum; i++) {
@@ -211,6 +378,9 @@ bool ELFFile::readProg() {
 // Returns success status.
 bool ELFFile::readSym() {
 	if (!valid) return false;
+	PHASE(stats, SYM);
+	_ElfReader io(fd, &plan);
+	symbols.clear();
 	
 	// Find `.symtab` section.
 	const auto *symtab = findSect(".symtab");
@@ -247,7 +417,7 @@ bool ELFFile::readSym() {
 	
 	// Read raw name strings.
 	std::vector<char> cache;
-	cache.reserve(strtab.file_size);
+	cache.resize(strtab.file_size);
 	SEEK(strtab.offset);
 	READ(cache.data(), strtab.file_size);
 	
@@ -265,6 +435,7 @@ bool ELFFile::readSym() {
 		
 		// Copy the string from the cache.
 		sym.name.assign(cache.data() + sym.name_index, len);
+		sym.hash = gnuHash(sym.name.c_str());
 	}
 	
 	return true;
@@ -274,6 +445,9 @@ bool ELFFile::readSym() {
 // Returns success status.
 bool ELFFile::readDynSym() {
 	if (!valid) return false;
+	PHASE(stats, DYN_SYM);
+	_ElfReader io(fd, &plan);
+	dynSym.clear();
 	
 	// Find `.symtab` section.
 	const auto *symtab = findSect(".dynsym");
@@ -310,7 +484,7 @@ bool ELFFile::readDynSym() {
 	
 	// Read raw name strings.
 	std::vector<char> cache;
-	cache.reserve(strtab.file_size);
+	cache.resize(strtab.file_size);
 	SEEK(strtab.offset);
 	READ(cache.data(), strtab.file_size);
 	
@@ -328,6 +502,7 @@ bool ELFFile::readDynSym() {
 		
 		// Copy the string from the cache.
 		sym.name.assign(cache.data() + sym.name_index, len);
+		sym.hash = gnuHash(sym.name.c_str());
 	}
 	
 	return true;
@@ -337,6 +512,9 @@ bool ELFFile::readDynSym() {
 // Returns success status.
 bool ELFFile::readDynSect() {
 	if (!valid) return false;
+	PHASE(stats, DYN_SECT);
+	_ElfReader io(fd, &plan);
+	dynLibs.clear();
 	bool is_little_endian = header.endianness == 1;
 	
 	// Find PT_DYNAMIC program header.
@@ -359,20 +537,20 @@ bool ELFFile::readDynSect() {
 	READ(cache.data(), sect->file_size);
 	
 	// Read entries.
-	for (size_t i = 0; i < prog->file_size / 8; i++) {
+	for (size_t i = 0; i < prog->file_size / sizeof(DynEntry); i++) {
 		// Read a raw entry.
-		SEEK(prog->offset + i * 8);
-		uint32_t tag, value;
-		READUINT(tag, 4);
-		READUINT(value, 4);
+		SEEK(prog->offset + i * sizeof(DynEntry));
+		Addr tag, value;
+		READUINT(tag, sizeof(Addr));
+		READUINT(value, sizeof(Addr));
 		
 		if (tag == (int) DT::NEEDED) {
 			// Read from cached strtab.
-			ssize_t max_len = prog->file_size - value - 1;
-			if (max_len <= 0 || value >= cache.size()) {
-				LOGE("ELF file invalid (d_ptr = 0x%08lx)", value);
+			if (value >= cache.size()) {
+				LOGE("ELF file invalid (d_ptr = 0x%08lx)", (unsigned long) value);
+				return false;
 			}
-			LOGD("%08zx %08lx %08lx", max_len, value, sect->vaddr);
+			size_t  max_len = cache.size() - value;
 			size_t  len     = strnlen(cache.data() + value, max_len);
 			dynLibs.push_back({cache.data() + value, len});
 			LOGD("Dynlib: %s", dynLibs.back().c_str());
@@ -401,15 +579,27 @@ bool ELFFile::readDyn() {
 }
 
 
-// If valid, load into memory.
-// Returns success status.
-Program ELFFile::load(Allocator alloc) {
-	if (!valid || !readProg()) return {};
+// Get the alignment `load` allocates memory with when there is no MPU padding.
+Addr ELFFile::loadAlignment() const {
+	Addr align = 32;
+	for (const auto &prog: progHeaders) {
+		if (prog.type != (int) PT::LOAD) continue;
+		// Segments keep their offset modulo `p_align`, up to the largest alignment honoured.
+		if (!(prog.alignment & (prog.alignment - 1)) && prog.alignment > align) {
+			align = prog.alignment < ELFLOADER_MAX_ALIGN ? prog.alignment : ELFLOADER_MAX_ALIGN;
+		}
+	}
+	return align;
+}
+
+// Allocate memory for loading and compute the addresses in the program, without copying any data.
+Program ELFFile::allocate(Allocator alloc, size_t regionGranularity) {
 	Program out;
 	
 	// Determine size and address.
 	Addr addrMin = -1;
 	Addr addrMax = 0;
+	Addr align   = loadAlignment();
 	for (const auto &prog: progHeaders) {
 		// Skip non-resident segments.
 		if (prog.type != (int) PT::LOAD) continue;
@@ -422,19 +612,37 @@ Program ELFFile::load(Allocator alloc) {
 		if (ah > addrMax) addrMax = ah;
 	}
 	
-	// TODO: Determine alignment.
-	Addr align = 32;
+	// Make room for naturally aligned MPU regions.
+	Addr padMin = addrMin;
+	Addr padMax = addrMax;
+	if (regionGranularity) {
+		for (const auto &prog: napotSegments(regionGranularity)) {
+			// Only segments that were widened to a power of two need alignment.
+			if (prog.mem_size & (prog.mem_size - 1) || prog.vaddr % prog.mem_size) continue;
+			if (prog.mem_size > align) align = prog.mem_size;
+			if (prog.vaddr < padMin) padMin = prog.vaddr;
+			if (prog.vaddr + prog.mem_size > padMax) padMax = prog.vaddr + prog.mem_size;
+		}
+		out.region_granularity = regionGranularity;
+	}
+	padMin -= padMin % align;
 	
 	// Get memory.
-	out.vaddr_req = addrMin;
-	auto allocation = alloc(addrMin, addrMax - addrMin, align);
+	out.vaddr_req = padMin;
+	if (_elf_phase) _elf_phase->allocations++;
+	auto allocation = alloc(padMin, padMax - padMin, align);
 	out.memory = (void *) allocation.first;
 	out.memory_cookie = (void *) allocation.second;
+	out.align = align;
 	
 	// Compute addresses.
 	out.vaddr_real = allocation.first;
-	out.size = addrMax - addrMin;
-	size_t offs = out.vaddr_real - addrMin;
+	out.size = padMax - padMin;
+	out.padding = out.size - (addrMax - addrMin);
+	size_t offs = out.vaddr_real - padMin;
+	if (regionGranularity) {
+		LOGD("Padded %zu bytes to %zu for MPU regions (align 0x%zx)", (size_t) (addrMax - addrMin), out.size, (size_t) align);
+	}
 	
 	// Check if we did get some memory.
 	if (!out) {
@@ -443,24 +651,6 @@ Program ELFFile::load(Allocator alloc) {
 	}
 	out.entry = (void *) (header.entry + out.vaddr_offset());
 	
-	// Copy datas.
-	for (const auto &prog: progHeaders) {
-		// Skip non-resident segments.
-		if (prog.type != (int) PT::LOAD) continue;
-		
-		// Read segment data.
-		fseek(fd, prog.offset, SEEK_SET);
-		size_t addr = prog.vaddr + offs;
-		fread((void *) addr, 1, prog.file_size, fd);
-		memset((void *) (addr + prog.file_size), 0, prog.mem_size - prog.file_size);
-		
-		// Debug log loaded address.
-		char r = prog.flags & 0x4 ? 'r' : '-';
-		char w = prog.flags & 0x2 ? 'w' : '-';
-		char x = prog.flags & 0x1 ? 'x' : '-';
-		LOGD("Prog 0x%x bytes at 0x%x %c%c%c", (int) prog.file_size, (int) (prog.offset + offs), r,w,x);
-	}
-	
 	// Find address of dynamic segment.
 	out.dynamic = nullptr;
 	for (const auto &prog: progHeaders) {
@@ -481,6 +671,177 @@ Program ELFFile::load(Allocator alloc) {
 	return out;
 }
 
+// If valid, load into memory.
+// Returns success status.
+Program ELFFile::load(Allocator alloc, size_t regionGranularity) {
+	if (!valid || (progHeaders.empty() && !readProg())) return {};
+	PHASE(stats, LOAD);
+	Program out = allocate(alloc, regionGranularity);
+	if (!out) return {};
+	
+	// Copy datas.
+	for (const auto &prog: progHeaders) {
+		// Skip non-resident segments.
+		if (prog.type != (int) PT::LOAD) continue;
+		
+		// Read segment data.
+		size_t addr = prog.vaddr + out.vaddr_offset();
+		_elf_count_read(prog.offset, prog.file_size);
+		_elf_pread(fd, (void *) addr, prog.file_size, prog.offset);
+		memset((void *) (addr + prog.file_size), 0, prog.mem_size - prog.file_size);
+		
+		// Trace loaded address.
+		TRACE(ELF_SEGMENT, addr, prog.file_size, prog.mem_size, prog.flags);
+	}
+	
+	return out;
+}
+
+// Add the metadata `readSect`, `readDynSym`, `readDynSect` and `relocate` read to `plan`.
+void ELFFile::planMetadata() {
+	// Raw section headers, as fetched.
+	std::vector<SectHeader> sects(header.shEntNum);
+	for (size_t i = 0; i < sects.size(); i++) {
+		auto data = plan.find(header.shOffset + i * header.shEntSize, sizeof(SectHeader));
+		if (!data) return;
+		memcpy(&sects[i], data, sizeof(SectHeader));
+	}
+	
+	// Section name table.
+	if (header.shStrIndex && header.shStrIndex < sects.size()) {
+		plan.add(sects[header.shStrIndex].offset, sects[header.shStrIndex].file_size);
+	}
+	
+	// Dynamic symbols and their names, and relocations.
+	for (const auto &sect: sects) {
+		if (sect.type == (int) SHT::DYNSYM) {
+			plan.add(sect.offset, sect.file_size);
+			if (sect.link && sect.link < sects.size()) {
+				plan.add(sects[sect.link].offset, sects[sect.link].file_size);
+			}
+		} else if (sect.type == (int) SHT::RELA) {
+			plan.add(sect.offset, sect.file_size);
+		}
+	}
+	
+	// Dynamic segment.
+	for (const auto &prog: progHeaders) {
+		if (prog.type == (int) PT::DYNAMIC) plan.add(prog.offset, prog.file_size);
+	}
+}
+
+// Read data required for loading and load into memory, like `readDyn` followed by `load`.
+Program ELFFile::loadDyn(Allocator alloc, size_t regionGranularity) {
+	return loadPlanned(alloc, regionGranularity, false);
+}
+
+// Implementation of `loadDyn` and `loadAsync`; `parallel` fetches with concurrent reads.
+Program ELFFile::loadPlanned(Allocator alloc, size_t regionGranularity, bool parallel) {
+	if (!valid) return {};
+	
+	// Fetch pending ranges of the plan.
+	auto fetch = [&]() {
+#ifdef ELFLOADER_ASYNC
+		if (parallel) return plan.executeParallel(fd);
+#endif
+		return plan.execute(fd);
+	};
+	
+	// Fetch program and section header tables.
+	{
+		PHASE(stats, PREFETCH);
+		plan.add(header.phOffset, header.phEntNum * header.phEntSize);
+		plan.add(header.shOffset, header.shEntNum * header.shEntSize);
+		if (!fetch()) return {};
+	}
+	if (progHeaders.empty() && !readProg()) return {};
+	
+	Program out;
+	{
+		PHASE(stats, LOAD);
+		out = allocate(alloc, regionGranularity);
+		if (!out) return {};
+	}
+	
+	// Fetch segments straight into program memory, along with any metadata they do not cover.
+	{
+		PHASE(stats, PREFETCH);
+		for (const auto &prog: progHeaders) {
+			if (prog.type != (int) PT::LOAD) continue;
+			plan.add(prog.offset, prog.file_size, (void *) (prog.vaddr + out.vaddr_offset()));
+		}
+		planMetadata();
+		if (!fetch()) {
+			dropPrefetch();
+			valid = false;
+			return out;
+		}
+	}
+	
+	// Clear the remainder of the segments.
+	for (const auto &prog: progHeaders) {
+		if (prog.type != (int) PT::LOAD) continue;
+		size_t addr = prog.vaddr + out.vaddr_offset();
+		memset((void *) (addr + prog.file_size), 0, prog.mem_size - prog.file_size);
+		TRACE(ELF_SEGMENT, addr, prog.file_size, prog.mem_size, prog.flags);
+	}
+	
+	// Parse the fetched metadata.
+	bool ok = (!sectHeaders.empty() || readSect()) && readDynSym() && readDynSect();
+	
+	// Writable segments may be changed by relocation, so they are read from the file from now on.
+	for (const auto &prog: progHeaders) {
+		if (prog.type == (int) PT::LOAD && (prog.flags & 0x2)) {
+			plan.drop((void *) (prog.vaddr + out.vaddr_offset()));
+		}
+	}
+	
+	if (!ok) valid = false;
+	return out;
+}
+
+// Get the loadable segments, each widened to a naturally aligned power-of-two block where possible.
+std::vector<ProgInfo> ELFFile::napotSegments(size_t granularity) const {
+	std::vector<ProgInfo> out;
+	Addr span = 0;
+	for (const auto &prog: progHeaders) {
+		if (prog.type != (int) PT::LOAD) continue;
+		out.push_back(prog);
+		if (prog.vaddr + prog.mem_size > span) span = prog.vaddr + prog.mem_size;
+	}
+	
+	for (size_t i = 0; i < out.size(); i++) {
+		Addr lo = out[i].vaddr;
+		Addr hi = out[i].vaddr + out[i].mem_size;
+		if (lo == hi) continue;
+		
+		// Smallest block that could hold the segment.
+		Addr size = granularity < 8 ? 8 : granularity;
+		while (size && size < hi - lo) size <<= 1;
+		
+		// Grow the block until it contains the segment without touching any other.
+		for (; size && size <= span * 2; size <<= 1) {
+			Addr base = lo & ~(size - 1);
+			if (base + size < hi) continue;
+			
+			bool clash = false;
+			for (size_t j = 0; j < out.size(); j++) {
+				if (j == i) continue;
+				Addr jl = out[j].vaddr;
+				Addr jh = out[j].vaddr + out[j].mem_size;
+				if (jl < base + size && jh > base) clash = true;
+			}
+			if (clash) break;
+			
+			out[i].vaddr    = base;
+			out[i].mem_size = size;
+			break;
+		}
+	}
+	
+	return out;
+}
+
 
 // Find section by name.
 const SectInfo *ELFFile::findSect(const std::string &name) const {
@@ -492,16 +853,18 @@ const SectInfo *ELFFile::findSect(const std::string &name) const {
 
 // Find symbol by name.
 const SymInfo *ELFFile::findSym(const std::string &name) const {
+	uint32_t hash = gnuHash(name.c_str());
 	for (const auto &sym: symbols) {
-		if (sym.name == name) return &sym;
+		if (sym.hash == hash && sym.name == name) return &sym;
 	}
 	return nullptr;
 }
 
 // Find symbol by name.
 const SymInfo *ELFFile::findDynSym(const std::string &name) const {
+	uint32_t hash = gnuHash(name.c_str());
 	for (const auto &sym: dynSym) {
-		if (sym.name == name) return &sym;
+		if (sym.hash == hash && sym.name == name) return &sym;
 	}
 	return nullptr;
 }
@@ -32,10 +32,29 @@
 #include <vector>
 #include <string>
 #include <map>
+#include <memory>
 #include <functional>
+#ifdef ELFLOADER_ASYNC
+#include <future>
+#endif
 
 #include "elfloader_machine.hpp"
 
+// Ranges of the file closer together than this many bytes are fetched in one read by `ReadPlan`.
+#ifndef ELFLOADER_READ_GAP
+#define ELFLOADER_READ_GAP 4096
+#endif
+// Reads smaller than this many bytes that `ReadPlan` did not prefetch fill a read-ahead window of this size,
+// so tables parsed field by field or entry by entry take one read per window instead of one per field.
+#ifndef ELFLOADER_READ_WINDOW
+#define ELFLOADER_READ_WINDOW 4096
+#endif
+// Largest `p_align` that `ELFFile::load` honours; segments are copied rather than mapped,
+// so page alignment beyond this only wastes memory.
+#ifndef ELFLOADER_MAX_ALIGN
+#define ELFLOADER_MAX_ALIGN 4096
+#endif
+
 
 
 namespace elf {
@@ -45,9 +64,11 @@ using SymMap = std::map<std::string, size_t>;
 
 #if SIZE_MAX > 0xFFFFFFFFLLU
 using Addr = uint64_t;
+using SAddr = int64_t;
 #define ELFLOADER_ELF_IS_ELF64
 #else
 using Addr = uint32_t;
+using SAddr = int32_t;
 #define ELFLOADER_ELF_IS_ELF32
 #endif
 
@@ -68,17 +89,28 @@ enum class ET {
 
 // Section header type.
 enum class SHT {
-	PROGBITS = 1,
-	SYMTAB   = 2,
-	STRTAB   = 3,
-	RELA     = 4,
-	HASH     = 5,
-	DYNAMIC  = 6,
-	NOTE     = 7,
-	NOBITS   = 8,
-	REL      = 9,
-	SHLIB    = 10,
-	DYNSYM   = 11,
+	PROGBITS      = 1,
+	SYMTAB        = 2,
+	STRTAB        = 3,
+	RELA          = 4,
+	HASH          = 5,
+	DYNAMIC       = 6,
+	NOTE          = 7,
+	NOBITS        = 8,
+	REL           = 9,
+	SHLIB         = 10,
+	DYNSYM        = 11,
+	INIT_ARRAY    = 14,
+	FINI_ARRAY    = 15,
+	PREINIT_ARRAY = 16,
+};
+
+// Section header flags.
+enum class SHF {
+	WRITE      = 0x01,
+	ALLOC      = 0x02,
+	EXECINSTR  = 0x04,
+	GNU_RETAIN = 0x200000,
 };
 
 // Program header type.
@@ -275,26 +307,34 @@ struct RelEntry {
 	// Offset in the subject section.
 	Addr     offset;
 	// Symbol index to apply to, relocation type.
-	uint32_t info;
+	Addr     info;
 	
 	// Zero the numbers.
 	RelEntry():
 		offset(0), info(0) {}
 	
+#ifdef ELFLOADER_ELF_IS_ELF64
+	// Extract type.
+	uint32_t type() const { return info & 0xffffffff; }
+	// Extract symbol index.
+	uint32_t symIndex() const { return info >> 32; }
+#else
 	// Extract type.
-	uint8_t type() const { return info & 255; }
+	uint32_t type() const { return info & 255; }
 	// Extract symbol index.
 	uint32_t symIndex() const { return info >> 8; }
+#endif
 };
+static_assert(sizeof(RelEntry) == 0x08 || sizeof(RelEntry) == 0x10, "elf::RelEntry must be either 0x08 or 0x10 bytes in size.");
 
 // Relocation entry (with addend).
 struct RelaEntry {
 	// Offset in the subject section.
 	Addr     offset;
 	// Symbol index to apply to, relocation type.
-	uint32_t info;
+	Addr     info;
 	// Addend.
-	int32_t  addend;
+	SAddr    addend;
 	
 	// Zero the numbers.
 	RelaEntry():
@@ -303,11 +343,19 @@ struct RelaEntry {
 	RelaEntry(const RelEntry &other):
 		offset(other.offset), info(other.info), addend(0) {}
 	
+#ifdef ELFLOADER_ELF_IS_ELF64
 	// Extract type.
-	uint8_t type() const { return info & 255; }
+	uint32_t type() const { return info & 0xffffffff; }
+	// Extract symbol index.
+	uint32_t symIndex() const { return info >> 32; }
+#else
+	// Extract type.
+	uint32_t type() const { return info & 255; }
 	// Extract symbol index.
 	uint32_t symIndex() const { return info >> 8; }
+#endif
 };
+static_assert(sizeof(RelaEntry) == 0x0c || sizeof(RelaEntry) == 0x18, "elf::RelaEntry must be either 0x0c or 0x18 bytes in size.");
 
 
 
@@ -318,9 +366,14 @@ struct SectInfo: public SectHeader {
 
 using ProgInfo = ProgHeader;
 
+// Compute the GNU hash of a symbol name.
+uint32_t gnuHash(const char *name);
+
 // Symbol header but with a name.
 struct SymInfo: public SymEntry {
 	std::string name;
+	// GNU hash of the name, to speed up lookups.
+	uint32_t hash;
 	
 	bool isFunction() const {
 		return (info & 0x0f) == (int) STT::FUNC;
@@ -354,11 +407,19 @@ struct Program {
 	void *memory;
 	// Size of allocated memory.
 	size_t size;
+	// Alignment the memory was allocated with.
+	size_t align;
+	// Bytes added to the allocation to make segments protectable by single MPU regions.
+	size_t padding;
+	// Minimum MPU region size the segment layout was made for, 0 if segments are at their linked layout.
+	size_t region_granularity;
 	
 	// By default, zero all fields.
 	Program():
 		vaddr_req(0), vaddr_real(0),
-		memory(nullptr), size(0) {}
+		dynamic(nullptr), entry(nullptr), memory_cookie(nullptr),
+		memory(nullptr), size(0), align(0),
+		padding(0), region_granularity(0) {}
 	
 	// True if `memory` is nonnull.
 	operator bool() const { return !!memory; }
@@ -366,7 +427,149 @@ struct Program {
 
 
 
+// Phases of loading a program, for instrumentation.
+enum class Phase {
+	HEADER,
+	PROG,
+	SECT,
+	SYM,
+	DYN_SYM,
+	DYN_SECT,
+	LOAD,
+	RELOCATE,
+	EXPORT,
+	MPU,
+	PREFETCH,
+	
+	// Number of phases.
+	COUNT
+};
+
+// Get the name of a load phase.
+const char *phaseName(Phase phase);
+
+// Instrumentation of a single load phase.
+struct PhaseStats {
+	// Number of times the phase ran.
+	size_t   runs;
+	// Total wall time in nanoseconds, including nested phases.
+	uint64_t time_ns;
+	// Number of reads from the file.
+	size_t   reads;
+	// Number of bytes read from the file.
+	size_t   bytes_read;
+	// Number of reads served from data prefetched by a `ReadPlan`.
+	size_t   prefetched;
+	// Number of calls to the program memory allocator.
+	size_t   allocations;
+	// Symbol map lookups that found a symbol.
+	size_t   sym_hits;
+	// Symbol map lookups that found nothing.
+	size_t   sym_misses;
+};
+
+// A read from an ELF file.
+struct IORecord {
+	// Phase that made the read.
+	Phase    phase;
+	// File offset.
+	uint64_t offset;
+	// Bytes read.
+	uint64_t size;
+};
+
+// Instrumentation of loading a program.
+// Filled in by `ELFFile`, `relocate`, `exportSymbols` and the MPU functions when `ELFFile::stats` is set.
+struct LoadStats {
+	// Per-phase statistics, indexed by `Phase`.
+	PhaseStats phases[(size_t) Phase::COUNT];
+	// Number of relocations applied, by relocation type.
+	std::map<uint32_t, size_t> relocs;
+	// Whether to append every read from the file to `io`.
+	bool recordIO;
+	// Reads from the file, in the order they were issued, if `recordIO` is set.
+	std::vector<IORecord> io;
+	
+	// By default, zero all statistics.
+	LoadStats(): phases{}, recordIO(false) {}
+	
+	// Print read counts per phase and, if reads were recorded, a read pattern report:
+	// histograms of read sizes and of the distance from the end of one read to the start of the next.
+	void printIOReport(FILE *to = stdout) const;
+	
+	// Get statistics of a phase.
+	PhaseStats &operator[](Phase phase) { return phases[(size_t) phase]; }
+	// Get statistics of a phase.
+	const PhaseStats &operator[](Phase phase) const { return phases[(size_t) phase]; }
+};
+
+
+
+// Collects the file ranges a load needs and fetches them in ascending file order, in as few reads as possible.
+// Ranges read into a destination are read directly; other ranges closer together than `gap` bytes are merged into one read.
+// The I/O of `ELFFile`, `relocate` and `exportSymbols` is served from the fetched data where it covers the requested bytes.
+class ReadPlan {
+	public:
+		// Ranges closer together than this are merged into one read.
+		size_t gap;
+		
+	protected:
+		// A range of the file.
+		struct Range {
+			// Offset in the file.
+			Addr  offset;
+			// Size in bytes.
+			Addr  size;
+			// Memory to read into, or null to read into a buffer owned by the plan.
+			void *dest;
+		};
+		
+		// Ranges to fetch on the next `execute`.
+		std::vector<Range> pending;
+		// Ranges fetched, sorted by offset.
+		std::vector<Range> spans;
+		// Buffers owned by the plan.
+		std::vector<std::shared_ptr<uint8_t[]>> buffers;
+		
+		// Turn the pending ranges into the reads that fetch them, in ascending file order.
+		// Merged reads get a buffer owned by the plan.
+		std::vector<Range> schedule();
+		// Record reads that completed as fetched data.
+		void commit(const std::vector<Range> &reads);
+		
+	public:
+		ReadPlan(): gap(ELFLOADER_READ_GAP) {}
+		
+		// Add a range to fetch.
+		// If `dest` is nonnull, the range is read directly into it and it must stay valid while the plan is in use.
+		void add(Addr offset, Addr size, void *dest = nullptr);
+		// Fetch all pending ranges that were not already fetched.
+		// Returns success status.
+		bool execute(FILE *fd);
+#ifdef ELFLOADER_ASYNC
+		// Fetch all pending ranges that were not already fetched, issuing the reads concurrently with `pread`.
+		// Falls back to `execute` if the stream has no file descriptor.
+		// Returns success status.
+		bool executeParallel(FILE *fd);
+#endif
+		// Add a copy of file data that was obtained elsewhere, such as from a metadata cache.
+		void insert(Addr offset, Addr size, const void *data);
+		// Get fetched data covering `size` bytes at `offset`, or null if not fetched.
+		const uint8_t *find(Addr offset, Addr size) const;
+		// Forget ranges that were read into `dest`.
+		void drop(const void *dest);
+		// Forget all fetched data.
+		void clear();
+};
+
+// Compute a hash of the entire contents of an ELF file, to key cached metadata.
+// This is not a cryptographic hash.
+uint64_t contentHash(FILE *fd);
+
 // ELF file reader and loader.
+// All reads are positional, so methods that fill in different data may run on different threads at once,
+// for example `readSym` while `load` copies segments.
+// `readProg` and `readSect` must finish before the methods that use their results start.
 class ELFFile {
 	public:
 		// Some callback that allocates memory for program loading.
@@ -376,6 +579,9 @@ class ELFFile {
 		// File descriptor to use for loading.
 		// Not closed by this class.
 		FILE *fd;
+		// Optional instrumentation, filled in as the file is read and loaded.
+		// Not owned by this class.
+		LoadStats *stats;
 		
 	protected:
 		// This is a valid ELF file for this machine.
@@ -393,13 +599,23 @@ class ELFFile {
 		std::vector<SymInfo> dynSym;
 		// Needed dynamic libraries.
 		std::vector<std::string> dynLibs;
+		// Data prefetched by `loadDyn`.
+		ReadPlan plan;
+		
+		// Allocate memory for loading and compute the addresses in the program, without copying any data.
+		Program allocate(Allocator alloc, size_t regionGranularity);
+		// Add the metadata `readSect`, `readDynSym`, `readDynSect` and `relocate` read to `plan`.
+		// The section header table must already be fetched.
+		void planMetadata();
+		// Implementation of `loadDyn` and `loadAsync`; `parallel` fetches with concurrent reads.
+		Program loadPlanned(Allocator alloc, size_t regionGranularity, bool parallel);
 		
 	public:
 		// Empty, invalid ELF file.
-		ELFFile(): valid(false) {}
+		ELFFile(): stats(nullptr), valid(false) {}
 		// Load headers and validity-check ELF file.
 		// File descriptor not closed by this class.
-		ELFFile(FILE *fd);
+		ELFFile(FILE *fd, LoadStats *stats = nullptr);
 		
 		// Dump debugging information.
 		void printDebugInfo();
@@ -430,7 +646,41 @@ class ELFFile {
 		bool readDyn();
 		
 		// If valid, load into memory.
-		Program load(Allocator alloc);
+		// If `regionGranularity` is nonzero, the allocation is aligned and padded so that every segment
+		// can be protected by one naturally aligned power-of-two MPU region of at least that size.
+		Program load(Allocator alloc, size_t regionGranularity = 0);
+		// Get the alignment `load` allocates memory with when there is no MPU padding:
+		// the largest `p_align` of the loadable segments, from 32 up to `ELFLOADER_MAX_ALIGN`.
+		Addr loadAlignment() const;
+		// Get the loadable segments, each widened to a naturally aligned power-of-two block where possible.
+		// Blocks are at least `granularity` bytes and do not overlap other segments.
+		// Only `vaddr` and `mem_size` are changed; segments that cannot be widened are returned as-is.
+		std::vector<ProgInfo> napotSegments(size_t granularity) const;
+		// Read data required for loading and load into memory, like `readDyn` followed by `load`.
+		// All file ranges needed, including those `relocate` reads, are fetched in ascending order with coalesced reads.
+		// Metadata in read-only segments is then read from program memory;
+		// call `dropPrefetch` before unloading the program if this ELF file is used afterwards.
+		// If reading fails after memory was allocated, the program is still returned so it can be released,
+		// and this ELF file is marked invalid.
+		Program loadDyn(Allocator alloc, size_t regionGranularity = 0);
+#ifdef ELFLOADER_ASYNC
+		// Like `loadDyn`, but runs in the background and issues the reads concurrently.
+		// This ELF file, the allocator and `stats` must not be used until the future is ready.
+		std::future<Program> loadAsync(Allocator alloc, size_t regionGranularity = 0);
+#endif
+		// Forget data prefetched by `loadDyn` or restored by `loadMetadata`.
+		void dropPrefetch() { plan.clear(); }
+		
+		// Serialise the parsed headers, symbols, needed libraries and relocation tables into a blob keyed by `key`.
+		// The blob has no pointers, so it can be stored and later used in place from a memory mapping.
+		// Returns an empty blob on failure.
+		std::vector<uint8_t> saveMetadata(uint64_t key) const;
+		// Restore the results of `read` or `readDyn` from a blob made by `saveMetadata`, instead of parsing the file.
+		// The blob must be aligned to 8 bytes and have been made with the same `key`; see `contentHash`.
+		// Returns success status; on failure, nothing is restored.
+		bool loadMetadata(const void *blob, size_t size, uint64_t key);
+		// Get data prefetched by `loadDyn`.
+		const ReadPlan &getPlan() const { return plan; }
 		
 		// Is this a VALID?
 		bool isValid() const { return valid; }
@@ -0,0 +1,162 @@
+/*
+	MIT License
+
+	Copyright (c) 2023 Julian Scheffers
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy
+	of this software and associated documentation files (the "Software"), to deal
+	in the Software without restriction, including without limitation the rights
+	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+	copies of the Software, and to permit persons to whom the Software is
+	furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+
+
+#include "elfloader.hpp"
+#include "elfloader_int.hpp"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+// Number of threads issuing reads for `ReadPlan::executeParallel`.
+#ifndef ELFLOADER_IO_THREADS
+#define ELFLOADER_IO_THREADS 4
+#endif
+
+// Reads larger than this are split so that they can be issued concurrently.
+#ifndef ELFLOADER_IO_CHUNK
+#define ELFLOADER_IO_CHUNK (256*1024)
+#endif
+
+namespace elf {
+
+// Worker threads that issue reads in the background.
+// Started on first use and stopped at exit.
+class IOPool {
+	protected:
+		// Protects `jobs` and `stopping`.
+		std::mutex mtx;
+		// Signalled when a job is added or the pool is stopping.
+		std::condition_variable cond;
+		// Jobs waiting for a thread.
+		std::deque<std::function<void()>> jobs;
+		// Worker threads.
+		std::vector<std::thread> threads;
+		// Whether the pool is stopping.
+		bool stopping = false;
+		
+		// Run jobs until the pool is stopped.
+		void work() {
+			std::unique_lock<std::mutex> lock(mtx);
+			while (1) {
+				cond.wait(lock, [this] { return stopping || !jobs.empty(); });
+				if (jobs.empty()) return;
+				auto job = std::move(jobs.front());
+				jobs.pop_front();
+				lock.unlock();
+				job();
+				lock.lock();
+			}
+		}
+		
+	public:
+		~IOPool() {
+			{
+				std::lock_guard<std::mutex> lock(mtx);
+				stopping = true;
+			}
+			cond.notify_all();
+			for (auto &thread: threads) thread.join();
+		}
+		
+		// Run a job on one of the worker threads.
+		void submit(std::function<void()> job) {
+			{
+				std::lock_guard<std::mutex> lock(mtx);
+				if (threads.empty()) {
+					for (int i = 0; i < ELFLOADER_IO_THREADS; i++) {
+						threads.emplace_back([this] { work(); });
+					}
+				}
+				jobs.push_back(std::move(job));
+			}
+			cond.notify_one();
+		}
+};
+
+// Get the shared pool of I/O threads.
+static IOPool &ioPool() {
+	static IOPool pool;
+	return pool;
+}
+
+// Fetch all pending ranges that were not already fetched, issuing the reads concurrently with `pread`.
+// Returns success status.
+bool ReadPlan::executeParallel(FILE *fd) {
+	if (fileno(fd) < 0) return execute(fd);
+	auto reads = schedule();
+	
+	// Split large reads into chunks; accounting is done here because the workers have no load phase.
+	std::vector<Range> chunks;
+	for (const auto &read: reads) {
+		for (Addr off = 0; off < read.size; off += ELFLOADER_IO_CHUNK) {
+			Addr len = std::min<Addr>(ELFLOADER_IO_CHUNK, read.size - off);
+			chunks.push_back({read.offset + off, len, (uint8_t *) read.dest + off});
+			_elf_count_read(read.offset + off, len);
+		}
+	}
+	if (chunks.empty()) return true;
+	
+	// Issue all chunks and wait for the last one to finish.
+	// The state is shared so it outlives a worker that finishes after the wait returns.
+	struct State {
+		std::mutex mtx;
+		std::condition_variable cond;
+		size_t remaining;
+		bool   failed;
+	};
+	auto state = std::make_shared<State>();
+	state->remaining = chunks.size();
+	state->failed    = false;
+	for (const auto &chunk: chunks) {
+		ioPool().submit([state, fd, chunk] {
+			bool ok = _elf_pread(fd, chunk.dest, chunk.size, chunk.offset) == chunk.size;
+			std::lock_guard<std::mutex> lock(state->mtx);
+			state->failed |= !ok;
+			if (--state->remaining == 0) state->cond.notify_all();
+		});
+	}
+	std::unique_lock<std::mutex> lock(state->mtx);
+	state->cond.wait(lock, [&] { return state->remaining == 0; });
+	bool failed = state->failed;
+	lock.unlock();
+	
+	if (failed) {
+		LOGE("I/O error while reading in parallel");
+		return false;
+	}
+	commit(reads);
+	return true;
+}
+
+// Like `loadDyn`, but runs in the background and issues the reads concurrently.
+std::future<Program> ELFFile::loadAsync(Allocator alloc, size_t regionGranularity) {
+	return std::async(std::launch::async, [this, alloc, regionGranularity] {
+		return loadPlanned(alloc, regionGranularity, true);
+	});
+}
+
+} // namespace elf
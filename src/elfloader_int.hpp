@@ -24,6 +24,14 @@
 
 #pragma once
 
+#include <stdarg.h>
+#include <errno.h>
+
+#include <chrono>
+
+#include "elfloader.hpp"
+#include "elfloader_trace.hpp"
+
 // #define ELFLOADER_LINENUMBERS
 
 #define lololol__FILENAME__ (strrchr(__FILE__, '/') ? strrchr(__FILE__, '/') + 1 : __FILE__)
@@ -36,13 +44,25 @@
 #define LOG_LNARG
 #endif
 
+// Log levels, selected at compile time with `ELFLOADER_LOG_LEVEL`.
+// Messages above the selected level are compiled out entirely, arguments included.
+#define ELFLOADER_LOG_NONE  0
+#define ELFLOADER_LOG_ERROR 1
+#define ELFLOADER_LOG_WARN  2
+#define ELFLOADER_LOG_INFO  3
+#define ELFLOADER_LOG_DEBUG 4
+
+#ifndef ELFLOADER_LOG_LEVEL
+#define ELFLOADER_LOG_LEVEL ELFLOADER_LOG_INFO
+#endif
+
 #ifdef ESP_PLATFORM
 #include <esp_log.h>
 static const char *TAG = "elfloader";
-#define LOGE(fmt, ...) ESP_LOGE(TAG, LOG_LNFMT fmt LOG_LNARG __VA_OPT__(,) __VA_ARGS__)
-#define LOGI(fmt, ...) ESP_LOGI(TAG, LOG_LNFMT fmt LOG_LNARG __VA_OPT__(,) __VA_ARGS__)
-#define LOGW(fmt, ...) ESP_LOGW(TAG, LOG_LNFMT fmt LOG_LNARG __VA_OPT__(,) __VA_ARGS__)
-#define LOGD(fmt, ...) ESP_LOGD(TAG, LOG_LNFMT fmt LOG_LNARG __VA_OPT__(,) __VA_ARGS__)
+#define _LOGE(fmt, ...) ESP_LOGE(TAG, LOG_LNFMT fmt LOG_LNARG __VA_OPT__(,) __VA_ARGS__)
+#define _LOGI(fmt, ...) ESP_LOGI(TAG, LOG_LNFMT fmt LOG_LNARG __VA_OPT__(,) __VA_ARGS__)
+#define _LOGW(fmt, ...) ESP_LOGW(TAG, LOG_LNFMT fmt LOG_LNARG __VA_OPT__(,) __VA_ARGS__)
+#define _LOGD(fmt, ...) ESP_LOGD(TAG, LOG_LNFMT fmt LOG_LNARG __VA_OPT__(,) __VA_ARGS__)
 #else
 static void _elf_log_helper(const char *prefix, const char *fmt, ...) {
 	fputs(prefix, stdout);
@@ -50,41 +70,165 @@ static void _elf_log_helper(const char *prefix, const char *fmt, ...) {
 	va_start(ls, fmt);
 	vprintf(fmt, ls);
 	va_end(ls);
-	fputs("\033[0m", stdout);
+	fputs("\033[0m\n", stdout);
 }
-#define LOGE(fmt, ...) _elf_log_helper("\033[31mErr  elfloader: ", LOG_LNFMT fmt LOG_LNARG __VA_OPT__(,) __VA_ARGS__)
-#define LOGI(fmt, ...) _elf_log_helper( "\033[0mInfo elfloader: ", LOG_LNFMT fmt LOG_LNARG __VA_OPT__(,) __VA_ARGS__)
-#define LOGW(fmt, ...) _elf_log_helper("\033[33mWarn elfloader: ", LOG_LNFMT fmt LOG_LNARG __VA_OPT__(,) __VA_ARGS__)
-#define LOGD(fmt, ...) _elf_log_helper("\033[34mDeb  elfloader: ", LOG_LNFMT fmt LOG_LNARG __VA_OPT__(,) __VA_ARGS__)
+#define _LOGE(fmt, ...) _elf_log_helper("\033[31mErr  elfloader: ", LOG_LNFMT fmt LOG_LNARG __VA_OPT__(,) __VA_ARGS__)
+#define _LOGI(fmt, ...) _elf_log_helper( "\033[0mInfo elfloader: ", LOG_LNFMT fmt LOG_LNARG __VA_OPT__(,) __VA_ARGS__)
+#define _LOGW(fmt, ...) _elf_log_helper("\033[33mWarn elfloader: ", LOG_LNFMT fmt LOG_LNARG __VA_OPT__(,) __VA_ARGS__)
+#define _LOGD(fmt, ...) _elf_log_helper("\033[34mDeb  elfloader: ", LOG_LNFMT fmt LOG_LNARG __VA_OPT__(,) __VA_ARGS__)
 #endif
 
+#if ELFLOADER_LOG_LEVEL >= ELFLOADER_LOG_ERROR
+#define LOGE(fmt, ...) _LOGE(fmt __VA_OPT__(,) __VA_ARGS__)
+#else
+#define LOGE(fmt, ...) do {} while (0)
+#endif
+#if ELFLOADER_LOG_LEVEL >= ELFLOADER_LOG_WARN
+#define LOGW(fmt, ...) _LOGW(fmt __VA_OPT__(,) __VA_ARGS__)
+#else
+#define LOGW(fmt, ...) do {} while (0)
+#endif
+#if ELFLOADER_LOG_LEVEL >= ELFLOADER_LOG_INFO
+#define LOGI(fmt, ...) _LOGI(fmt __VA_OPT__(,) __VA_ARGS__)
+#else
+#define LOGI(fmt, ...) do {} while (0)
+#endif
+#if ELFLOADER_LOG_LEVEL >= ELFLOADER_LOG_DEBUG
+#define LOGD(fmt, ...) _LOGD(fmt __VA_OPT__(,) __VA_ARGS__)
+#else
+#define LOGD(fmt, ...) do {} while (0)
+#endif
+
+
+
+// Statistics of the load phase running on this thread, if instrumented.
+extern thread_local elf::PhaseStats *_elf_phase;
+// Statistics of the load running on this thread, if instrumented.
+extern thread_local elf::LoadStats *_elf_stats;
+
+// Append a read made in the current load phase to `LoadStats::io`.
+void _elf_record_read(uint64_t offset, size_t len);
+
+// Account a read from the file in the current load phase.
+static inline void _elf_count_read(uint64_t offset, size_t len) {
+	if (_elf_phase) {
+		_elf_phase->reads++;
+		_elf_phase->bytes_read += len;
+		if (_elf_stats->recordIO) _elf_record_read(offset, len);
+	}
+}
 
+// Account a read served from prefetched data in the current load phase.
+static inline void _elf_count_prefetched() {
+	if (_elf_phase) _elf_phase->prefetched++;
+}
+
+// Account a symbol map lookup in the current load phase.
+static inline void _elf_count_lookup(bool found) {
+	if (_elf_phase) {
+		if (found) _elf_phase->sym_hits++;
+		else _elf_phase->sym_misses++;
+	}
+}
+
+// Instruments a load phase for as long as it is in scope.
+class _ElfPhaseScope {
+	protected:
+		// Statistics of the enclosing phase.
+		elf::PhaseStats *outer;
+		// Statistics of the enclosing load.
+		elf::LoadStats  *outerStats;
+		// Statistics of this phase, if instrumented.
+		elf::PhaseStats *phase;
+		// Time at which the phase started.
+		std::chrono::steady_clock::time_point start;
+		
+	public:
+		_ElfPhaseScope(elf::LoadStats *stats, elf::Phase id): outer(_elf_phase), outerStats(_elf_stats), phase(stats ? &(*stats)[id] : nullptr) {
+			if (!phase) return;
+			phase->runs++;
+			_elf_phase = phase;
+			_elf_stats = stats;
+			start = std::chrono::steady_clock::now();
+		}
+		~_ElfPhaseScope() {
+			if (!phase) return;
+			auto time = std::chrono::steady_clock::now() - start;
+			phase->time_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(time).count();
+			_elf_phase = outer;
+			_elf_stats = outerStats;
+		}
+};
+#define PHASE(stats, id) _ElfPhaseScope _elf_phase_scope((stats), elf::Phase::id)
+
+
+
+// Read `len` bytes at `offset` without using or moving a shared file position.
+// Uses `pread` if the stream has a file descriptor, or else a seek and read under a lock.
+// Does not account the read. Returns the number of bytes read.
+size_t _elf_pread(FILE *fd, void *dest, size_t len, uint64_t offset);
+
+// File position used by the I/O macros.
+// Reads are positional, so any number of readers can use one file at the same time.
+// They are served from data prefetched by a `ReadPlan` where possible.
+struct _ElfReader {
+	// File to read from.
+	FILE *fd;
+	// Prefetched data, if any.
+	const elf::ReadPlan *plan;
+	// Position of the next read.
+	uint64_t pos;
+	// Read-ahead window, allocated on the first small read that misses the plan.
+	std::unique_ptr<uint8_t[]> window;
+	// File offset of the window.
+	uint64_t windowPos;
+	// Number of valid bytes in the window.
+	size_t windowLen;
+	
+	_ElfReader(FILE *fd, const elf::ReadPlan *plan = nullptr): fd(fd), plan(plan), pos(0), windowPos(0), windowLen(0) {}
+	
+	// Read `len` bytes at the position and advance it.
+	// Returns success status.
+	bool read(void *dest, size_t len) {
+		const uint8_t *data = plan ? plan->find(pos, len) : nullptr;
+		if (data) {
+			_elf_count_prefetched();
+			memcpy(dest, data, len);
+		} else if (len < ELFLOADER_READ_WINDOW) {
+			if (pos < windowPos || pos - windowPos + len > windowLen) {
+				// Refill the window at the position; it may come up short at the end of the file.
+				if (!window) window.reset(new uint8_t[ELFLOADER_READ_WINDOW]);
+				windowPos = pos;
+				windowLen = _elf_pread(fd, window.get(), ELFLOADER_READ_WINDOW, pos);
+				_elf_count_read(pos, windowLen);
+				if (windowLen < len) return false;
+			}
+			memcpy(dest, window.get() + (pos - windowPos), len);
+		} else {
+			_elf_count_read(pos, len);
+			if (_elf_pread(fd, dest, len, pos) != len) return false;
+		}
+		pos += len;
+		return true;
+	}
+};
 
 // A magic tester for multi boits
-static bool _elf_expect(FILE *fd, size_t len, const void *magic) {
+static bool _elf_expect(_ElfReader &io, size_t len, const void *magic) {
 	uint8_t tmp[len];
-	size_t read = fread(tmp, 1, len, fd);
-	if (read != len) return false;
+	if (!io.read(tmp, len)) return false;
 	return !memcmp(tmp, magic, len);
 }
-#define EXPECT(count, magic) do { errno = 0; if (!_elf_expect(fd, count, magic)) {LOGE("I/O error: %s", strerror(errno)); return false;} } while(0)
+#define EXPECT(count, magic) do { errno = 0; if (!_elf_expect(io, count, magic)) {LOGE("I/O error: %s", strerror(errno)); return false;} } while(0)
 
 // A INTEGER READING DEVICE
-static bool _elf_readint(FILE *fd, uint64_t *out, size_t size, bool is_signed, bool is_le) {
-	uint64_t tmp = 0;
+static bool _elf_readint(_ElfReader &io, uint64_t *out, size_t size, bool is_signed, bool is_le) {
+	uint8_t buf[8];
+	if (!io.read(buf, size)) return false;
 	
-	if (is_le) {
-		for (size_t i = 0; i < size; i++) {
-			int c = fgetc(fd);
-			if (c == EOF) return false;
-			tmp |= (uint64_t) (c & 0xff) << (i*8);
-		}
-	} else {
-		for (size_t i = 0; i < size; i++) {
-			int c = fgetc(fd);
-			if (c == EOF) return false;
-			tmp |= c << ((size-i-1)*8);
-		}
+	uint64_t tmp = 0;
+	for (size_t i = 0; i < size; i++) {
+		tmp |= (uint64_t) buf[is_le ? i : size-i-1] << (i*8);
 	}
 	
 	if (is_signed && (tmp >> (size*8-1))) {
@@ -96,22 +240,13 @@ static bool _elf_readint(FILE *fd, uint64_t *out, size_t size, bool is_signed, b
 	*out = tmp;
 	return true;
 }
-#define READUINT(dest, size) do { errno = 0; uint64_t tmp; if (!_elf_readint(fd, &tmp, size, false, is_little_endian)) {LOGE("I/O error: %s", strerror(errno)); return false;} (dest) = tmp; } while(0)
+#define READUINT(dest, size) do { errno = 0; uint64_t tmp; if (!_elf_readint(io, &tmp, size, false, is_little_endian)) {LOGE("I/O error: %s", strerror(errno)); return false;} (dest) = tmp; } while(0)
 
 // SKIPS PADDING.
-static bool _elf_skip(FILE *fd, size_t len) {
-	long pre = ftell(fd);
-	fseek(fd, len, SEEK_CUR);
-	return ftell(fd) - pre == len;
-}
-#define SKIP(size) do { errno = 0; if (!_elf_skip(fd, (size))) {LOGE("I/O error: %s", strerror(errno)); return false;} } while(0)
+#define SKIP(size) do { io.pos += (size); } while(0)
 
 // SEEKD LOKATON.
-static bool _elf_seek(FILE *fd, size_t idx) {
-	fseek(fd, idx, SEEK_SET);
-	return ftell(fd) == idx;
-}
-#define SEEK(idx) do { errno = 0; if (!_elf_seek(fd, (idx))) {LOGE("I/O error: %s", strerror(errno)); return false;} } while(0)
+#define SEEK(idx) do { io.pos = (idx); } while(0)
 
 // READ BIANIER.
-#define READ(ptr, len) do { auto tmplen = (len); errno = 0; if (fread(ptr, 1, tmplen, fd) != tmplen) {LOGE("I/O error: %s", strerror(errno)); return false;} } while(0)
+#define READ(ptr, len) do { errno = 0; if (!io.read((ptr), (len))) {LOGE("I/O error: %s", strerror(errno)); return false;} } while(0)
@@ -0,0 +1,149 @@
+/*
+	MIT License
+
+	Copyright (c) 2023 Julian Scheffers
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy
+	of this software and associated documentation files (the "Software"), to deal
+	in the Software without restriction, including without limitation the rights
+	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+	copies of the Software, and to permit persons to whom the Software is
+	furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+
+
+#include "elfloader_trace.hpp"
+
+#include <atomic>
+
+namespace elf::trace {
+
+static_assert((ELFLOADER_TRACE_RING_SIZE & (ELFLOADER_TRACE_RING_SIZE - 1)) == 0, "ELFLOADER_TRACE_RING_SIZE must be a power of two.");
+
+#if ELFLOADER_TRACE
+// Per-event counters.
+static std::atomic<size_t> counters[(size_t) Event::COUNT];
+#endif
+
+#if ELFLOADER_TRACE == ELFLOADER_TRACE_RING
+// Trace ring buffer.
+static Record ring[ELFLOADER_TRACE_RING_SIZE];
+// Sequence number of the next record to write.
+static std::atomic<uint32_t> head;
+// Sequence number of the next record to read.
+static uint32_t tail;
+#endif
+
+
+
+// Record an event.
+void emit(Event event, uint16_t argc, size_t a, size_t b, size_t c, size_t d) {
+	#if ELFLOADER_TRACE
+	if (event < Event::COUNT) {
+		counters[(size_t) event].fetch_add(1, std::memory_order_relaxed);
+	}
+	#else
+	(void) event;
+	#endif
+	#if ELFLOADER_TRACE != ELFLOADER_TRACE_RING
+	(void) argc; (void) a; (void) b; (void) c; (void) d;
+	#endif
+	
+	#if ELFLOADER_TRACE == ELFLOADER_TRACE_RING
+	// Claim a slot; writers never wait for each other or for the reader.
+	uint32_t seq = head.fetch_add(1, std::memory_order_relaxed);
+	auto &rec = ring[seq & (ELFLOADER_TRACE_RING_SIZE - 1)];
+	
+	// Invalidate, fill in, then publish the record.
+	__atomic_store_n(&rec.seq, seq - 1, __ATOMIC_RELAXED);
+	rec.event   = event;
+	rec.argc    = argc;
+	rec.args[0] = a;
+	rec.args[1] = b;
+	rec.args[2] = c;
+	rec.args[3] = d;
+	__atomic_store_n(&rec.seq, seq, __ATOMIC_RELEASE);
+	#endif
+}
+
+// Get the number of times an event occurred since the last reset.
+size_t count(Event event) {
+	#if ELFLOADER_TRACE
+	if (event < Event::COUNT) return counters[(size_t) event].load(std::memory_order_relaxed);
+	#else
+	(void) event;
+	#endif
+	return 0;
+}
+
+// Copy up to `max` unread records out of the ring, oldest first.
+size_t drain(Record *out, size_t max) {
+	#if ELFLOADER_TRACE == ELFLOADER_TRACE_RING
+	uint32_t end = head.load(std::memory_order_acquire);
+	
+	// Skip records that have already been overwritten.
+	if (end - tail > ELFLOADER_TRACE_RING_SIZE) {
+		tail = end - ELFLOADER_TRACE_RING_SIZE;
+	}
+	
+	size_t n = 0;
+	while (n < max && tail != end) {
+		const auto &rec = ring[tail & (ELFLOADER_TRACE_RING_SIZE - 1)];
+		
+		// Stop at records still being written.
+		if (__atomic_load_n(&rec.seq, __ATOMIC_ACQUIRE) != tail) break;
+		out[n] = rec;
+		// Discard the copy if a writer lapped us in the meantime.
+		if (__atomic_load_n(&rec.seq, __ATOMIC_ACQUIRE) == tail) n++;
+		tail++;
+	}
+	
+	return n;
+	#else
+	(void) out; (void) max;
+	return 0;
+	#endif
+}
+
+// Clear all counters and the ring.
+void reset() {
+	#if ELFLOADER_TRACE
+	for (auto &counter: counters) {
+		counter.store(0, std::memory_order_relaxed);
+	}
+	#endif
+	#if ELFLOADER_TRACE == ELFLOADER_TRACE_RING
+	tail = head.load(std::memory_order_relaxed);
+	#endif
+}
+
+// Get the name of an event, for decoding.
+const char *eventName(Event event) {
+	switch (event) {
+		case Event::MPU_TOR1:           return "MPU_TOR1";
+		case Event::MPU_TOR2:           return "MPU_TOR2";
+		case Event::MPU_NA4:            return "MPU_NA4";
+		case Event::MPU_NAPOT:          return "MPU_NAPOT";
+		case Event::MPU_OUT_OF_ENTRIES: return "MPU_OUT_OF_ENTRIES";
+		case Event::MPU_GRANULARITY:    return "MPU_GRANULARITY";
+		case Event::MPU_PROBE:          return "MPU_PROBE";
+		case Event::ELF_SEGMENT:        return "ELF_SEGMENT";
+		case Event::ELF_RELOC_SECT:     return "ELF_RELOC_SECT";
+		case Event::ELF_RELOC:          return "ELF_RELOC";
+		case Event::ELF_SYM_IMPORT:     return "ELF_SYM_IMPORT";
+		default:                        return "?";
+	}
+}
+
+} // namespace elf::trace
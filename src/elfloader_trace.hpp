@@ -0,0 +1,119 @@
+/*
+	MIT License
+
+	Copyright (c) 2023 Julian Scheffers
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy
+	of this software and associated documentation files (the "Software"), to deal
+	in the Software without restriction, including without limitation the rights
+	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+	copies of the Software, and to permit persons to whom the Software is
+	furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Trace modes, selected at compile time with `ELFLOADER_TRACE`.
+// No tracing; trace points compile to nothing.
+#define ELFLOADER_TRACE_OFF      0
+// Count occurrences of every event.
+#define ELFLOADER_TRACE_COUNTERS 1
+// Count events and store them in a binary ring buffer.
+#define ELFLOADER_TRACE_RING     2
+
+#ifndef ELFLOADER_TRACE
+#define ELFLOADER_TRACE ELFLOADER_TRACE_OFF
+#endif
+
+// Number of records in the trace ring, must be a power of two.
+#ifndef ELFLOADER_TRACE_RING_SIZE
+#define ELFLOADER_TRACE_RING_SIZE 64
+#endif
+
+namespace elf::trace {
+
+// Trace event identifiers.
+// These are stored in trace records and decoded offline; only ever append to this list.
+enum class Event : uint16_t {
+	// MPU region appended as a merged single-entry TOR: slot, base, size, pmpcfg.
+	MPU_TOR1,
+	// MPU region appended as a two-entry TOR: slot, base, size, pmpcfg.
+	MPU_TOR2,
+	// MPU region appended as NA4: slot, base, size, pmpcfg.
+	MPU_NA4,
+	// MPU region appended as NAPOT: slot, base, size, pmpcfg.
+	MPU_NAPOT,
+	// MPU region not appended for lack of entries: base, size.
+	MPU_OUT_OF_ENTRIES,
+	// MPU region not appended because it is misaligned: base, size, granularity.
+	MPU_GRANULARITY,
+	// MPU probed: entry count, granularity.
+	MPU_PROBE,
+	// Segment loaded: address, file size, memory size, flags.
+	ELF_SEGMENT,
+	// Relocation section started: file offset, entry count.
+	ELF_RELOC_SECT,
+	// Relocation applied: type, offset, symbol index, addend.
+	ELF_RELOC,
+	// Symbol imported from the symbol map: symbol index, value.
+	ELF_SYM_IMPORT,
+	
+	// Number of event types.
+	COUNT
+};
+
+// Maximum number of arguments per record.
+static const size_t MAX_ARGS = 4;
+
+// Binary trace record.
+struct Record {
+	// Sequence number; the record is valid when this matches its position in the stream.
+	uint32_t seq;
+	// Event identifier.
+	Event    event;
+	// Number of valid arguments.
+	uint16_t argc;
+	// Event arguments.
+	size_t   args[MAX_ARGS];
+};
+
+// Record an event. Use the `TRACE` macro instead so that it compiles away when tracing is off.
+void emit(Event event, uint16_t argc, size_t a = 0, size_t b = 0, size_t c = 0, size_t d = 0);
+// Get the number of times an event occurred since the last reset.
+size_t count(Event event);
+// Copy up to `max` unread records out of the ring, oldest first.
+// Records overwritten before being read are skipped.
+size_t drain(Record *out, size_t max);
+// Clear all counters and the ring.
+void reset();
+// Get the name of an event, for decoding.
+const char *eventName(Event event);
+
+} // namespace elf::trace
+
+// Count the arguments of a trace point.
+#define _ELF_TRACE_ARGC(...) _ELF_TRACE_ARGC_(0 __VA_OPT__(,) __VA_ARGS__, 4, 3, 2, 1, 0)
+#define _ELF_TRACE_ARGC_(_0, _1, _2, _3, _4, n, ...) n
+
+#if ELFLOADER_TRACE
+// Trace point: event name followed by up to four integer arguments.
+#define TRACE(event, ...) ::elf::trace::emit(::elf::trace::Event::event, _ELF_TRACE_ARGC(__VA_ARGS__) __VA_OPT__(,) __VA_ARGS__)
+#else
+// Trace point: event name followed by up to four integer arguments.
+#define TRACE(event, ...) do {} while (0)
+#endif
@@ -0,0 +1,624 @@
+/*
+	MIT License
+
+	Copyright (c) 2023 Julian Scheffers
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy
+	of this software and associated documentation files (the "Software"), to deal
+	in the Software without restriction, including without limitation the rights
+	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+	copies of the Software, and to permit persons to whom the Software is
+	furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+
+
+#include "fastload.hpp"
+#include "relocation.hpp"
+#include "elfloader_int.hpp"
+
+#include <algorithm>
+
+namespace elf::fastload {
+
+// A word to be fixed up at load time, as decided by the last relocation that targets it.
+struct Fixup {
+	// Import index, or UINT32_MAX to add the load base.
+	uint32_t import;
+};
+
+// Appends records and strings to an image.
+class ImageWriter {
+	public:
+		// Image under construction.
+		std::vector<uint8_t> image;
+		// String pool.
+		std::vector<char>    strings;
+		
+		// Append a table of records, aligned to 8 bytes.
+		template<typename T>
+		Table table(const std::vector<T> &records) {
+			image.resize((image.size() + 7) & ~7, 0);
+			Table out = { (uint32_t) image.size(), (uint32_t) records.size() };
+			auto ptr = (const uint8_t *) records.data();
+			image.insert(image.end(), ptr, ptr + records.size() * sizeof(T));
+			return out;
+		}
+		
+		// Add a string to the pool.
+		String string(const std::string &str) {
+			String out = { (uint32_t) strings.size(), (uint32_t) str.size() };
+			strings.insert(strings.end(), str.begin(), str.end());
+			strings.push_back(0);
+			return out;
+		}
+};
+
+// Whether a dynamic symbol is exported, ignoring symbols already present in the map.
+static bool isExport(const SymInfo &sym) {
+	if (sym.section >= 0xff00 || sym.section == 0) return false;
+	if (!sym.isFunction() && !sym.isObject()) return false;
+	return sym.bind() == (int) STB::GLOBAL || sym.bind() == (int) STB::WEAK;
+}
+
+// Build a perfect hash table of exports.
+// Every bucket of hashes gets a seed that sends all of its hashes to free slots.
+// Returns success status.
+static bool buildExports(const std::vector<const SymInfo *> &syms, std::vector<Export> &slots, std::vector<uint32_t> &seeds, ImageWriter &writer) {
+	size_t nslots   = syms.size();
+	size_t nbuckets = syms.size() / 4 + 1;
+	
+	// Distribute symbols over buckets.
+	std::vector<std::vector<const SymInfo *>> buckets(nbuckets);
+	for (auto sym: syms) {
+		buckets[sym->hash % nbuckets].push_back(sym);
+	}
+	
+	// Place the largest buckets first, while most slots are free.
+	std::vector<size_t> order(nbuckets);
+	for (size_t i = 0; i < nbuckets; i++) order[i] = i;
+	std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return buckets[a].size() > buckets[b].size(); });
+	
+	slots.assign(nslots, Export{});
+	seeds.assign(nbuckets, 0);
+	std::vector<bool>     used(nslots, false);
+	std::vector<uint32_t> taken;
+	for (size_t index: order) {
+		const auto &bucket = buckets[index];
+		if (bucket.empty()) break;
+		
+		// Equal hashes can never be told apart.
+		for (size_t i = 0; i < bucket.size(); i++) {
+			for (size_t j = 0; j < i; j++) {
+				if (bucket[i]->hash == bucket[j]->hash) {
+					LOGE("Exports '%s' and '%s' have the same hash", bucket[i]->name.c_str(), bucket[j]->name.c_str());
+					return false;
+				}
+			}
+		}
+		
+		// Try seeds until every hash of the bucket lands in a different free slot.
+		uint32_t seed = 0;
+		while (1) {
+			taken.clear();
+			for (auto sym: bucket) {
+				uint32_t slot = slotOf(sym->hash, seed, nslots);
+				if (used[slot] || std::find(taken.begin(), taken.end(), slot) != taken.end()) break;
+				taken.push_back(slot);
+			}
+			if (taken.size() == bucket.size()) break;
+			if (++seed == 0) {
+				LOGE("Unable to build export hash table");
+				return false;
+			}
+		}
+		
+		seeds[index] = seed;
+		for (size_t i = 0; i < bucket.size(); i++) {
+			used[taken[i]]  = true;
+			slots[taken[i]] = { bucket[i]->value, writer.string(bucket[i]->name), bucket[i]->hash, bucket[i]->bind() };
+		}
+	}
+	
+	return true;
+}
+
+// Convert a shared object into a fast-load image.
+bool convert(ELFFile &ctx, std::vector<uint8_t> &out) {
+	if (ctx.getProg().empty() || ctx.getSect().empty()) ctx.readDyn();
+	if (!ctx.isValid()) return false;
+	
+	// Determine bounds of the memory image.
+	Addr addrMin = -1;
+	Addr addrMax = 0;
+	for (const auto &prog: ctx.getProg()) {
+		if (prog.type != (int) PT::LOAD) continue;
+		if (prog.vaddr < addrMin) addrMin = prog.vaddr;
+		if (prog.vaddr + prog.mem_size > addrMax) addrMax = prog.vaddr + prog.mem_size;
+	}
+	if (addrMax <= addrMin) {
+		LOGE("No loadable segments");
+		return false;
+	}
+	
+	// Start the image at an aligned address, as `ELFFile::allocate` does, so that segments keep their offset modulo `p_align`.
+	Addr align = ctx.loadAlignment();
+	addrMin -= addrMin % align;
+	if (addrMax - addrMin > UINT32_MAX) {
+		LOGE("Loadable segments too large for a fast-load image");
+		return false;
+	}
+	
+	// Build the memory image.
+	std::vector<uint8_t> mem(addrMax - addrMin, 0);
+	Addr dataSize = 0;
+	_ElfReader io(ctx.fd, &ctx.getPlan());
+	for (const auto &prog: ctx.getProg()) {
+		if (prog.type != (int) PT::LOAD) continue;
+		if (prog.file_size > prog.mem_size) {
+			LOGE("ELF file invalid (p_filesz > p_memsz)");
+			return false;
+		}
+		SEEK(prog.offset);
+		READ(mem.data() + (prog.vaddr - addrMin), prog.file_size);
+		if (prog.vaddr - addrMin + prog.file_size > dataSize) dataSize = prog.vaddr - addrMin + prog.file_size;
+	}
+	
+	// Store the addend of every relocation in place, remembering which words need fixing up.
+	// Later relocations of the same word replace earlier ones, as with `relocate`.
+	const auto &dynSym = ctx.getDynSym();
+	std::map<uint32_t, Fixup>       fixups;
+	std::map<std::string, uint32_t> importIndex;
+	std::vector<Import>             imports;
+	ImageWriter writer;
+	for (const auto &sect: ctx.getSect()) {
+		if (sect.type == (int) SHT::REL) {
+			LOGE("REL relocations are not supported");
+			return false;
+		} else if (sect.type != (int) SHT::RELA) {
+			continue;
+		}
+		
+		for (size_t i = 0; i < sect.file_size / sect.entry_size; i++) {
+			RelaEntry entry;
+			SEEK(sect.offset + i * sect.entry_size);
+			READ(&entry, sizeof(entry));
+			
+			auto index = entry.symIndex();
+			if (index >= dynSym.size()) {
+				LOGE("ELF file invalid (r_sym = 0x%x)", (int) index);
+				return false;
+			}
+			auto &sym = dynSym[index];
+			
+			Addr offset = entry.offset - addrMin;
+			if (entry.offset < addrMin || offset >= mem.size() || mem.size() - offset < sizeof(Addr)) {
+				LOGE("Relocation at 0x%zx is outside loadable segments", (size_t) entry.offset);
+				return false;
+			} else if (offset % sizeof(Addr)) {
+				LOGE("Relocation at 0x%zx is misaligned", (size_t) entry.offset);
+				return false;
+			} else if (index && sym.section >= 0xff00) {
+				LOGE("Relocation against special section 0x%04x", sym.section);
+				return false;
+			}
+			
+			// Work out the word's link-time value and what is added to it at load time.
+			Addr value;
+			auto kind = relocationKind(entry.type());
+			if (kind == RelKind::RELATIVE) {
+				value = entry.addend;
+				fixups[offset] = { UINT32_MAX };
+			} else if (kind == RelKind::SYMBOL || kind == RelKind::SLOT) {
+				value = kind == RelKind::SYMBOL ? entry.addend : 0;
+				if (index == 0) {
+					fixups.erase(offset);
+				} else if (sym.section == 0) {
+					auto iter = importIndex.find(sym.name);
+					if (iter == importIndex.end()) {
+						iter = importIndex.emplace(sym.name, imports.size()).first;
+						imports.push_back({writer.string(sym.name), 0});
+					}
+					fixups[offset] = { iter->second };
+				} else {
+					value += sym.value;
+					fixups[offset] = { UINT32_MAX };
+				}
+			} else {
+				LOGE("Relocation type 0x%x cannot be converted", (int) entry.type());
+				return false;
+			}
+			
+			memcpy(mem.data() + offset, &value, sizeof(Addr));
+			if (offset + sizeof(Addr) > dataSize) dataSize = offset + sizeof(Addr);
+		}
+	}
+	
+	// Pack words that need the load base added into runs.
+	std::vector<Run>         runs;
+	std::vector<ImportReloc> relocs;
+	for (const auto &[offset, fixup]: fixups) {
+		if (fixup.import != UINT32_MAX) {
+			relocs.push_back({offset, fixup.import});
+		} else if (!runs.empty() && runs.back().offset + runs.back().count * sizeof(Addr) == offset) {
+			runs.back().count++;
+		} else {
+			runs.push_back({offset, 1});
+		}
+	}
+	
+	// Exports, in a perfect hash table.
+	std::vector<const SymInfo *> exports;
+	for (const auto &sym: dynSym) {
+		if (!isExport(sym)) continue;
+		for (auto other: exports) {
+			if (other->name == sym.name) {
+				LOGE("Duplicate symbol '%s'", sym.name.c_str());
+				return false;
+			}
+		}
+		exports.push_back(&sym);
+	}
+	std::vector<Export>   slots;
+	std::vector<uint32_t> seeds;
+	if (!buildExports(exports, slots, seeds, writer)) return false;
+	
+	// Protection of each segment.
+	std::vector<Region> regions;
+	for (const auto &prog: ctx.getProg()) {
+		if (prog.type != (int) PT::LOAD) continue;
+		regions.push_back({prog.vaddr - addrMin, prog.mem_size, prog.flags, 0});
+	}
+	
+	// Fill in the header.
+	Header head = {};
+	memcpy(head.magic, MAGIC, sizeof(MAGIC));
+	head.version  = VERSION;
+	head.machine  = ctx.getHeader().machine;
+	head.addrSize = sizeof(Addr);
+	head.vaddr    = addrMin;
+	head.memSize  = mem.size();
+	head.align    = align;
+	head.entry    = ctx.getHeader().entry;
+	head.dynamic  = 0;
+	for (const auto &prog: ctx.getProg()) {
+		if (prog.type == (int) PT::DYNAMIC) head.dynamic = prog.vaddr;
+	}
+	
+	// Tables and strings.
+	writer.image.resize(sizeof(Header));
+	head.runs    = writer.table(runs);
+	head.relocs  = writer.table(relocs);
+	head.imports = writer.table(imports);
+	head.exports = writer.table(slots);
+	head.seeds   = writer.table(seeds);
+	head.regions = writer.table(regions);
+	head.strings     = writer.image.size();
+	head.stringsSize = writer.strings.size();
+	writer.image.insert(writer.image.end(), writer.strings.begin(), writer.strings.end());
+	
+	// Memory image, without the trailing zeroes.
+	writer.image.resize((writer.image.size() + 7) & ~7, 0);
+	head.dataOffset = writer.image.size();
+	head.dataSize   = dataSize;
+	writer.image.insert(writer.image.end(), mem.begin(), mem.begin() + dataSize);
+	
+	memcpy(writer.image.data(), &head, sizeof(Header));
+	out = std::move(writer.image);
+	LOGD("Converted to %zu byte image: %zu runs, %zu imports, %zu exports", out.size(), runs.size(), imports.size(), exports.size());
+	return true;
+}
+
+
+
+// Check that a table lies within the first `size` bytes of an image.
+template<typename T>
+static bool checkTable(Table table, size_t size) {
+	return !(table.offset % alignof(T)) && table.offset <= size && (size - table.offset) / sizeof(T) >= table.count;
+}
+
+// Check the header of an image.
+static bool checkHeader(const Header &header) {
+	if (memcmp(header.magic, MAGIC, sizeof(MAGIC)) || header.version != VERSION || header.addrSize != sizeof(Addr)) {
+		LOGE("Fast-load image invalid (magic or version)");
+		return false;
+	} else if (machineType && header.machine != machineType) {
+		LOGE("Fast-load image has machine type 0x%04x", header.machine);
+		return false;
+	} else if (header.dataSize > header.memSize || header.dataOffset < sizeof(Header) || header.dataOffset > UINT32_MAX) {
+		LOGE("Fast-load image invalid (size)");
+		return false;
+	}
+	return true;
+}
+
+// Check the tables of an image, given everything up to the memory image.
+// All relocated words must lie in the data of the memory image.
+static bool checkTables(const Header &header, const uint8_t *meta) {
+	size_t size = header.dataOffset;
+	if (!checkTable<Run>(header.runs, size) || !checkTable<ImportReloc>(header.relocs, size)
+		|| !checkTable<Import>(header.imports, size) || !checkTable<Export>(header.exports, size)
+		|| !checkTable<uint32_t>(header.seeds, size) || !checkTable<Region>(header.regions, size)
+		|| header.strings > size || size - header.strings < header.stringsSize
+		|| (header.exports.count && !header.seeds.count)) {
+		LOGE("Fast-load image invalid (table bounds)");
+		return false;
+	}
+	
+	bool ok = true;
+	auto checkString = [&](String str) {
+		ok &= str.offset <= header.stringsSize && header.stringsSize - str.offset > str.length;
+	};
+	auto words = header.dataSize / sizeof(Addr);
+	auto runs  = (const Run *) (meta + header.runs.offset);
+	for (uint32_t i = 0; i < header.runs.count; i++) {
+		ok &= !(runs[i].offset % sizeof(Addr)) && runs[i].offset / sizeof(Addr) <= words && words - runs[i].offset / sizeof(Addr) >= runs[i].count;
+	}
+	auto relocs = (const ImportReloc *) (meta + header.relocs.offset);
+	for (uint32_t i = 0; i < header.relocs.count; i++) {
+		ok &= !(relocs[i].offset % sizeof(Addr)) && relocs[i].offset / sizeof(Addr) < words && relocs[i].import < header.imports.count;
+	}
+	auto imports = (const Import *) (meta + header.imports.offset);
+	for (uint32_t i = 0; i < header.imports.count; i++) {
+		checkString(imports[i].name);
+	}
+	auto exports = (const Export *) (meta + header.exports.offset);
+	for (uint32_t i = 0; i < header.exports.count; i++) {
+		checkString(exports[i].name);
+	}
+	auto regions = (const Region *) (meta + header.regions.offset);
+	for (uint32_t i = 0; i < header.regions.count; i++) {
+		ok &= regions[i].offset <= header.memSize && header.memSize - regions[i].offset >= regions[i].size;
+	}
+	if (!ok) {
+		LOGE("Fast-load image invalid (record bounds)");
+	}
+	return ok;
+}
+
+// Prelink an image for loading at `base`, with the imports taken from `map`.
+bool prelink(std::vector<uint8_t> &image, Addr base, const SymMap &map) {
+	if (image.size() < sizeof(Header)) {
+		LOGE("Fast-load image invalid (size)");
+		return false;
+	}
+	Header header;
+	memcpy(&header, image.data(), sizeof(Header));
+	if (!checkHeader(header) || image.size() - header.dataOffset < header.dataSize || !checkTables(header, image.data())) {
+		return false;
+	} else if (base % header.align) {
+		LOGE("Prelink address 0x%zx is not aligned to 0x%zx", (size_t) base, (size_t) header.align);
+		return false;
+	}
+	
+	// Resolve every import before changing anything.
+	auto imports = (Import *) (image.data() + header.imports.offset);
+	std::vector<Addr> values(header.imports.count);
+	for (uint32_t i = 0; i < header.imports.count; i++) {
+		auto name = (const char *) image.data() + header.strings + imports[i].name.offset;
+		auto iter = map.find(std::string(name, imports[i].name.length));
+		if (iter == map.end()) {
+			LOGE("Link error: Unresolved symbol '%.*s'", (int) imports[i].name.length, name);
+			return false;
+		}
+		values[i] = iter->second;
+	}
+	
+	// Move the words that depend on the load address.
+	auto mem   = image.data() + header.dataOffset;
+	Addr delta = base - header.vaddr;
+	auto runs  = (const Run *) (image.data() + header.runs.offset);
+	for (uint32_t i = 0; i < header.runs.count; i++) {
+		for (uint32_t j = 0; j < runs[i].count; j++) {
+			Addr word;
+			memcpy(&word, mem + runs[i].offset + j * sizeof(Addr), sizeof(Addr));
+			word += delta;
+			memcpy(mem + runs[i].offset + j * sizeof(Addr), &word, sizeof(Addr));
+		}
+	}
+	
+	// Bind the imports.
+	auto relocs = (const ImportReloc *) (image.data() + header.relocs.offset);
+	for (uint32_t i = 0; i < header.relocs.count; i++) {
+		Addr word;
+		memcpy(&word, mem + relocs[i].offset, sizeof(Addr));
+		word += values[relocs[i].import] - (Addr) imports[relocs[i].import].value;
+		memcpy(mem + relocs[i].offset, &word, sizeof(Addr));
+	}
+	for (uint32_t i = 0; i < header.imports.count; i++) {
+		imports[i].value = values[i];
+	}
+	
+	// Move the addresses in the metadata.
+	auto exports = (Export *) (image.data() + header.exports.offset);
+	for (uint32_t i = 0; i < header.exports.count; i++) {
+		exports[i].value += delta;
+	}
+	header.vaddr += delta;
+	header.entry += delta;
+	if (header.dynamic) header.dynamic += delta;
+	memcpy(image.data(), &header, sizeof(Header));
+	
+	LOGD("Prelinked for 0x%zx", (size_t) base);
+	return true;
+}
+
+// Read and check the header and tables.
+Image::Image(FILE *fd, LoadStats *stats): fd(fd), stats(stats), valid(false) {
+	PHASE(stats, HEADER);
+	
+	// Check the header.
+	_elf_count_read(0, sizeof(Header));
+	if (_elf_pread(fd, &header, sizeof(Header), 0) != sizeof(Header)) {
+		LOGE("I/O error: %s", strerror(errno));
+		return;
+	}
+	if (!checkHeader(header)) return;
+	
+	// Read everything up to the memory image.
+	meta.resize(header.dataOffset);
+	_elf_count_read(0, meta.size());
+	if (_elf_pread(fd, meta.data(), meta.size(), 0) != meta.size()) {
+		LOGE("I/O error: %s", strerror(errno));
+		return;
+	}
+	
+	// Check the tables, so that loading need not.
+	valid = checkTables(header, meta.data());
+}
+
+// Load into memory.
+Program Image::load(ELFFile::Allocator alloc) {
+	if (!valid) return {};
+	PHASE(stats, LOAD);
+	Program out;
+	
+	// Get memory.
+	out.vaddr_req = header.vaddr;
+	if (_elf_phase) _elf_phase->allocations++;
+	auto allocation = alloc(header.vaddr, header.memSize, header.align);
+	out.memory = (void *) allocation.first;
+	out.memory_cookie = (void *) allocation.second;
+	out.vaddr_real = allocation.first;
+	out.size = header.memSize;
+	out.align = header.align;
+	if (!out) {
+		LOGE("Unable to allocate %zu bytes for loading", out.size);
+		return {};
+	}
+	out.entry   = (void *) (header.entry + out.vaddr_offset());
+	out.dynamic = header.dynamic ? (void *) (header.dynamic + out.vaddr_offset()) : nullptr;
+	
+	// Read the memory image in one go.
+	_elf_count_read(header.dataOffset, header.dataSize);
+	if (_elf_pread(fd, out.memory, header.dataSize, header.dataOffset) != header.dataSize) {
+		LOGE("I/O error: %s", strerror(errno));
+		valid = false;
+		return out;
+	}
+	memset((uint8_t *) out.memory + header.dataSize, 0, header.memSize - header.dataSize);
+	TRACE(ELF_SEGMENT, out.vaddr_real, header.dataSize, header.memSize, 0);
+	
+	return out;
+}
+
+// Apply all relocations, taking imports from `map`.
+bool Image::relocate(const Program &program, const SymMap &map) const {
+	if (!valid) return false;
+	PHASE(stats, RELOCATE);
+	auto mem = (uint8_t *) program.memory;
+	
+	// Resolve each import once, as the difference from the value already in the image.
+	Addr base  = program.vaddr_offset();
+	bool bound = !base;
+	std::vector<Addr> values(header.imports.count);
+	auto imports = table<Import>(header.imports);
+	for (uint32_t i = 0; i < header.imports.count; i++) {
+		auto iter = map.find(std::string(string(imports[i].name), imports[i].name.length));
+		_elf_count_lookup(iter != map.end());
+		if (iter == map.end()) {
+			LOGE("Link error: Unresolved symbol '%.*s'", (int) imports[i].name.length, string(imports[i].name));
+			return false;
+		}
+		TRACE(ELF_SYM_IMPORT, i, iter->second);
+		values[i] = iter->second - imports[i].value;
+		bound &= !values[i];
+	}
+	
+	// A prelinked image at its prelinked address needs nothing done.
+	if (bound) {
+		LOGD("Image already linked for 0x%zx", (size_t) program.vaddr_real);
+		return true;
+	}
+	
+	// Add the load base to runs of words.
+	auto runs = table<Run>(header.runs);
+	for (uint32_t i = 0; base && i < header.runs.count; i++) {
+		auto words = (Addr *) (mem + runs[i].offset);
+		for (uint32_t j = 0; j < runs[i].count; j++) {
+			words[j] += base;
+		}
+	}
+	
+	// Add import values.
+	auto relocs = table<ImportReloc>(header.relocs);
+	for (uint32_t i = 0; i < header.relocs.count; i++) {
+		*(Addr *) (mem + relocs[i].offset) += values[relocs[i].import];
+	}
+	
+	return true;
+}
+
+// Find the address of an exported symbol, or 0 if it does not exist.
+size_t Image::findExport(const std::string &name, const Program &program) const {
+	if (!valid || !header.exports.count) return 0;
+	uint32_t hash  = gnuHash(name.c_str());
+	uint32_t seed  = table<uint32_t>(header.seeds)[hash % header.seeds.count];
+	auto    &entry = table<Export>(header.exports)[slotOf(hash, seed, header.exports.count)];
+	if (entry.hash != hash || entry.name.length != name.size() || memcmp(string(entry.name), name.data(), name.size())) {
+		return 0;
+	}
+	return entry.value + program.vaddr_offset();
+}
+
+// Extract exported symbols into the map.
+bool Image::exportSymbols(const Program &program, SymMap &map) const {
+	if (!valid) return false;
+	PHASE(stats, EXPORT);
+	auto exports = table<Export>(header.exports);
+	
+	// Check for duplicates before changing the map.
+	for (uint32_t i = 0; i < header.exports.count; i++) {
+		if (exports[i].bind != (int) STB::GLOBAL) continue;
+		std::string name(string(exports[i].name), exports[i].name.length);
+		auto existing = map.find(name);
+		_elf_count_lookup(existing != map.end());
+		if (existing != map.end()) {
+			LOGE("Duplicate symbol '%s'", name.c_str());
+			return false;
+		}
+	}
+	
+	// Weak symbols do not replace existing ones.
+	for (uint32_t i = 0; i < header.exports.count; i++) {
+		if (!exports[i].name.length) continue;
+		map.emplace(std::string(string(exports[i].name), exports[i].name.length), exports[i].value + program.vaddr_offset());
+	}
+	
+	return true;
+}
+
+// Get the MPU regions that protect the loaded program.
+std::vector<mpu::Region> Image::regions(const Program &program) const {
+	std::vector<mpu::Region> out;
+	if (!valid) return out;
+	auto regions = table<Region>(header.regions);
+	for (uint32_t i = 0; i < header.regions.count; i++) {
+		out.push_back({
+			// Compute address.
+			regions[i].offset + program.vaddr_real,
+			regions[i].size,
+			// Default privilege.
+			mpu::PRIV_MIN,
+			// Forwards permission flags.
+			!!(regions[i].flags & 0x4),
+			!!(regions[i].flags & 0x2),
+			!!(regions[i].flags & 0x1),
+			// Active region.
+			1
+		});
+	}
+	return mpu::pureMerge(out);
+}
+	
+} // namespace elf::fastload
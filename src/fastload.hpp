@@ -0,0 +1,229 @@
+/*
+	MIT License
+
+	Copyright (c) 2023 Julian Scheffers
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy
+	of this software and associated documentation files (the "Software"), to deal
+	in the Software without restriction, including without limitation the rights
+	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+	copies of the Software, and to permit persons to whom the Software is
+	furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <vector>
+
+#include "elfloader.hpp"
+#include "mpu.hpp"
+
+// Fast-load images: shared objects converted ahead of time by `convert`,
+// so that loading is one contiguous read and relocation is nearly straight-line code.
+//
+// The image holds the memory image of all loadable segments with addends already stored in place,
+// runs of words that only need the load base added, import relocations grouped by a deduplicated import table,
+// a perfect hash table of exports and the protection of each segment.
+//
+// An image can be prelinked for a fixed address and set of import values by `prelink`.
+// Words in the memory image then hold their final values, so that relocating the image at that address
+// with the same import values does nothing; elsewhere, only the differences are added.
+namespace elf::fastload {
+
+// Version of the image layout; bump when any of the structures below change.
+static const uint32_t VERSION = 2;
+
+// Location of a table in an image.
+struct Table {
+	// Offset from the start of the image.
+	uint32_t offset;
+	// Number of records.
+	uint32_t count;
+};
+
+// A string in the string pool.
+struct String {
+	// Offset in the string pool.
+	uint32_t offset;
+	// Length excluding the NUL terminator.
+	uint32_t length;
+};
+
+// A run of consecutive words to which the load base is added.
+struct Run {
+	// Offset of the first word from the start of the memory image.
+	uint32_t offset;
+	// Number of words.
+	uint32_t count;
+};
+
+// An imported symbol.
+struct Import {
+	// Name.
+	String   name;
+	// Value already added to the words that import it; 0 unless prelinked.
+	uint64_t value;
+};
+
+// A word to which the value of an import is added.
+struct ImportReloc {
+	// Offset of the word from the start of the memory image.
+	uint32_t offset;
+	// Index in the import table.
+	uint32_t import;
+};
+
+// An exported symbol, in a slot of the perfect hash table.
+struct Export {
+	// Link-time value.
+	uint64_t value;
+	// Name; empty for unused slots.
+	String   name;
+	// GNU hash of the name.
+	uint32_t hash;
+	// ELF symbol binding.
+	uint32_t bind;
+};
+
+// Protection of part of the memory image.
+struct Region {
+	// Offset from the start of the memory image.
+	uint64_t offset;
+	// Size in bytes.
+	uint64_t size;
+	// ELF segment flags: execute is bit 0, write bit 1 and read bit 2.
+	uint32_t flags;
+	// Padding bytes.
+	uint32_t _padding0;
+};
+
+// Header of an image.
+struct Header {
+	// Magic: "ELFFAST\0".
+	char     magic[8];
+	// Layout version.
+	uint32_t version;
+	// ELF machine type.
+	uint16_t machine;
+	// Size of `Addr` the image was made for.
+	uint16_t addrSize;
+	// Link-time address of the start of the memory image; `prelink` moves it to the prelinked address.
+	uint64_t vaddr;
+	// Size of the memory image.
+	uint64_t memSize;
+	// Alignment of the memory image.
+	uint64_t align;
+	// Link-time entrypoint address.
+	uint64_t entry;
+	// Link-time address of the dynamic segment, or 0 if none.
+	uint64_t dynamic;
+	// File offset of the data of the memory image.
+	uint64_t dataOffset;
+	// Size of the data; the rest of the memory image is zeroed.
+	uint64_t dataSize;
+	// Runs of words to add the load base to, as `Run`, sorted by offset.
+	Table    runs;
+	// Words to add import values to, as `ImportReloc`, sorted by offset.
+	Table    relocs;
+	// Imported symbols, as `Import`.
+	Table    imports;
+	// Perfect hash table of exports, as `Export`.
+	Table    exports;
+	// Per-bucket seeds of the perfect hash table, as `uint32_t`.
+	Table    seeds;
+	// Segment protection, as `Region`.
+	Table    regions;
+	// Offset of the string pool.
+	uint32_t strings;
+	// Size of the string pool.
+	uint32_t stringsSize;
+};
+
+// Magic at the start of an image.
+static const char MAGIC[8] = { 'E', 'L', 'F', 'F', 'A', 'S', 'T', 0 };
+
+// Get the slot of a name hash in a perfect hash table of `slots` slots.
+static inline uint32_t slotOf(uint32_t hash, uint32_t seed, uint32_t slots) {
+	uint32_t x = hash ^ (seed * 0x9e3779b9u);
+	x ^= x >> 16;
+	x *= 0x85ebca6bu;
+	x ^= x >> 13;
+	x *= 0xc2b2ae35u;
+	x ^= x >> 16;
+	return x % slots;
+}
+
+// Convert a shared object into a fast-load image.
+// Reads the dynamic information of `ctx` if that was not done yet.
+// Fails if the object has relocations that are not pointer-sized relative, symbol or slot relocations.
+// Returns success status.
+bool convert(ELFFile &ctx, std::vector<uint8_t> &out);
+// Prelink an image for loading at `base`, with the imports taken from `map`.
+// Relocating the result at `base` with the same import values skips all relocations;
+// anywhere else or with other values, it is relocated like any other image.
+// `base` must be aligned to the alignment of the image and all imports must be in `map`.
+// Returns success status; on failure, the image is unchanged.
+bool prelink(std::vector<uint8_t> &image, Addr base, const SymMap &map);
+
+// A fast-load image opened for loading.
+class Image {
+	public:
+		// File descriptor to use for loading.
+		// Not closed by this class.
+		FILE *fd;
+		// Optional instrumentation, filled in as the image is loaded.
+		// Not owned by this class.
+		LoadStats *stats;
+		
+	protected:
+		// This is a valid image for this machine.
+		bool valid;
+		// Image header.
+		Header header;
+		// Everything before the data of the memory image.
+		std::vector<uint8_t> meta;
+		
+		// Get a table of the image.
+		template<typename T>
+		const T *table(Table table) const { return (const T *) (meta.data() + table.offset); }
+		// Get a string from the string pool.
+		const char *string(String str) const { return (const char *) meta.data() + header.strings + str.offset; }
+		
+	public:
+		// Read and check the header and tables.
+		Image(FILE *fd, LoadStats *stats = nullptr);
+		
+		// Is this a VALID?
+		bool isValid() const { return valid; }
+		// Get read-only copy of header.
+		const auto &getHeader() const { return header; }
+		
+		// Load into memory.
+		Program load(ELFFile::Allocator alloc);
+		// Apply all relocations, taking imports from `map`.
+		// Does nothing to prelinked images loaded at the prelinked address with the prelinked import values.
+		bool relocate(const Program &program, const SymMap &map) const;
+		// Find the address of an exported symbol, or 0 if it does not exist.
+		size_t findExport(const std::string &name, const Program &program) const;
+		// Extract exported symbols into the map.
+		bool exportSymbols(const Program &program, SymMap &map) const;
+		// Get the MPU regions that protect the loaded program.
+		std::vector<mpu::Region> regions(const Program &program) const;
+};
+
+} // namespace elf::fastload
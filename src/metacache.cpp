@@ -0,0 +1,341 @@
+/*
+	MIT License
+
+	Copyright (c) 2023 Julian Scheffers
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy
+	of this software and associated documentation files (the "Software"), to deal
+	in the Software without restriction, including without limitation the rights
+	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+	copies of the Software, and to permit persons to whom the Software is
+	furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+
+
+#include "elfloader.hpp"
+#include "elfloader_int.hpp"
+
+namespace elf {
+
+// Magic at the start of a metadata blob.
+static const char cacheMagic[8] = { 'E', 'L', 'F', 'M', 'E', 'T', 'A', 0 };
+// Version of the blob layout; bump when any of the structures below change.
+static const uint32_t cacheVersion = 1;
+
+// Location of a table in a metadata blob.
+struct CacheTable {
+	// Offset from the start of the blob.
+	uint32_t offset;
+	// Number of records.
+	uint32_t count;
+};
+
+// Header of a metadata blob.
+struct CacheHeader {
+	// Magic: "ELFMETA\0".
+	char       magic[8];
+	// Layout version.
+	uint32_t   version;
+	// Size of `Addr` on the host that made the blob.
+	uint16_t   addrSize;
+	// Machine type the blob was made for.
+	uint16_t   machine;
+	// Key the blob was made with.
+	uint64_t   key;
+	// Total size of the blob.
+	uint32_t   size;
+	// Size of the string pool.
+	uint32_t   stringsSize;
+	// Offset of the string pool.
+	uint32_t   strings;
+	// Padding bytes.
+	uint32_t   _padding0;
+	// Program headers, as `ProgHeader`.
+	CacheTable prog;
+	// Section headers, as `CacheSect`.
+	CacheTable sect;
+	// Non-alocable symbols, as `CacheSym`.
+	CacheTable sym;
+	// Alocable symbols, as `CacheSym`.
+	CacheTable dynSym;
+	// Needed dynamic libraries, as `CacheString`.
+	CacheTable dynLibs;
+	// Raw file data, as `CacheData`.
+	CacheTable data;
+	// The ELF header.
+	Header     header;
+};
+
+// A string in the string pool.
+struct CacheString {
+	// Offset in the string pool.
+	uint32_t offset;
+	// Length excluding the NUL terminator.
+	uint32_t length;
+};
+
+// A section header with its name.
+struct CacheSect {
+	SectHeader  header;
+	CacheString name;
+};
+
+// A symbol with its name and name hash.
+struct CacheSym {
+	SymEntry    entry;
+	CacheString name;
+	uint32_t    hash;
+};
+
+// Raw data from the ELF file, such as a relocation table.
+struct CacheData {
+	// Offset in the ELF file.
+	uint64_t offset;
+	// Size in bytes.
+	uint64_t size;
+	// Offset in the blob.
+	uint64_t blobOffset;
+};
+
+
+
+// Compute a hash of the entire contents of an ELF file, to key cached metadata.
+uint64_t contentHash(FILE *fd) {
+	const size_t chunk = 16384;
+	uint64_t buf[chunk / 8];
+	uint64_t hash   = 0xcbf29ce484222325llu;
+	uint64_t offset = 0;
+	
+	while (1) {
+		size_t len = _elf_pread(fd, buf, chunk, offset);
+		_elf_count_read(offset, len);
+		
+		// Mix in whole words, then the remaining bytes.
+		size_t words = len / 8;
+		for (size_t i = 0; i < words; i++) {
+			hash = (hash ^ buf[i]) * 0x100000001b3llu;
+			hash ^= hash >> 29;
+		}
+		for (size_t i = words * 8; i < len; i++) {
+			hash = (hash ^ ((uint8_t *) buf)[i]) * 0x100000001b3llu;
+		}
+		
+		offset += len;
+		if (len < chunk) break;
+	}
+	
+	// Mix in the length, so that trailing zeroes change the hash.
+	hash = (hash ^ offset) * 0x100000001b3llu;
+	return hash ^ (hash >> 32);
+}
+
+
+
+// Appends records and strings to a metadata blob.
+class CacheWriter {
+	public:
+		// Blob under construction.
+		std::vector<uint8_t> blob;
+		// String pool.
+		std::vector<char>    strings;
+		
+		// Append a table of records, aligned to 8 bytes.
+		template<typename T>
+		CacheTable table(const std::vector<T> &records) {
+			blob.resize((blob.size() + 7) & ~7, 0);
+			CacheTable out = { (uint32_t) blob.size(), (uint32_t) records.size() };
+			auto ptr = (const uint8_t *) records.data();
+			blob.insert(blob.end(), ptr, ptr + records.size() * sizeof(T));
+			return out;
+		}
+		
+		// Add a string to the pool.
+		CacheString string(const std::string &str) {
+			CacheString out = { (uint32_t) strings.size(), (uint32_t) str.size() };
+			strings.insert(strings.end(), str.begin(), str.end());
+			strings.push_back(0);
+			return out;
+		}
+		
+		// Convert symbols to records.
+		std::vector<CacheSym> symbols(const std::vector<SymInfo> &in) {
+			std::vector<CacheSym> out;
+			for (const auto &sym: in) {
+				out.push_back({sym, string(sym.name), sym.hash});
+			}
+			return out;
+		}
+};
+
+// Serialise the parsed metadata into a blob keyed by `key`.
+std::vector<uint8_t> ELFFile::saveMetadata(uint64_t key) const {
+	if (!valid) return {};
+	CacheWriter writer;
+	CacheHeader head = {};
+	memcpy(head.magic, cacheMagic, sizeof(cacheMagic));
+	head.version  = cacheVersion;
+	head.addrSize = sizeof(Addr);
+	head.machine  = header.machine;
+	head.key      = key;
+	head.header   = header;
+	writer.blob.resize(sizeof(CacheHeader));
+	
+	// Headers and symbols.
+	head.prog = writer.table(progHeaders);
+	std::vector<CacheSect> sects;
+	for (const auto &sect: sectHeaders) {
+		sects.push_back({sect, writer.string(sect.name)});
+	}
+	head.sect   = writer.table(sects);
+	head.sym    = writer.table(writer.symbols(symbols));
+	head.dynSym = writer.table(writer.symbols(dynSym));
+	std::vector<CacheString> libs;
+	for (const auto &lib: dynLibs) {
+		libs.push_back(writer.string(lib));
+	}
+	head.dynLibs = writer.table(libs);
+	
+	// Relocation tables, so `relocate` need not read the file.
+	std::vector<CacheData> data;
+	std::vector<uint8_t>   raw;
+	for (const auto &sect: sectHeaders) {
+		if (sect.type != (int) SHT::RELA && sect.type != (int) SHT::REL) continue;
+		size_t pos = raw.size();
+		raw.resize(pos + ((sect.file_size + 7) & ~7), 0);
+		_ElfReader io(fd, &plan);
+		io.pos = sect.offset;
+		if (!io.read(raw.data() + pos, sect.file_size)) {
+			LOGE("I/O error: %s", strerror(errno));
+			return {};
+		}
+		data.push_back({sect.offset, sect.file_size, pos});
+	}
+	head.data = writer.table(data);
+	writer.blob.resize((writer.blob.size() + 7) & ~7, 0);
+	for (auto &entry: data) {
+		entry.blobOffset += writer.blob.size();
+	}
+	memcpy(writer.blob.data() + head.data.offset, data.data(), data.size() * sizeof(CacheData));
+	writer.blob.insert(writer.blob.end(), raw.begin(), raw.end());
+	
+	// String pool.
+	head.strings     = writer.blob.size();
+	head.stringsSize = writer.strings.size();
+	writer.blob.insert(writer.blob.end(), writer.strings.begin(), writer.strings.end());
+	
+	head.size = writer.blob.size();
+	memcpy(writer.blob.data(), &head, sizeof(CacheHeader));
+	return writer.blob;
+}
+
+
+
+// Get a table from a metadata blob, or null if it is out of bounds.
+template<typename T>
+static const T *cacheTable(const uint8_t *blob, size_t size, CacheTable table) {
+	if (table.offset % alignof(T) || table.offset > size || (size - table.offset) / sizeof(T) < table.count) {
+		return nullptr;
+	}
+	return (const T *) (blob + table.offset);
+}
+
+// Get a string from the pool of a metadata blob.
+// Returns success status.
+static bool cacheString(std::string &out, const CacheHeader &head, const uint8_t *blob, CacheString str) {
+	if (str.offset > head.stringsSize || head.stringsSize - str.offset < str.length) return false;
+	out.assign((const char *) blob + head.strings + str.offset, str.length);
+	return true;
+}
+
+// Restore the results of `read` or `readDyn` from a blob made by `saveMetadata`.
+bool ELFFile::loadMetadata(const void *blobPtr, size_t size, uint64_t key) {
+	auto blob = (const uint8_t *) blobPtr;
+	if ((size_t) blob % 8 || size < sizeof(CacheHeader)) {
+		LOGW("Metadata cache invalid (size or alignment)");
+		return false;
+	}
+	
+	// Validate the key and layout.
+	const auto &head = *(const CacheHeader *) blob;
+	if (memcmp(head.magic, cacheMagic, sizeof(cacheMagic)) || head.version != cacheVersion || head.addrSize != sizeof(Addr)) {
+		LOGW("Metadata cache invalid (magic or version)");
+		return false;
+	} else if (head.key != key) {
+		LOGI("Metadata cache is stale");
+		return false;
+	} else if (head.size > size || head.strings > head.size || head.size - head.strings < head.stringsSize) {
+		LOGW("Metadata cache invalid (size)");
+		return false;
+	} else if (machineType && head.machine != machineType) {
+		LOGW("Metadata cache has machine type 0x%04x", head.machine);
+		return false;
+	}
+	
+	auto prog   = cacheTable<ProgHeader>(blob, head.size, head.prog);
+	auto sect   = cacheTable<CacheSect>(blob, head.size, head.sect);
+	auto sym    = cacheTable<CacheSym>(blob, head.size, head.sym);
+	auto dsym   = cacheTable<CacheSym>(blob, head.size, head.dynSym);
+	auto libs   = cacheTable<CacheString>(blob, head.size, head.dynLibs);
+	auto data   = cacheTable<CacheData>(blob, head.size, head.data);
+	if (!prog || !sect || !sym || !dsym || !libs || !data) {
+		LOGW("Metadata cache invalid (table bounds)");
+		return false;
+	}
+	
+	// Decode into temporaries, so nothing is restored on failure.
+	std::vector<ProgInfo>    newProg(prog, prog + head.prog.count);
+	std::vector<SectInfo>    newSect(head.sect.count);
+	std::vector<SymInfo>     newSym(head.sym.count);
+	std::vector<SymInfo>     newDynSym(head.dynSym.count);
+	std::vector<std::string> newLibs(head.dynLibs.count);
+	bool ok = true;
+	for (size_t i = 0; i < newSect.size(); i++) {
+		(SectHeader &) newSect[i] = sect[i].header;
+		ok &= cacheString(newSect[i].name, head, blob, sect[i].name);
+	}
+	auto syms = [&](std::vector<SymInfo> &out, const CacheSym *in) {
+		for (size_t i = 0; i < out.size(); i++) {
+			(SymEntry &) out[i] = in[i].entry;
+			out[i].hash = in[i].hash;
+			ok &= cacheString(out[i].name, head, blob, in[i].name);
+		}
+	};
+	syms(newSym, sym);
+	syms(newDynSym, dsym);
+	for (size_t i = 0; i < newLibs.size(); i++) {
+		ok &= cacheString(newLibs[i], head, blob, libs[i]);
+	}
+	for (size_t i = 0; i < head.data.count; i++) {
+		ok &= data[i].blobOffset <= head.size && head.size - data[i].blobOffset >= data[i].size;
+	}
+	if (!ok) {
+		LOGW("Metadata cache invalid (string or data bounds)");
+		return false;
+	}
+	
+	// Everything checks out.
+	header      = head.header;
+	progHeaders = std::move(newProg);
+	sectHeaders = std::move(newSect);
+	symbols     = std::move(newSym);
+	dynSym      = std::move(newDynSym);
+	dynLibs     = std::move(newLibs);
+	for (size_t i = 0; i < head.data.count; i++) {
+		plan.insert(data[i].offset, data[i].size, blob + data[i].blobOffset);
+	}
+	valid = true;
+	return true;
+}
+
+} // namespace elf
@@ -23,8 +23,8 @@
 */
 
 #include "mpu.hpp"
+#include "elfloader_int.hpp"
 
-#include <iostream>
 #include <algorithm>
 
 using namespace elf;
@@ -75,11 +75,15 @@ bool appendRegion(Region wdata) { return false; }
 // Entries may be in the list but empty.
 std::vector<Region> readRegions() __attribute__((weak));
 std::vector<Region> readRegions() { return {}; }
+// Determine how many MPU entries it takes to append a list of regions in order.
+int entriesNeeded(const std::vector<Region> &regions) __attribute__((weak));
+int entriesNeeded(const std::vector<Region> &regions) { return regions.size(); }
 
 
 
 // Merge regions of the same type into a new list.
 std::vector<Region> pureMerge(const std::vector<Region> &regions) {
+	if (regions.empty()) return {};
 	std::vector<size_t> boundaries;
 	boundaries.reserve(regions.size() * 2);
 	
@@ -129,7 +133,8 @@ std::vector<Region> pureMerge(const std::vector<Region> &regions) {
 	
 	// Merge contiguous identical regions.
 	for (size_t i = 1; i < out.size();) {
-		if (out[i-1].rwx() == out[i].rwx() && out[i-1].privilege == out[i].privilege) {
+		bool contiguous = out[i-1].base + out[i-1].size == out[i].base;
+		if (contiguous && out[i-1].rwx() == out[i].rwx() && out[i-1].privilege == out[i].privilege) {
 			out[i-1].size += out[i].size;
 			out.erase(out.begin() + i);
 		} else {
@@ -140,11 +145,76 @@ std::vector<Region> pureMerge(const std::vector<Region> &regions) {
 	return out;
 }
 
+// Determine how many bytes gain permissions when merging two regions.
+static uint64_t mergeCost(const Region &a, const Region &b) {
+	uint8_t  rwx  = a.rwx() | b.rwx();
+	uint64_t cost = 0;
+	if (rwx != a.rwx()) cost += a.size;
+	if (rwx != b.rwx()) cost += b.size;
+	return cost;
+}
+
+// Merge region `b` into the region `a` that precedes it.
+static void mergeInto(Region &a, const Region &b) {
+	a.size   = b.base + b.size - a.base;
+	a.read  |= b.read;
+	a.write |= b.write;
+	a.exec  |= b.exec;
+}
+
+// Aggressively merge regions, even if that means losing information.
+std::vector<Region> lossyMerge(const std::vector<Region> &in) {
+	std::vector<Region> out = pureMerge(in);
+	
+	// Every contiguous run becomes one region with the union of its permissions.
+	for (size_t i = 1; i < out.size();) {
+		if (out[i-1].base + out[i-1].size == out[i].base) {
+			mergeInto(out[i-1], out[i]);
+			out.erase(out.begin() + i);
+		} else {
+			i++;
+		}
+	}
+	
+	return out;
+}
+
+// Merge contiguous regions until they fit in `budget` MPU entries.
+std::vector<Region> planRegions(const std::vector<Region> &in, int budget) {
+	std::vector<Region> out = pureMerge(in);
+	
+	while (entriesNeeded(out) > budget) {
+		// Find the cheapest pair of contiguous regions to merge.
+		size_t   best     = 0;
+		uint64_t bestCost = UINT64_MAX;
+		for (size_t i = 1; i < out.size(); i++) {
+			if (out[i-1].base + out[i-1].size != out[i].base) continue;
+			uint64_t cost = mergeCost(out[i-1], out[i]);
+			if (cost < bestCost) {
+				best     = i;
+				bestCost = cost;
+			}
+		}
+		
+		// Nothing left to merge.
+		if (!best) return {};
+		
+		mergeInto(out[best-1], out[best]);
+		out.erase(out.begin() + best);
+	}
+	
+	return out;
+}
+
 // Set memory protections based on program headers.
 bool applyPH(const ELFFile &ctx, const Program &program) {
+	PHASE(ctx.stats, MPU);
 	std::vector<Region> tmp;
 	
-	for (const auto &prog: ctx.getProg()) {
+	// Programs loaded with a padded layout can use the widened segments.
+	auto segs = program.region_granularity ? ctx.napotSegments(program.region_granularity) : ctx.getProg();
+	
+	for (const auto &prog: segs) {
 		// Skip non-resident segments.
 		if (prog.type != (int) PT::LOAD) continue;
 		
@@ -173,9 +243,81 @@ bool applyPH(const ELFFile &ctx, const Program &program) {
 	return true;
 }
 
+// Sections that are no longer written to after relocation.
+static bool isRelro(const std::string &name) {
+	return name == ".got" || name == ".got.plt" || name == ".data.rel.ro"
+		|| name == ".init_array" || name == ".fini_array" || name == ".preinit_array"
+		|| name == ".dynamic";
+}
+
+// Find the loaded segment containing a virtual address.
+static const ProgInfo *findSegment(const ELFFile &ctx, Addr vaddr) {
+	for (const auto &prog: ctx.getProg()) {
+		if (prog.type != (int) PT::LOAD) continue;
+		if (vaddr >= prog.vaddr && vaddr < prog.vaddr + prog.mem_size) return &prog;
+	}
+	return nullptr;
+}
+
 // Set memory protections based on section headers.
 bool applySect(const ELFFile &ctx, const Program &program) {
-	return false;
+	PHASE(ctx.stats, MPU);
+	std::vector<Region> tmp;
+	std::vector<const ProgInfo *> segs;
+	
+	for (const auto &sect: ctx.getSect()) {
+		// Skip non-resident sections.
+		if (!(sect.flags & (Addr) SHF::ALLOC) || !sect.file_size) continue;
+		
+		tmp.push_back({
+			// Compute address.
+			sect.vaddr + program.vaddr_offset(),
+			sect.file_size,
+			// Default privilege.
+			PRIV_MIN,
+			// Section permission flags.
+			true,
+			(sect.flags & (Addr) SHF::WRITE) && !isRelro(sect.name),
+			!!(sect.flags & (Addr) SHF::EXECINSTR),
+			// Active region.
+			1
+		});
+		segs.push_back(findSegment(ctx, sect.vaddr));
+	}
+	
+	// Without section headers, fall back to segments.
+	if (tmp.empty()) return applyPH(ctx, program);
+	
+	// Extend sections over alignment gaps within the same segment, so they can be merged.
+	std::vector<size_t> order(tmp.size());
+	for (size_t i = 0; i < order.size(); i++) order[i] = i;
+	std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return tmp[a].base < tmp[b].base; });
+	for (size_t i = 1; i < order.size(); i++) {
+		auto &prev = tmp[order[i-1]];
+		auto &next = tmp[order[i]];
+		if (segs[order[i-1]] && segs[order[i-1]] == segs[order[i]] && prev.base + prev.size < next.base) {
+			prev.size = next.base - prev.base;
+		}
+	}
+	
+	// Round outwards to the MPU granularity; shared granules get the union of permissions.
+	size_t gran = granularity();
+	for (auto &region: tmp) {
+		uint64_t end = (region.base + region.size + gran - 1) / gran * gran;
+		region.base  = region.base / gran * gran;
+		region.size  = end - region.base;
+	}
+	
+	// Fit the regions in the free MPU entries, merging towards segment granularity if need be.
+	tmp = planRegions(tmp, regionMax() - regionCount());
+	if (tmp.empty()) return applyPH(ctx, program);
+	
+	for (const auto &region: tmp) {
+		auto res = appendRegion(region);
+		if (!res) return false;
+	}
+	
+	return true;
 }
 
 };
@@ -69,7 +69,7 @@ struct Region {
 	
 	// Combines read, write and execute into a single number.
 	// Read is bit 0, write bit 1 and execute bit 2.
-	uint8_t rwx() {
+	uint8_t rwx() const {
 		return read | (write << 1) | (exec << 2);
 	}
 };
@@ -95,13 +95,22 @@ bool appendRegion(Region wdata);
 // Entries may be in the list but empty.
 std::vector<Region> readRegions();
 
+// Determine how many MPU entries it takes to append a list of regions in order.
+int entriesNeeded(const std::vector<Region> &regions);
+
 // Merge regions of the same type into a new list.
 std::vector<Region> pureMerge(const std::vector<Region> &in);
 // Aggressively merge regions, even if that means losing information.
 std::vector<Region> lossyMerge(const std::vector<Region> &in);
+// Merge contiguous regions until they fit in `budget` MPU entries.
+// Merges that grant the fewest bytes extra permissions are made first.
+// Returns an empty list if the regions cannot be made to fit.
+std::vector<Region> planRegions(const std::vector<Region> &in, int budget);
 // Set memory protections based on program headers.
 bool applyPH(const elf::ELFFile &ctx, const elf::Program &program);
 // Set memory protections based on section headers.
+// Should be called after relocation, as relocated data such as `.got` is made read-only.
+// Falls back to `applyPH` if there are not enough free MPU entries.
 bool applySect(const elf::ELFFile &ctx, const elf::Program &program);
 
 };
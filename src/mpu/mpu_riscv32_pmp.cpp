@@ -23,12 +23,22 @@
 */
 
 #include "mpu.hpp"
-#include <iostream>
+#include "elfloader_trace.hpp"
+#include <algorithm>
 
+#ifdef ELFLOADER_PMP_SIM
+#include "mpu/pmp_sim.hpp"
+#endif
 
 
-// PMP region count: either 16 or 64.
+
+// Maximum PMP region count: either 16 or 64.
+// The number actually implemented is probed at runtime, but only up to this many entries.
+// Set to 64 (CMake option `ELFLOADER_PMP_REGIONS`) only for cores with the upper PMP CSRs
+// (privileged spec 1.12 and later); older cores trap on access to them.
+#ifndef PMP_REGIONS
 #define PMP_REGIONS 16
+#endif
 // Lock entries when appending.
 #define PMP_LOCK 0
 // Enable TOR merging optimisation.
@@ -108,6 +118,7 @@ bool setActive(bool activity) {
 }
 
 
+#ifndef ELFLOADER_PMP_SIM
 // Read all PMP regions and addresses.
 static void readAll(size_t *pmpcfgRaw, size_t *pmpaddr) {
 	// Unfortunately, the CSRs are not indexable, only addressable.
@@ -229,12 +240,6 @@ static size_t readCfgRaw(int index) {
 	return out;
 }
 
-// Read mpm*cfg by index.
-static uint8_t readCfg(int index) {
-	size_t raw = readCfgRaw(index / 4);
-	return raw >> (index*8);
-}
-
 // Read pmpaddr* register by index.
 static size_t readAddr(int index) {
 	size_t out;
@@ -337,18 +342,6 @@ static void writeCfgRaw(int index, size_t in) {
 	}
 }
 
-// Write pmp*cfg by index.
-static void writeCfg(int index, uint8_t in) {
-	// This is packed, read the entire CSR.
-	size_t orig = readCfgRaw(index/4);
-	// Mask out the part to write.
-	orig &= ~(0xff << (index*8));
-	// Put in new data.
-	orig |= in << (index*8);
-	// Write back.
-	writeCfgRaw(index/4, orig);
-}
-
 // Write pmpaddr* register by index.
 static void writeAddr(int index, size_t in) {
 	// Long live the stupidly long switch case!
@@ -422,15 +415,135 @@ static void writeAddr(int index, size_t in) {
 	}
 }
 
+#else
+// Read all PMP regions and addresses.
+static void readAll(size_t *pmpcfgRaw, size_t *pmpaddr) {
+	for (int i = 0; i < PMP_REGIONS / 4; i++) {
+		pmpcfgRaw[i] = pmpsim::readCfgRaw(i);
+	}
+	for (int i = 0; i < PMP_REGIONS; i++) {
+		pmpaddr[i] = pmpsim::readAddr(i);
+	}
+}
+
+// Read pmpcfg* register by index.
+static size_t readCfgRaw(int index) {
+	return pmpsim::readCfgRaw(index);
+}
+
+// Read pmpaddr* register by index.
+static size_t readAddr(int index) {
+	return pmpsim::readAddr(index);
+}
+
+// Write pmpcfg* register by index.
+static void writeCfgRaw(int index, size_t in) {
+	pmpsim::writeCfgRaw(index, in);
+}
+
+// Write pmpaddr* register by index.
+static void writeAddr(int index, size_t in) {
+	pmpsim::writeAddr(index, in);
+}
+#endif
+
+// Read mpm*cfg by index.
+static uint8_t readCfg(int index) {
+	size_t raw = readCfgRaw(index / 4);
+	return raw >> (index % 4 * 8);
+}
+
+// Write pmp*cfg by index.
+static void writeCfg(int index, uint8_t in) {
+	// This is packed, read the entire CSR.
+	size_t orig = readCfgRaw(index/4);
+	// Mask out the part to write.
+	orig &= ~((size_t) 0xff << (index % 4 * 8));
+	// Put in new data.
+	orig |= (size_t) in << (index % 4 * 8);
+	// Write back.
+	writeCfgRaw(index/4, orig);
+}
+
+// Number of implemented PMP entries, -1 if not yet probed.
+static int pmpCount = -1;
+// PMP granularity in bytes.
+static size_t pmpGranularity = 4;
+#ifdef ELFLOADER_PMP_SIM
+// Simulator configuration that was probed.
+static unsigned pmpProbed;
+#endif
+
+// Determine the number of implemented entries and the granularity.
+// Entries in use are not touched; free entries have their address restored after probing.
+static void probe() {
+	pmpCount       = 0;
+	pmpGranularity = 4;
+	bool haveGranularity = false;
+	
+	for (int i = 0; i < PMP_REGIONS; i++) {
+		// Entries in use are obviously implemented.
+		if (readCfg(i) & 0x98) {
+			pmpCount = i + 1;
+			continue;
+		}
+		// So is the base of a TOR entry above; writing it would be ignored if that entry is locked,
+		// or briefly change the range that entry protects if it is not.
+		if (i + 1 < PMP_REGIONS && (PMPA) ((readCfg(i + 1) >> 3) & 3) == PMPA::TOR) {
+			pmpCount = i + 1;
+			continue;
+		}
+		
+		// Unimplemented entries are hardwired to zero.
+		size_t orig  = readAddr(i);
+		writeAddr(i, -1);
+		size_t gmask = readAddr(i);
+		writeAddr(i, orig);
+		if (!gmask) break;
+		pmpCount = i + 1;
+		
+		// Address bits below G read as zero for entries that are off.
+		if (!haveGranularity) {
+			pmpGranularity  = (gmask & -gmask) * 4;
+			haveGranularity = true;
+		}
+	}
+	
+	TRACE(MPU_PROBE, pmpCount, pmpGranularity);
+}
+
+// Probe the PMP if that has not been done yet.
+static void ensureProbed() {
+	#ifdef ELFLOADER_PMP_SIM
+	if (pmpProbed != pmpsim::generation()) {
+		pmpProbed = pmpsim::generation();
+		pmpCount  = -1;
+	}
+	#endif
+	if (pmpCount < 0) probe();
+}
+
+// Determine which PMP entries are in use.
+// The address-only entry below a TOR entry also counts as used.
+static void findUsed(bool *used) {
+	ensureProbed();
+	for (int i = 0; i < pmpCount; i += 4) {
+		size_t cfgRaw = readCfgRaw(i/4);
+		for (int j = 0; j < 4 && i + j < pmpCount; j++) {
+			uint8_t cfg = cfgRaw >> (j*8);
+			used[i+j] = cfg & 0x98;
+			if (i + j && (PMPA) ((cfg >> 3) & 3) == PMPA::TOR) used[i+j-1] = true;
+		}
+	}
+}
+
 // Find the first empty PMP region.
 // Returns -1 if not found.
 static int findEmpty() {
-	for (int i = 0; i < PMP_REGIONS; i += 4) {
-		size_t cfgRaw = readCfgRaw(i);
-		for (int j = 0; j < 4; j++) {
-			uint8_t cfg = cfgRaw >> (j*8);
-			if (!(cfg & 0x98)) return i+j;
-		}
+	bool used[PMP_REGIONS];
+	findUsed(used);
+	for (int i = 0; i < pmpCount; i++) {
+		if (!used[i]) return i;
 	}
 	return -1;
 }
@@ -438,16 +551,10 @@ static int findEmpty() {
 // Find the first pair of two empty PMP regions.
 // Returns index of lower PMP entry, -1 if not found.
 static int findEmptyPair() {
-	size_t pmpPrev = 0xffffffff;
-	for (int i = 0; i < PMP_REGIONS; i += 4) {
-		size_t cfgRaw = readCfgRaw(i/4);
-		if (!(pmpPrev & 0x98000000) && !(cfgRaw & 0x98)) return i-1;
-		for (int j = 0; j < 3; j++) {
-			uint8_t cfg0 = cfgRaw >> (j*8);
-			uint8_t cfg1 = cfgRaw >> (j*8+8);
-			if (!(cfg0 & 0x98) && !(cfg1 & 0x98)) return i+j;
-		}
-		pmpPrev = cfgRaw;
+	bool used[PMP_REGIONS];
+	findUsed(used);
+	for (int i = 0; i + 1 < pmpCount; i++) {
+		if (!used[i] && !used[i+1]) return i;
 	}
 	return -1;
 }
@@ -455,21 +562,52 @@ static int findEmptyPair() {
 
 // Get current number of regions.
 int regionCount() {
-	return 0;
+	bool used[PMP_REGIONS];
+	findUsed(used);
+	int count = 0;
+	for (int i = 0; i < pmpCount; i++) {
+		count += used[i];
+	}
+	return count;
 }
 
 // Get maximum number of regions in current configuration.
 int regionMax() {
-	return PMP_REGIONS;
+	ensureProbed();
+	return pmpCount;
 }
 
 // Determine granularity.
 size_t granularity() {
-	int slot = findEmpty();
-	writeAddr(slot, -1);
-	auto gmask = readAddr(slot);
-	auto granularity = ~gmask + 1;
-	return granularity * 4;
+	ensureProbed();
+	return pmpGranularity;
+}
+
+// Determine how many MPU entries it takes to append a list of regions in order.
+// Assumes the regions are appended to consecutive free entries.
+int entriesNeeded(const std::vector<Region> &regions) {
+	int      used    = 0;
+	int      need    = 0;
+	bool     prevTor = false;
+	uint64_t prevTop = 0;
+	
+	for (const auto &region: regions) {
+		if (!region.size) continue;
+		bool isLong = region.base % region.size || (region.size & (region.size-1));
+		
+		// A pair of free entries is searched for even if only one ends up being used.
+		need = std::max(need, used + (isLong ? 2 : 1));
+		if (isLong && PMP_TOR_MERGING && prevTor && prevTop == region.base) {
+			used += 1;
+		} else {
+			used += isLong ? 2 : 1;
+		}
+		
+		prevTor = isLong;
+		prevTop = region.base + region.size;
+	}
+	
+	return need;
 }
 
 // Determine whether two [start,start+len) ranges overlap.
@@ -556,79 +694,42 @@ bool appendRegion(Region wdata) {
 	// Find an empty slot.
 	int slot = isLong ? findEmptyPair() : findEmpty();
 	if (slot < 0) {
-		std::cout << "MPU: Out of entries.\n";
+		TRACE(MPU_OUT_OF_ENTRIES, wdata.base, wdata.size);
 		return false;
 	}
 	
-	// Determine address granularity.
-	std::cout << "Slot: " << std::dec << slot << '\n';
-	writeAddr(slot, -1);
-	auto gmask = readAddr(slot);
-	auto granularity = ~gmask + 1;
-	
 	// Enforce granularity requirements.
-	if ((wdata.base | wdata.size) & 3) {
-		std::cout << "MPU: Granularity error (4).\n";
-		return false;
-	}
-	if ((wdata.base >> 2) & ~gmask || (wdata.size >> 2) & ~gmask) {
-		std::cout << "MPU: Granularity error (0x" << std::hex << granularity << std::dec << ").\n";
+	if ((wdata.base | wdata.size) & (pmpGranularity - 1)) {
+		TRACE(MPU_GRANULARITY, wdata.base, wdata.size, pmpGranularity);
 		return false;
 	}
 	
+	// Generate config.
+	uint8_t config = PMP_LOCK * 0x80;
+	if (wdata.read)  config |= 0x01;
+	if (wdata.write) config |= 0x02;
+	if (wdata.exec)  config |= 0x04;
+	
 	// Choose strategy.
 	if (isLong && PMP_TOR_MERGING && readAddr(slot-1) == (wdata.base >> 2)) {
 		// Single-entry TOR strategy.
-		std::cout << "TOR (1):\n";
-		std::cout << "  Base: 0x" << std::hex << wdata.base << '\n';
-		std::cout << "  Size: 0x" << std::hex << wdata.size << '\n';
-		std::cout << "  Adr0: 0x" << (wdata.base >> 2) << '\n';
-		std::cout << "  Adr1: 0x" << ((wdata.base >> 2) + (wdata.size >> 2)) << '\n';
+		TRACE(MPU_TOR1, slot, wdata.base, wdata.size, config | 0x08);
 		writeAddr(slot, (wdata.base >> 2) + (wdata.size >> 2));
-		// Generate config.
-		uint8_t config = PMP_LOCK * 0x80;
-		if (wdata.read)  config |= 0x01;
-		if (wdata.write) config |= 0x02;
-		if (wdata.exec)  config |= 0x04;
-		std::cout << "  Cfg:  0x" << (config | 0x08) << '\n';
-		std::cout << '\n';
 		writeCfg(slot, config | 0x08);
 		
 	} else if (isLong) {
 		// Two-entry TOR strategy.
-		std::cout << "TOR (2):\n";
-		std::cout << "  Base: 0x" << std::hex << wdata.base << '\n';
-		std::cout << "  Size: 0x" << std::hex << wdata.size << '\n';
-		std::cout << "  Adr0: 0x" << (wdata.base >> 2) << '\n';
-		std::cout << "  Adr1: 0x" << ((wdata.base >> 2) + (wdata.size >> 2)) << '\n';
+		TRACE(MPU_TOR2, slot, wdata.base, wdata.size, config | 0x08);
 		writeAddr(slot,   wdata.base >> 2);
 		writeAddr(slot+1, (wdata.base >> 2) + (wdata.size >> 2));
-		// Generate config.
-		uint8_t config = PMP_LOCK * 0x80;
-		if (wdata.read)  config |= 0x01;
-		if (wdata.write) config |= 0x02;
-		if (wdata.exec)  config |= 0x04;
-		std::cout << "  Cfg:  0x" << (config | 0x08) << '\n';
-		std::cout << '\n';
-		writeCfg(slot, config | 0x10);
+		writeCfg(slot, PMP_LOCK * 0x80);
 		writeCfg(slot+1, config | 0x08);
 		
 	} else if ((wdata.base | wdata.size) & 4) {
 		// NA4 strategy.
-		size_t addr  = wdata.base >> 2;
-		std::cout << "NA4:\n";
-		std::cout << "  Base: 0x" << std::hex << wdata.base << '\n';
-		std::cout << "  Size: 0x" << std::hex << wdata.size << '\n';
-		std::cout << "  Addr: 0x" << addr << '\n';
+		TRACE(MPU_NA4, slot, wdata.base, wdata.size, config | 0x10);
 		writeAddr(slot, wdata.base >> 2);
-		// Generate config.
-		uint8_t config = PMP_LOCK * 0x80 | 0x10;
-		if (wdata.read)  config |= 0x01;
-		if (wdata.write) config |= 0x02;
-		if (wdata.exec)  config |= 0x04;
-		std::cout << "  Cfg:  0x" << (unsigned) config << '\n';
-		std::cout << '\n';
-		writeCfg(slot, config);
+		writeCfg(slot, config | 0x10);
 		
 	} else {
 		// NAPOT strategy.
@@ -636,20 +737,9 @@ bool appendRegion(Region wdata) {
 		size_t amask = (wdata.size >> 2) - 1;
 		addr &= ~amask;
 		addr |= amask >> 1;
-		std::cout << "NAPOT:\n";
-		std::cout << "  Base: 0x" << std::hex << wdata.base << '\n';
-		std::cout << "  Size: 0x" << std::hex << wdata.size << '\n';
-		std::cout << "  Mask: 0x" << amask << '\n';
-		std::cout << "  Addr: 0x" << addr << '\n';
+		TRACE(MPU_NAPOT, slot, wdata.base, wdata.size, config | 0x18);
 		writeAddr(slot, addr);
-		// Generate config.
-		uint8_t config = PMP_LOCK * 0x80 | 0x18;
-		if (wdata.read)  config |= 0x01;
-		if (wdata.write) config |= 0x02;
-		if (wdata.exec)  config |= 0x04;
-		std::cout << "  Cfg:  0x" << (unsigned) config << '\n';
-		std::cout << '\n';
-		writeCfg(slot, config);
+		writeCfg(slot, config | 0x18);
 	}
 	
 	return true;
@@ -659,22 +749,26 @@ bool appendRegion(Region wdata) {
 // On fail, returns an empty list.
 // Entries may be in the list but empty.
 std::vector<Region> readRegions() {
+	ensureProbed();
 	std::vector<Region> list;
-	list.reserve(PMP_REGIONS);
+	list.reserve(pmpCount);
 	
 	// Buffer for pmpcfg* registers.
-	size_t pmpcfgRaw[PMP_REGIONS/sizeof(size_t)];
-	// Buffer for pmp*cfg values.
-	auto   pmpcfg = (uint8_t *) &pmpcfgRaw;
+	size_t pmpcfgRaw[PMP_REGIONS/4];
 	// Buffer for pmpaddr* registers.
 	size_t pmpaddr[PMP_REGIONS];
 	readAll(pmpcfgRaw, pmpaddr);
 	
-	// Translate register datas.
+	// Unpack pmp*cfg values; there are four per register.
+	uint8_t pmpcfg[PMP_REGIONS];
 	for (int i = 0; i < PMP_REGIONS; i++) {
+		pmpcfg[i] = pmpcfgRaw[i/4] >> (i % 4 * 8);
+	}
+	
+	// Translate register datas.
+	for (int i = 0; i < pmpCount; i++) {
 		list.push_back(decodeRegion(i, pmpcfg, pmpaddr));
 	}
-	std::cout << std::dec;
 	
 	return list;
 }
@@ -0,0 +1,220 @@
+/*
+	MIT License
+
+	Copyright (c) 2023 Julian Scheffers
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy
+	of this software and associated documentation files (the "Software"), to deal
+	in the Software without restriction, including without limitation the rights
+	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+	copies of the Software, and to permit persons to whom the Software is
+	furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+
+
+#include "mpu/pmp_sim.hpp"
+
+#include <string.h>
+
+namespace mpu::pmpsim {
+
+// Number of implemented entries.
+static int count = 16;
+// Granularity G.
+static int G = 0;
+// Configuration byte of every entry.
+static uint8_t cfg[MAX_ENTRIES];
+// Address register of every entry, as written.
+static size_t addr[MAX_ENTRIES];
+// CSR access counters.
+static Stats counters;
+// Number of times `configure` was called.
+static unsigned configured;
+
+
+
+// Reset the model to `entries` implemented entries (16 or 64) and granularity G.
+void configure(int entries, int g) {
+	if (entries < 0) entries = 0;
+	if (entries > MAX_ENTRIES) entries = MAX_ENTRIES;
+	count = entries;
+	G     = g;
+	memset(cfg, 0, sizeof(cfg));
+	memset(addr, 0, sizeof(addr));
+	counters = {};
+	configured++;
+}
+
+// Get the number of implemented entries.
+int entries() {
+	return count;
+}
+
+// Get the granularity G.
+int granularityG() {
+	return G;
+}
+
+// Get a number that changes every time `configure` is called.
+unsigned generation() {
+	return configured;
+}
+
+
+
+// Get the A field of an entry.
+static uint8_t modeOf(int index) {
+	return (cfg[index] >> 3) & 3;
+}
+
+// Address register value as observed by software and by the checker.
+static size_t effectiveAddr(int index) {
+	size_t value = addr[index];
+	if (G >= 2 && modeOf(index) == 3) {
+		// NAPOT: bits [G-2:0] read as ones.
+		value |= ((size_t) 1 << (G - 1)) - 1;
+	} else if (G >= 1 && modeOf(index) != 3) {
+		// OFF and TOR: bits [G-1:0] read as zeros.
+		value &= ~(((size_t) 1 << G) - 1);
+	}
+	return value;
+}
+
+// Read `pmpcfg*` by CSR index.
+size_t readCfgRaw(int index) {
+	counters.cfgReads++;
+	size_t out = 0;
+	for (int i = 0; i < 4; i++) {
+		int entry = index * 4 + i;
+		if (entry < 0 || entry >= count) break;
+		out |= (size_t) cfg[entry] << (i * 8);
+	}
+	return out;
+}
+
+// Write `pmpcfg*` by CSR index.
+void writeCfgRaw(int index, size_t value) {
+	counters.cfgWrites++;
+	for (int i = 0; i < 4; i++) {
+		int entry = index * 4 + i;
+		if (entry < 0 || entry >= count) break;
+		uint8_t in = value >> (i * 8);
+		
+		// Locked entries ignore writes.
+		if (cfg[entry] & 0x80) continue;
+		// R=0, W=1 is a reserved combination.
+		if ((in & 0x03) == 0x02) continue;
+		// NA4 is not selectable if G >= 1.
+		if (G >= 1 && ((in >> 3) & 3) == 2) continue;
+		
+		// Bits 5 and 6 are reserved and read as zero.
+		cfg[entry] = in & 0x9f;
+	}
+}
+
+// Read `pmpaddr*` by index.
+size_t readAddr(int index) {
+	counters.addrReads++;
+	if (index < 0 || index >= count) return 0;
+	return effectiveAddr(index);
+}
+
+// Write `pmpaddr*` by index.
+void writeAddr(int index, size_t value) {
+	counters.addrWrites++;
+	if (index < 0 || index >= count) return;
+	
+	// Locked entries ignore writes.
+	if (cfg[index] & 0x80) return;
+	// So does the base address of a locked TOR entry.
+	if (index + 1 < count && (cfg[index+1] & 0x80) && modeOf(index+1) == 1) return;
+	
+	addr[index] = value;
+}
+
+
+
+// Compute the [lo,hi) byte range matched by an entry.
+// Returns false if the entry matches nothing.
+static bool bounds(int index, uint64_t &lo, uint64_t &hi) {
+	size_t value = effectiveAddr(index);
+	
+	switch (modeOf(index)) {
+		default:
+			// Disabled entry.
+			return false;
+			
+		case 1:
+			// Top-of-range entry.
+			lo = index ? (uint64_t) effectiveAddr(index-1) << 2 : 0;
+			hi = (uint64_t) value << 2;
+			return lo < hi;
+			
+		case 2:
+			// Naturally aligned four-byte unit.
+			lo = (uint64_t) value << 2;
+			hi = lo + 4;
+			return true;
+			
+		case 3: {
+			// Naturally aligned power of 2 unit.
+			int ones = 0;
+			while (ones < 61 && (value >> ones) & 1) ones++;
+			uint64_t mask = ((uint64_t) 2 << ones) - 1;
+			lo = (uint64_t) (value & ~mask) << 2;
+			hi = lo + ((uint64_t) 8 << ones);
+			return true;
+		}
+	}
+}
+
+// Determine whether an access of `len` bytes at `addr` would succeed.
+bool check(uint64_t start, size_t len, Access type, bool machine) {
+	uint64_t end = start + len;
+	
+	for (int i = 0; i < count; i++) {
+		uint64_t lo, hi;
+		if (!bounds(i, lo, hi)) continue;
+		if (end <= lo || start >= hi) continue;
+		
+		// The lowest-numbered match decides; partial matches fail.
+		if (start < lo || end > hi) return false;
+		// Machine mode is only subject to locked entries.
+		if (machine && !(cfg[i] & 0x80)) return true;
+		
+		switch (type) {
+			case Access::READ:  return cfg[i] & 0x01;
+			case Access::WRITE: return cfg[i] & 0x02;
+			case Access::EXEC:  return cfg[i] & 0x04;
+		}
+		return false;
+	}
+	
+	// Unmatched accesses only succeed in machine mode or without any entries.
+	return machine || count == 0;
+}
+
+
+
+// Get the CSR access counters.
+const Stats &stats() {
+	return counters;
+}
+
+// Reset the CSR access counters.
+void resetStats() {
+	counters = {};
+}
+
+} // namespace mpu::pmpsim
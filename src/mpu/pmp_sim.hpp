@@ -0,0 +1,94 @@
+/*
+	MIT License
+
+	Copyright (c) 2023 Julian Scheffers
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy
+	of this software and associated documentation files (the "Software"), to deal
+	in the Software without restriction, including without limitation the rights
+	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+	copies of the Software, and to permit persons to whom the Software is
+	furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Software model of a RISC-V PMP unit.
+// Used in place of the CSRs by `mpu_riscv32_pmp.cpp` when built with `ELFLOADER_PMP_SIM`,
+// so the region allocation logic can run on a host without RISC-V hardware.
+// The configuration registers are modelled as on RV32: four entries per `pmpcfg*`.
+// The address registers are host-word sized, so host pointers can be protected.
+
+namespace mpu::pmpsim {
+
+// Maximum number of PMP entries the model can implement.
+static const int MAX_ENTRIES = 64;
+
+// Type of memory access.
+enum class Access {
+	READ,
+	WRITE,
+	EXEC,
+};
+
+// CSR access counters.
+struct Stats {
+	// Number of `pmpcfg*` reads.
+	size_t cfgReads;
+	// Number of `pmpcfg*` writes.
+	size_t cfgWrites;
+	// Number of `pmpaddr*` reads.
+	size_t addrReads;
+	// Number of `pmpaddr*` writes.
+	size_t addrWrites;
+};
+
+// Reset the model to `entries` implemented entries (16 or 64) and granularity G.
+// The smallest region is 2^(G+2) bytes.
+// Unimplemented entries read as zero and ignore writes.
+void configure(int entries = 16, int g = 0);
+// Get the number of implemented entries.
+int entries();
+// Get the granularity G.
+int granularityG();
+// Get a number that changes every time `configure` is called.
+// Lets the backend know cached probe results are stale.
+unsigned generation();
+
+// Read `pmpcfg*` by CSR index.
+size_t readCfgRaw(int index);
+// Write `pmpcfg*` by CSR index.
+// Bytes belonging to locked entries are left unchanged.
+void writeCfgRaw(int index, size_t value);
+// Read `pmpaddr*` by index.
+size_t readAddr(int index);
+// Write `pmpaddr*` by index.
+// Ignored if the entry is locked or is the base of a locked TOR entry.
+void writeAddr(int index, size_t value);
+
+// Determine whether an access of `len` bytes at `addr` would succeed.
+// The lowest-numbered matching entry decides; an entry matching only part of the access faults.
+// In machine mode, only locked entries are enforced and unmatched accesses succeed.
+bool check(uint64_t addr, size_t len, Access type, bool machine = false);
+
+// Get the CSR access counters.
+const Stats &stats();
+// Reset the CSR access counters.
+void resetStats();
+
+} // namespace mpu::pmpsim
@@ -0,0 +1,119 @@
+/*
+	MIT License
+
+	Copyright (c) 2023 Julian Scheffers
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy
+	of this software and associated documentation files (the "Software"), to deal
+	in the Software without restriction, including without limitation the rights
+	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+	copies of the Software, and to permit persons to whom the Software is
+	furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+
+
+
+#include "perfmap.hpp"
+#include "elfloader_int.hpp"
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+namespace elf {
+
+// Write to `/tmp/perf-<pid>.map`, where perf looks for it.
+PerfMap::PerfMap() {
+	path = "/tmp/perf-" + std::to_string(getpid()) + ".map";
+}
+
+// Write the map file.
+bool PerfMap::write() const {
+	// Replace the file at once, so that perf never reads half of it.
+	std::string tmp = path + ".tmp";
+	FILE *fd = fopen(tmp.c_str(), "w");
+	if (!fd) {
+		LOGE("Unable to open '%s'", tmp.c_str());
+		return false;
+	}
+	bool ok = true;
+	for (const auto &ent: entries) {
+		ok &= fwrite(ent.lines.data(), 1, ent.lines.size(), fd) == ent.lines.size();
+	}
+	ok &= !fclose(fd);
+	ok = ok && !rename(tmp.c_str(), path.c_str());
+	if (!ok) {
+		LOGE("Unable to write '%s'", path.c_str());
+		::remove(tmp.c_str());
+	}
+	return ok;
+}
+
+// Add the function symbols of a program loaded from `ctx`.
+bool PerfMap::add(const ELFFile &ctx, const Program &program) {
+	// Defined functions from both symbol tables, by address.
+	std::vector<std::pair<size_t, const SymInfo *>> funcs;
+	for (const auto *table: {&ctx.getSym(), &ctx.getDynSym()}) {
+		for (const auto &sym: *table) {
+			if (sym.section == 0 || sym.section >= 0xff00 || !sym.isFunction()) continue;
+			funcs.push_back({sym.value + program.vaddr_offset(), &sym});
+		}
+	}
+	std::sort(funcs.begin(), funcs.end(), [](const auto &a, const auto &b) {
+		return a.first != b.first ? a.first < b.first : a.second->name < b.second->name;
+	});
+	
+	// Perf needs a size; functions without one extend to the next function or the end of the program.
+	std::string lines;
+	size_t end = (size_t) program.memory + program.size;
+	for (size_t i = 0; i < funcs.size(); i++) {
+		auto [addr, sym] = funcs[i];
+		if (i && funcs[i-1].first == addr && funcs[i-1].second->name == sym->name) continue;
+		size_t size = sym->size;
+		if (!size) {
+			size_t next = end;
+			for (size_t j = i + 1; j < funcs.size(); j++) {
+				if (funcs[j].first != addr) {
+					next = funcs[j].first;
+					break;
+				}
+			}
+			size = next > addr ? next - addr : 1;
+		}
+		char buf[48];
+		snprintf(buf, sizeof(buf), "%zx %zx ", addr, size);
+		lines += buf;
+		lines += sym->name;
+		lines += '\n';
+	}
+	
+	entries.push_back({program.memory, std::move(lines)});
+	return write();
+}
+
+// Remove a program.
+bool PerfMap::remove(const Program &program) {
+	for (auto iter = entries.begin(); iter != entries.end(); iter++) {
+		if (iter->memory == program.memory) {
+			entries.erase(iter);
+			return write();
+		}
+	}
+	return false;
+}
+
+} // namespace elf
@@ -0,0 +1,77 @@
+/*
+	MIT License
+
+	Copyright (c) 2023 Julian Scheffers
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy
+	of this software and associated documentation files (the "Software"), to deal
+	in the Software without restriction, including without limitation the rights
+	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+	copies of the Software, and to permit persons to whom the Software is
+	furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+
+
+#pragma once
+
+#include <stddef.h>
+
+#include <list>
+#include <string>
+
+#include "elfloader.hpp"
+
+namespace elf {
+
+// Writes a perf map file naming the functions of loaded programs,
+// so that `perf report` can symbolise samples in their memory, which is anonymous to perf.
+// The file lists the programs currently added; it is rewritten whenever one is added or removed,
+// so that addresses of unloaded programs are not attributed to their functions.
+// Not thread-safe.
+class PerfMap {
+	protected:
+		// A program in the map.
+		struct Entry {
+			// Start of its memory, to find it again.
+			void       *memory;
+			// Lines of the map file for its functions.
+			std::string lines;
+		};
+		
+		// Path of the map file.
+		std::string path;
+		// Programs in the map.
+		std::list<Entry> entries;
+		
+		// Write the map file.
+		// Returns success status.
+		bool write() const;
+		
+	public:
+		// Write to `/tmp/perf-<pid>.map`, where perf looks for it.
+		PerfMap();
+		// Write to `path`.
+		PerfMap(std::string path): path(std::move(path)) {}
+		
+		// Add the function symbols of a program loaded from `ctx`, at the addresses `program` has them.
+		// Returns success status.
+		bool add(const ELFFile &ctx, const Program &program);
+		// Remove a program; call before unloading it.
+		// Returns success status.
+		bool remove(const Program &program);
+		// Get the path of the map file.
+		const std::string &getPath() const { return path; }
+};
+
+} // namespace elf
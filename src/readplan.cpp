@@ -0,0 +1,148 @@
+/*
+	MIT License
+
+	Copyright (c) 2023 Julian Scheffers
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy
+	of this software and associated documentation files (the "Software"), to deal
+	in the Software without restriction, including without limitation the rights
+	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+	copies of the Software, and to permit persons to whom the Software is
+	furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+
+
+#include "elfloader.hpp"
+#include "elfloader_int.hpp"
+
+#include <algorithm>
+
+namespace elf {
+
+// Add a range to fetch.
+void ReadPlan::add(Addr offset, Addr size, void *dest) {
+	if (!size) return;
+	pending.push_back({offset, size, dest});
+}
+
+// Turn the pending ranges into the reads that fetch them, in ascending file order.
+// Merged reads get a buffer owned by the plan.
+std::vector<ReadPlan::Range> ReadPlan::schedule() {
+	std::vector<Range> todo = std::move(pending);
+	pending.clear();
+	std::sort(todo.begin(), todo.end(), [](const Range &a, const Range &b) {
+		return a.offset < b.offset;
+	});
+	
+	// Whether a range is already fetched or will be read into a destination.
+	auto covered = [&](const Range &range) {
+		if (find(range.offset, range.size)) return true;
+		for (const auto &other: todo) {
+			if (other.dest && other.offset <= range.offset && range.offset + range.size <= other.offset + other.size) return true;
+		}
+		return false;
+	};
+	
+	std::vector<Range> reads;
+	for (size_t i = 0; i < todo.size();) {
+		if (todo[i].dest) {
+			// Ranges with a destination are read there directly.
+			reads.push_back(todo[i]);
+			i++;
+			continue;
+		}
+		if (covered(todo[i])) {
+			i++;
+			continue;
+		}
+		
+		// Merge nearby ranges into one read, up to the next range with a destination.
+		Addr start = todo[i].offset;
+		Addr end   = todo[i].offset + todo[i].size;
+		size_t j;
+		for (j = i + 1; j < todo.size(); j++) {
+			if (todo[j].dest || todo[j].offset > end + gap) break;
+			if (covered(todo[j])) continue;
+			end = std::max(end, todo[j].offset + todo[j].size);
+		}
+		
+		// Read the merged range into a new buffer.
+		std::shared_ptr<uint8_t[]> buffer(new uint8_t[end - start]);
+		reads.push_back({start, end - start, buffer.get()});
+		buffers.push_back(std::move(buffer));
+		i = j;
+	}
+	
+	return reads;
+}
+
+// Record reads that completed as fetched data.
+void ReadPlan::commit(const std::vector<Range> &reads) {
+	spans.insert(spans.end(), reads.begin(), reads.end());
+	std::sort(spans.begin(), spans.end(), [](const Range &a, const Range &b) {
+		return a.offset < b.offset;
+	});
+}
+
+// Fetch all pending ranges that were not already fetched.
+// Returns success status.
+bool ReadPlan::execute(FILE *fd) {
+	auto reads = schedule();
+	
+	// Read in ascending order.
+	for (const auto &read: reads) {
+		_elf_count_read(read.offset, read.size);
+		if (_elf_pread(fd, read.dest, read.size, read.offset) != read.size) {
+			LOGE("I/O error: %s", strerror(errno));
+			return false;
+		}
+	}
+	
+	commit(reads);
+	return true;
+}
+
+// Add a copy of file data that was obtained elsewhere, such as from a metadata cache.
+void ReadPlan::insert(Addr offset, Addr size, const void *data) {
+	if (!size) return;
+	std::shared_ptr<uint8_t[]> buffer(new uint8_t[size]);
+	memcpy(buffer.get(), data, size);
+	commit({{offset, size, buffer.get()}});
+	buffers.push_back(std::move(buffer));
+}
+
+// Get fetched data covering `size` bytes at `offset`, or null if not fetched.
+const uint8_t *ReadPlan::find(Addr offset, Addr size) const {
+	for (const auto &span: spans) {
+		if (span.offset > offset) break;
+		if (offset + size <= span.offset + span.size) {
+			return (const uint8_t *) span.dest + (offset - span.offset);
+		}
+	}
+	return nullptr;
+}
+
+// Forget ranges that were read into `dest`.
+void ReadPlan::drop(const void *dest) {
+	std::erase_if(spans, [dest](const Range &span) { return span.dest == dest; });
+}
+
+// Forget all fetched data.
+void ReadPlan::clear() {
+	pending.clear();
+	spans.clear();
+	buffers.clear();
+}
+
+} // namespace elf
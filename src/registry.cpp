@@ -0,0 +1,97 @@
+/*
+	MIT License
+
+	Copyright (c) 2023 Julian Scheffers
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy
+	of this software and associated documentation files (the "Software"), to deal
+	in the Software without restriction, including without limitation the rights
+	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+	copies of the Software, and to permit persons to whom the Software is
+	furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+
+
+#include "registry.hpp"
+#include "elfloader_int.hpp"
+
+namespace elf {
+
+// Releases all libraries, whether or not they are still referenced.
+Registry::~Registry() {
+	for (auto &lib: libs) {
+		if (lib.refs) LOGW("Library '%s' still has %zu references", lib.names[0].c_str(), lib.refs);
+		releaser(lib.program);
+	}
+}
+
+// Find a library by name and add a reference to it.
+Registry::Library *Registry::acquire(const std::string &name) {
+	auto iter = byName.find(name);
+	if (iter == byName.end()) return nullptr;
+	iter->second->refs++;
+	return iter->second;
+}
+
+// Find a library by hash of the contents and add a reference to it.
+Registry::Library *Registry::acquire(uint64_t key, const std::string &name) {
+	auto iter = byKey.find(key);
+	if (!key || iter == byKey.end()) return nullptr;
+	iter->second->refs++;
+	iter->second->names.push_back(name);
+	byName[name] = iter->second;
+	return iter->second;
+}
+
+// Add a library that was loaded and relocated, with one reference.
+Registry::Library *Registry::add(const std::string &name, uint64_t key, ELFFile &&file, const Program &program, SymMap exports, std::vector<Library *> needs) {
+	for (auto need: needs) need->refs++;
+	libs.push_back({{name}, key, std::move(file), program, std::move(exports), std::move(needs), 1});
+	auto lib = &libs.back();
+	byName[name] = lib;
+	if (key) byKey[key] = lib;
+	return lib;
+}
+
+// Drop a reference to a library, releasing it and then the libraries it needs if it was the last.
+void Registry::release(Library *lib) {
+	if (--lib->refs) return;
+	LOGD("Releasing library '%s'", lib->names[0].c_str());
+	for (const auto &name: lib->names) byName.erase(name);
+	if (lib->key) byKey.erase(lib->key);
+	releaser(lib->program);
+	auto needs = std::move(lib->needs);
+	for (auto iter = libs.begin(); iter != libs.end(); iter++) {
+		if (&*iter == lib) {
+			libs.erase(iter);
+			break;
+		}
+	}
+	for (auto need: needs) release(need);
+}
+
+// Get the symbols that a program loaded from `ctx` exports, as `exportSymbols` added them to `map`.
+SymMap exportedSymbols(const ELFFile &ctx, const Program &program, const SymMap &map) {
+	SymMap out;
+	for (const auto &sym: ctx.getDynSym()) {
+		if (sym.section == 0 || sym.section >= 0xff00 || (!sym.isFunction() && !sym.isObject())) continue;
+		auto iter = map.find(sym.name);
+		if (iter != map.end() && iter->second == sym.value + program.vaddr_offset()) {
+			out.insert(*iter);
+		}
+	}
+	return out;
+}
+
+} // namespace elf
@@ -0,0 +1,108 @@
+/*
+	MIT License
+
+	Copyright (c) 2023 Julian Scheffers
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy
+	of this software and associated documentation files (the "Software"), to deal
+	in the Software without restriction, including without limitation the rights
+	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+	copies of the Software, and to permit persons to whom the Software is
+	furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+
+
+#pragma once
+
+#include <stdint.h>
+
+#include <list>
+#include <map>
+#include <string>
+#include <functional>
+
+#include "elfloader.hpp"
+
+namespace elf {
+
+// Libraries loaded once and shared between programs, with reference counts.
+// Libraries are found by the name they are needed by, which by convention is their soname,
+// or by the hash of their contents; see `contentHash`.
+// Not thread-safe.
+class Registry {
+	public:
+		// Releases the memory of a library when its last reference is dropped.
+		using Releaser = std::function<void(Program &program)>;
+		
+		// A loaded and relocated library.
+		struct Library {
+			// Names it is known by.
+			std::vector<std::string> names;
+			// Hash of the contents, or 0 if not computed.
+			uint64_t key;
+			// The ELF file it was loaded from.
+			ELFFile  file;
+			// The loaded program.
+			Program  program;
+			// Symbols it exports.
+			SymMap   exports;
+			// Libraries it needs, each holding a reference from this one.
+			std::vector<Library *> needs;
+			// Number of references.
+			size_t   refs;
+		};
+		
+		// Callback that releases the memory of libraries.
+		Releaser releaser;
+		// Whether to hash the contents of libraries not found by name,
+		// so that a library is shared even if it is needed by different names.
+		bool matchContent;
+		
+	protected:
+		// Loaded libraries.
+		std::list<Library> libs;
+		// Libraries by name.
+		std::map<std::string, Library *> byName;
+		// Libraries by hash of the contents.
+		std::map<uint64_t, Library *> byKey;
+		
+	public:
+		Registry(Releaser releaser): releaser(releaser), matchContent(false) {}
+		// Releases all libraries, whether or not they are still referenced.
+		~Registry();
+		Registry(const Registry &) = delete;
+		Registry &operator=(const Registry &) = delete;
+		
+		// Find a library by name and add a reference to it.
+		// Returns null if not loaded.
+		Library *acquire(const std::string &name);
+		// Find a library by hash of the contents and add a reference to it.
+		// The library will also be known by `name`.
+		// Returns null if not loaded.
+		Library *acquire(uint64_t key, const std::string &name);
+		// Add a library that was loaded and relocated, with one reference.
+		// The libraries it `needs` are kept loaded for as long as it is.
+		// The memory of `program` is released by `releaser` after the last reference is dropped.
+		Library *add(const std::string &name, uint64_t key, ELFFile &&file, const Program &program, SymMap exports, std::vector<Library *> needs);
+		// Drop a reference to a library, releasing it and then the libraries it needs if it was the last.
+		void release(Library *lib);
+		
+		// Get the number of loaded libraries.
+		size_t size() const { return libs.size(); }
+};
+
+// Get the symbols that a program loaded from `ctx` exports, as `exportSymbols` added them to `map`.
+SymMap exportedSymbols(const ELFFile &ctx, const Program &program, const SymMap &map);
+
+} // namespace elf
@@ -0,0 +1,494 @@
+/*
+	MIT License
+
+	Copyright (c) 2023 Julian Scheffers
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy
+	of this software and associated documentation files (the "Software"), to deal
+	in the Software without restriction, including without limitation the rights
+	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+	copies of the Software, and to permit persons to whom the Software is
+	furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+
+
+
+#include "relobject.hpp"
+#include "relocation.hpp"
+#include "elfloader_int.hpp"
+
+#include <string.h>
+
+#include <algorithm>
+#include <numeric>
+
+namespace elf {
+
+// Placement order of a section: code, read-only data, writable data, then zero-initialised data.
+static int placementGroup(const SectInfo &sect) {
+	if (sect.type == (int) SHT::NOBITS) return 3;
+	if (sect.flags & (int) SHF::EXECINSTR) return 0;
+	if (sect.flags & (int) SHF::WRITE) return 2;
+	return 1;
+}
+
+// Whether a section is kept regardless of references to it.
+static bool isRetained(const SectInfo &sect) {
+	return sect.type == (int) SHT::INIT_ARRAY || sect.type == (int) SHT::FINI_ARRAY
+		|| sect.type == (int) SHT::PREINIT_ARRAY || (sect.flags & (int) SHF::GNU_RETAIN);
+}
+
+// Largest group of functions profile-guided ordering keeps together, so that a group fits in a page.
+static const Addr maxClusterSize = 4096;
+
+// Reorder the code sections, given by section header index, so the hottest callers and callees are adjacent.
+// This is the C3 heuristic: every function, hottest first by calls made and received, is appended to the group of its most frequent caller,
+// after which the groups are placed in order of calls per byte.
+void RelObject::orderByProfile(std::vector<size_t> &code) const {
+	const auto &sects = ctx.getSect();
+	
+	// Position in `code` by section header index, and of every function.
+	std::vector<size_t> node(sects.size(), SIZE_MAX);
+	for (size_t i = 0; i < code.size(); i++) node[code[i]] = i;
+	std::map<std::string, size_t> functions;
+	for (const auto &sym: ctx.getSym()) {
+		if (sym.isFunction() && sym.section < node.size() && node[sym.section] != SIZE_MAX) {
+			functions.emplace(sym.name, node[sym.section]);
+		}
+	}
+	
+	// Calls made and received by every section, and the section that makes the most calls to it.
+	std::vector<uint64_t> weight(code.size());
+	std::map<std::pair<size_t, size_t>, uint64_t> edges;
+	for (const auto &edge: profile) {
+		auto callee = functions.find(edge.callee);
+		auto caller = functions.find(edge.caller);
+		if (callee != functions.end()) weight[callee->second] += edge.count;
+		if (caller != functions.end()) weight[caller->second] += edge.count;
+		if (callee != functions.end() && caller != functions.end() && caller->second != callee->second) {
+			edges[{callee->second, caller->second}] += edge.count;
+		}
+	}
+	std::vector<size_t>   caller(code.size(), SIZE_MAX);
+	std::vector<uint64_t> callerCount(code.size());
+	for (const auto &[key, count]: edges) {
+		if (count > callerCount[key.first]) {
+			callerCount[key.first] = count;
+			caller[key.first]      = key.second;
+		}
+	}
+	
+	// Merge groups, starting with every section in a group of its own.
+	std::vector<size_t> cluster(code.size());
+	std::vector<std::vector<size_t>> members(code.size());
+	std::vector<Addr> size(code.size());
+	std::vector<uint64_t> total(weight);
+	for (size_t i = 0; i < code.size(); i++) {
+		cluster[i] = i;
+		members[i] = {i};
+		size[i]    = sects[code[i]].file_size;
+	}
+	std::vector<size_t> hottest(code.size());
+	std::iota(hottest.begin(), hottest.end(), 0);
+	std::stable_sort(hottest.begin(), hottest.end(), [&](size_t a, size_t b) { return weight[a] > weight[b]; });
+	for (auto callee: hottest) {
+		if (!weight[callee]) break;
+		if (caller[callee] == SIZE_MAX) continue;
+		size_t into = cluster[caller[callee]], from = cluster[callee];
+		if (into == from || size[into] + size[from] > maxClusterSize) continue;
+		for (auto i: members[from]) cluster[i] = into;
+		members[into].insert(members[into].end(), members[from].begin(), members[from].end());
+		members[from].clear();
+		size[into]  += size[from];
+		total[into] += total[from];
+	}
+	
+	// Place the groups by calls per byte; code that was not called keeps its order after them.
+	std::vector<size_t> clusters;
+	for (size_t i = 0; i < code.size(); i++) {
+		if (!members[i].empty()) clusters.push_back(i);
+	}
+	std::stable_sort(clusters.begin(), clusters.end(), [&](size_t a, size_t b) {
+		return (double) total[a] / size[a] > (double) total[b] / size[b];
+	});
+	std::vector<size_t> out;
+	out.reserve(code.size());
+	for (auto i: clusters) {
+		for (auto member: members[i]) out.push_back(code[member]);
+	}
+	code = std::move(out);
+}
+
+// Read the contents and relocations of the allocatable sections that are reachable from the roots.
+bool RelObject::readSections() {
+	_ElfReader io(ctx.fd);
+	const auto &sects = ctx.getSect();
+	const auto &syms  = ctx.getSym();
+	sections.clear();
+	sectionIndex.assign(sects.size(), SIZE_MAX);
+	
+	// Relocation sections by the section they apply to.
+	std::vector<std::pair<size_t, size_t>> relas;
+	for (size_t i = 0; i < sects.size(); i++) {
+		const auto &sect = sects[i];
+		if (sect.type != (int) SHT::RELA && sect.type != (int) SHT::REL) continue;
+		if (sect.info >= sects.size() || !(sects[sect.info].flags & (int) SHF::ALLOC)) continue;
+		relas.emplace_back(sect.info, i);
+	}
+	std::sort(relas.begin(), relas.end());
+	
+	// Read the relocations of a section, sorted by offset.
+	std::vector<std::vector<RelaEntry>> relocs(sects.size());
+	auto readRelocs = [&](size_t target) {
+		auto iter = std::lower_bound(relas.begin(), relas.end(), std::pair<size_t, size_t>(target, 0));
+		for (; iter != relas.end() && iter->first == target; iter++) {
+			const auto &sect = sects[iter->second];
+			if (sect.type == (int) SHT::REL) {
+				LOGE("Relocations without addends are not supported (`%s`)", sect.name.c_str());
+				return false;
+			}
+			if (sect.entry_size < sizeof(RelaEntry)) {
+				LOGE("ELF file invalid (`%s`: sh_entsize = 0x%zx)", sect.name.c_str(), (size_t) sect.entry_size);
+				return false;
+			}
+			std::vector<uint8_t> raw(sect.file_size);
+			SEEK(sect.offset);
+			READ(raw.data(), raw.size());
+			for (size_t i = 0; i < sect.file_size / sect.entry_size; i++) {
+				RelaEntry entry;
+				memcpy(&entry, raw.data() + i * sect.entry_size, sizeof(entry));
+				if (entry.symIndex() >= syms.size() || entry.offset >= sects[target].file_size) {
+					LOGE("ELF file invalid (`%s`: entry %zu)", sect.name.c_str(), i);
+					return false;
+				}
+				relocs[target].push_back(entry);
+			}
+		}
+		// Relaxation relies on a relocation being followed by its `R_RISCV_RELAX` or equivalent.
+		std::stable_sort(relocs[target].begin(), relocs[target].end(), [](const RelaEntry &a, const RelaEntry &b) {
+			return a.offset < b.offset;
+		});
+		return true;
+	};
+	
+	// Sections to place: those the roots reach through relocations, or every allocatable one.
+	std::vector<bool> live(sects.size());
+	std::vector<size_t> work;
+	auto mark = [&](size_t i) {
+		if (i >= sects.size() || live[i] || !(sects[i].flags & (int) SHF::ALLOC) || !sects[i].file_size) return;
+		live[i] = true;
+		work.push_back(i);
+	};
+	if (gcSections) {
+		for (size_t i = 0; i < sects.size(); i++) {
+			if (isRetained(sects[i])) mark(i);
+		}
+		if (roots.empty()) {
+			for (const auto &sym: syms) {
+				bool global = sym.bind() == (int) STB::GLOBAL || sym.bind() == (int) STB::WEAK;
+				if (global && (sym.isFunction() || sym.isObject()) && sym.section < 0xff00) mark(sym.section);
+			}
+		}
+		for (const auto &name: roots) {
+			auto sym = ctx.findSym(name);
+			if (!sym || sym->section == 0) {
+				LOGE("Root symbol '%s' is not defined", name.c_str());
+				return false;
+			}
+			if (sym->section < 0xff00) mark(sym->section);
+		}
+	} else {
+		for (size_t i = 0; i < sects.size(); i++) mark(i);
+	}
+	while (!work.empty()) {
+		size_t i = work.back();
+		work.pop_back();
+		if (!readRelocs(i)) return false;
+		if (!gcSections) continue;
+		for (const auto &rel: relocs[i]) {
+			uint16_t sect = syms[rel.symIndex()].section;
+			if (sect < 0xff00) mark(sect);
+		}
+	}
+	
+	// Group them by permissions.
+	std::vector<size_t> order;
+	size_t dead = 0;
+	for (size_t i = 0; i < sects.size(); i++) {
+		if (live[i]) order.push_back(i);
+		else if ((sects[i].flags & (int) SHF::ALLOC) && sects[i].file_size) dead++;
+	}
+	if (dead) LOGD("Skipped %zu unreferenced sections", dead);
+	std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+		return placementGroup(sects[a]) < placementGroup(sects[b]);
+	});
+	if (!profile.empty()) {
+		// Code is placed first.
+		auto end = std::find_if(order.begin(), order.end(), [&](size_t i) { return placementGroup(sects[i]) != 0; });
+		std::vector<size_t> code(order.begin(), end);
+		orderByProfile(code);
+		std::copy(code.begin(), code.end(), order.begin());
+	}
+	for (auto i: order) {
+		const auto &sect = sects[i];
+		Section out = {i, sect.flags, sect.alignment ? sect.alignment : 1, sect.file_size, 0, {}, std::move(relocs[i]), {}};
+		if (out.align & (out.align - 1)) {
+			LOGE("ELF file invalid (`%s`: sh_addralign = 0x%zx)", sect.name.c_str(), (size_t) sect.alignment);
+			return false;
+		}
+		if (sect.type != (int) SHT::NOBITS) {
+			out.data.resize(sect.file_size);
+			SEEK(sect.offset);
+			READ(out.data.data(), sect.file_size);
+		}
+		sectionIndex[i] = sections.size();
+		sections.push_back(std::move(out));
+	}
+	
+	symbols.assign(syms.begin(), syms.end());
+	for (uint32_t i = 1; i < syms.size(); i++) {
+		if (syms[i].section < sectionIndex.size() && sectionIndex[syms[i].section] != SIZE_MAX) {
+			sections[sectionIndex[syms[i].section]].symbols.push_back(i);
+		}
+	}
+	return true;
+}
+
+// Find the imported symbols in `map` and the symbols that need global offset table slots or veneers.
+bool RelObject::resolve(const SymMap &map) {
+	// Only symbols the placed sections refer to need to be defined.
+	std::vector<bool> used(symbols.size());
+	for (const auto &sect: sections) {
+		for (const auto &rel: sect.relocs) used[rel.symIndex()] = true;
+	}
+	for (uint32_t i = 1; i < symbols.size(); i++) {
+		const auto &sym = ctx.getSym()[i];
+		if (sym.section == 0xfff2) {
+			LOGE("Common symbol '%s' is not supported", sym.name.c_str());
+			return false;
+		}
+		if (sym.section != 0 || sym.name.empty() || !used[i]) continue;
+		auto iter = map.find(sym.name);
+		_elf_count_lookup(iter != map.end());
+		if (iter != map.end()) {
+			symbols[i].value = iter->second;
+		} else if (sym.bind() == (int) STB::WEAK) {
+			symbols[i].value = 0;
+		} else {
+			LOGE("Link error: Unresolved symbol '%s'", sym.name.c_str());
+			return false;
+		}
+	}
+	
+	// Every called import gets a veneer until it is known where the object is placed.
+	got.clear();
+	veneers.clear();
+	bool useVeneers = veneerSize();
+	for (const auto &sect: sections) {
+		for (const auto &rel: sect.relocs) {
+			if (needsGotSlot(rel.type())) got.emplace(rel.symIndex(), got.size());
+			if (useVeneers && canUseVeneer(rel.type()) && symbols[rel.symIndex()].section == 0) {
+				veneers.emplace(rel.symIndex(), veneers.size());
+			}
+		}
+	}
+	return true;
+}
+
+// Compute the offset of every section, the global offset table and the veneers.
+Addr RelObject::layout() {
+	Addr offset = 0;
+	for (auto &sect: sections) {
+		offset      = (offset + sect.align - 1) & ~(sect.align - 1);
+		sect.offset = offset;
+		offset     += sect.size;
+	}
+	gotOffset    = (offset + sizeof(Addr) - 1) & ~(Addr) (sizeof(Addr) - 1);
+	veneerOffset = gotOffset + got.size() * sizeof(Addr);
+	return veneerOffset + veneers.size() * veneerSize();
+}
+
+// Place, relax and relocate the object, taking imported symbols from `map`.
+Program RelObject::load(ELFFile::Allocator alloc, const SymMap &map) {
+	Program out;
+	if (!ctx.isValid()) return out;
+	if (ctx.getHeader().type != (int) ET::REL) {
+		LOGE("ELF file is not a relocatable object");
+		return out;
+	}
+	
+	// Reserve memory for the object before relaxation, which only makes it smaller.
+	Addr size, align = sizeof(Addr);
+	{
+		PHASE(ctx.stats, LOAD);
+		if (!readSections() || !resolve(map)) return out;
+		size = layout();
+		for (const auto &sect: sections) align = std::max(align, sect.align);
+		if (_elf_phase) _elf_phase->allocations++;
+		auto allocation   = alloc(0, size, align);
+		out.memory        = (void *) allocation.first;
+		out.memory_cookie = (void *) allocation.second;
+		if (!out.memory) {
+			LOGE("Out of memory (%zu bytes)", (size_t) size);
+			return out;
+		}
+	}
+	base           = (Addr) out.memory;
+	out.vaddr_req  = 0;
+	out.vaddr_real = base;
+	out.size       = size;
+	out.align      = align;
+	// Objects have no entrypoint or dynamic segment, so `entry` and `dynamic` stay null.
+	
+	PHASE(ctx.stats, RELOCATE);
+	// Imports that every call site in the object reaches directly need no veneer.
+	size_t veneerCount = veneers.size();
+	std::map<uint32_t, size_t> farImports;
+	for (const auto &[sym, slot]: veneers) {
+		Addr addr = symbolAddr(sym);
+		if (!callReaches(base, addr) || !callReaches(base + size, addr)) farImports.emplace(sym, farImports.size());
+	}
+	veneers = std::move(farImports);
+	if (veneerCount) LOGD("%zu of %zu imports need veneers", veneers.size(), veneerCount);
+	
+	// Code may move by as much as it shrinks in total, which is less than its size.
+	Addr slack = 0;
+	for (const auto &sect: sections) {
+		if (sect.flags & (int) SHF::EXECINSTR) slack += sect.size;
+	}
+	for (auto &sect: sections) {
+		if (!(sect.flags & (int) SHF::EXECINSTR)) continue;
+		if (relax && !relaxSection(*this, sect, slack)) return out;
+		if (!alignSection(*this, sect)) return out;
+	}
+	out.size = layout();
+	if (out.size < size) LOGD("Relaxation saved %zu bytes", (size_t) (size - out.size));
+	
+	// Copy the sections, fill in the global offset table and veneers, and relocate.
+	for (const auto &sect: sections) {
+		auto mem = (uint8_t *) sectionAddr(sect);
+		if (sect.data.empty()) memset(mem, 0, sect.size);
+		else memcpy(mem, sect.data.data(), sect.size);
+	}
+	for (const auto &[sym, slot]: got) {
+		((Addr *) (base + gotOffset))[slot] = symbolAddr(sym);
+	}
+	for (const auto &[sym, slot]: veneers) {
+		if (!makeVeneer((uint8_t *) (base + veneerOffset + slot * veneerSize()), symbolAddr(sym))) return out;
+	}
+	for (const auto &sect: sections) {
+		if (!relocateSection(*this, sect, (uint8_t *) sectionAddr(sect))) return out;
+	}
+	
+	return out;
+}
+
+// Add the global symbols the loaded object defines to `map`.
+bool RelObject::exportSymbols(SymMap &map) const {
+	PHASE(ctx.stats, EXPORT);
+	std::vector<uint32_t> exports;
+	for (uint32_t i = 1; i < symbols.size(); i++) {
+		const auto &sym = ctx.getSym()[i];
+		if (sym.section == 0 || (sym.section < 0xff00 && sectionIndex[sym.section] == SIZE_MAX)) continue;
+		if (!sym.isFunction() && !sym.isObject()) continue;
+		if (sym.bind() == (int) STB::WEAK) {
+			if (!map.count(sym.name)) exports.push_back(i);
+		} else if (sym.bind() == (int) STB::GLOBAL) {
+			if (map.count(sym.name)) {
+				LOGE("Duplicate symbol '%s'", sym.name.c_str());
+				return false;
+			}
+			exports.push_back(i);
+		}
+	}
+	for (auto i: exports) map[ctx.getSym()[i].name] = symbolAddr(i);
+	return true;
+}
+
+// Get the address of a symbol once placed.
+Addr RelObject::symbolAddr(uint32_t index) const {
+	const auto &sym = symbols[index];
+	if (sym.section == 0 || sym.section >= 0xff00) {
+		return sym.value;
+	} else if (sectionIndex[sym.section] == SIZE_MAX) {
+		return 0;
+	}
+	return sectionAddr(sections[sectionIndex[sym.section]]) + sym.value;
+}
+
+// Remove byte ranges in a section, moving the symbols and relocations after them.
+void RelObject::deleteBytes(Section &sect, const std::vector<std::pair<Addr, Addr>> &ranges) {
+	if (ranges.empty()) return;
+	
+	// Bytes removed before the end of every range.
+	std::vector<Addr> removed(ranges.size());
+	for (size_t i = 0; i < ranges.size(); i++) {
+		removed[i] = (i ? removed[i-1] : 0) + ranges[i].second;
+	}
+	// Offsets in a removed range move to where it started.
+	// Symbols are mostly in order of address, so the ranges are searched onwards from the previous offset.
+	struct Cursor {
+		size_t index = 0;
+		Addr   last  = 0;
+	};
+	auto moved = [&](Cursor &cur, Addr offset) -> Addr {
+		if (offset < cur.last) {
+			auto iter = std::upper_bound(ranges.begin(), ranges.end(), offset, [](Addr offset, const std::pair<Addr, Addr> &range) {
+				return offset < range.first + range.second;
+			});
+			cur.index = iter - ranges.begin();
+		} else {
+			while (cur.index < ranges.size() && ranges[cur.index].first + ranges[cur.index].second <= offset) cur.index++;
+		}
+		cur.last = offset;
+		size_t i = cur.index;
+		Addr before = i ? removed[i-1] : 0;
+		if (i < ranges.size() && offset > ranges[i].first) return ranges[i].first - before;
+		return offset - before;
+	};
+	
+	Cursor starts, ends;
+	for (auto index: sect.symbols) {
+		auto &sym = symbols[index];
+		Addr end  = moved(ends, sym.value + sym.size);
+		sym.value = moved(starts, sym.value);
+		sym.size  = end - sym.value;
+	}
+	
+	std::vector<RelaEntry> relocs;
+	relocs.reserve(sect.relocs.size());
+	size_t i = 0;
+	for (auto rel: sect.relocs) {
+		// Relocations are sorted, so the ranges before them only grow.
+		while (i < ranges.size() && ranges[i].first + ranges[i].second <= rel.offset) i++;
+		if (i < ranges.size() && rel.offset >= ranges[i].first) continue;
+		rel.offset -= i ? removed[i-1] : 0;
+		relocs.push_back(rel);
+	}
+	sect.relocs = std::move(relocs);
+	
+	if (!sect.data.empty()) {
+		Addr to = ranges[0].first;
+		for (size_t i = 0; i < ranges.size(); i++) {
+			Addr from = ranges[i].first + ranges[i].second;
+			Addr end  = i + 1 < ranges.size() ? ranges[i+1].first : sect.size;
+			memmove(sect.data.data() + to, sect.data.data() + from, end - from);
+			to += end - from;
+		}
+		sect.data.resize(to);
+	}
+	sect.size -= removed.back();
+}
+
+} // namespace elf
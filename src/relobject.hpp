@@ -0,0 +1,146 @@
+/*
+	MIT License
+
+	Copyright (c) 2023 Julian Scheffers
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy
+	of this software and associated documentation files (the "Software"), to deal
+	in the Software without restriction, including without limitation the rights
+	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+	copies of the Software, and to permit persons to whom the Software is
+	furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "elfloader.hpp"
+
+namespace elf {
+
+// Loads relocatable object files (`ET_REL`) by placing their sections in memory and applying static relocations,
+// so that code can be loaded without first linking it into a shared object.
+// Because the loader places the code, code sequences can be relaxed into shorter ones before it is copied;
+// relaxation is done by the machine backend, see `relaxSection`.
+// Sections are placed grouped by permissions: code, read-only data, writable data and then zero-initialised data,
+// followed by a global offset table if any relocation needs one and veneers for imports too far away to call directly.
+// Sections that cannot be reached from the roots through relocations are not read or placed at all,
+// which pays off for objects built with `-ffunction-sections -fdata-sections`.
+// Such objects can also have their code ordered by a call profile, so that the functions that call each other most
+// are placed next to each other (C3 ordering); see `profile`.
+class RelObject {
+	public:
+		// Calls from one function to another in a call profile.
+		struct CallEdge {
+			// Name of the calling function; if empty, the calls only count towards how hot the callee is,
+			// which is what `CallProfile::counts` of a program that imports the functions gives.
+			std::string caller;
+			// Name of the called function.
+			std::string callee;
+			// Number of calls.
+			uint64_t    count;
+		};
+		
+		// An allocatable section.
+		struct Section {
+			// Index of the section header.
+			size_t                 index;
+			// Section header flags.
+			Addr                   flags;
+			// Alignment.
+			Addr                   align;
+			// Size in memory; changed by relaxation.
+			Addr                   size;
+			// Offset in the program memory once placed.
+			Addr                   offset;
+			// Contents, empty for zero-initialised sections; changed by relaxation.
+			std::vector<uint8_t>   data;
+			// Relocations, sorted by offset; changed by relaxation.
+			std::vector<RelaEntry> relocs;
+			// Indices of the symbols defined in this section.
+			std::vector<uint32_t>  symbols;
+		};
+		
+		// The ELF file, which must have been read with `read`.
+		const ELFFile &ctx;
+		// Whether to shrink code sequences whose targets are in range of shorter ones.
+		bool relax;
+		// Whether to leave out sections that cannot be reached from the roots.
+		bool gcSections;
+		// Names of the symbols the host uses, such as the entry point; if empty, every exported symbol is a root.
+		std::vector<std::string> roots;
+		// Call profile to order code sections by; if empty, they are placed in file order.
+		std::vector<CallEdge> profile;
+		
+		// Allocatable sections, in the order they are placed.
+		std::vector<Section> sections;
+		// Indices in `sections` by section header index, or SIZE_MAX for sections that are not loaded.
+		std::vector<size_t> sectionIndex;
+		// Symbols, with values relative to their section, or the value found in the symbol map if undefined;
+		// changed by relaxation.
+		std::vector<SymEntry> symbols;
+		// Global offset table slots by symbol index.
+		std::map<uint32_t, size_t> got;
+		// Offset of the global offset table in the program memory.
+		Addr gotOffset;
+		// Veneer slots by symbol index, for calls to imports that are out of direct range.
+		std::map<uint32_t, size_t> veneers;
+		// Offset of the veneers in the program memory.
+		Addr veneerOffset;
+		// Address of the program memory, once allocated.
+		Addr base;
+		
+	protected:
+		// Reorder the code sections, given by section header index, so the hottest callers and callees are adjacent.
+		void orderByProfile(std::vector<size_t> &code) const;
+		// Read the contents and relocations of the allocatable sections that are reachable from the roots.
+		// Returns success status.
+		bool readSections();
+		// Find the imported symbols in `map` and the symbols that need global offset table slots or veneers.
+		// Returns success status.
+		bool resolve(const SymMap &map);
+		// Compute the offset of every section, the global offset table and the veneers.
+		// Returns the size of the program memory.
+		Addr layout();
+		
+	public:
+		RelObject(const ELFFile &ctx): ctx(ctx), relax(true), gcSections(true), gotOffset(0), veneerOffset(0), base(0) {}
+		
+		// Place, relax and relocate the object, taking imported symbols from `map`.
+		// Code and veneers are written as data, so synchronise the instruction cache (`fence.i`) before running it,
+		// and apply MPU protection only after loading.
+		// If relocating fails after memory was allocated, the program is still returned so it can be released.
+		Program load(ELFFile::Allocator alloc, const SymMap &map);
+		// Add the global symbols the loaded object defines to `map`.
+		// Returns success status; fails on duplicate symbols.
+		bool exportSymbols(SymMap &map) const;
+		
+		// Get the address of a symbol once placed.
+		Addr symbolAddr(uint32_t index) const;
+		// Get the address of a section once placed.
+		Addr sectionAddr(const Section &sect) const { return base + sect.offset; }
+		// Remove byte ranges, given as offset and length in ascending order, from a section.
+		// Symbols and relocations after them are moved down, and relocations in them are dropped.
+		void deleteBytes(Section &sect, const std::vector<std::pair<Addr, Addr>> &ranges);
+};
+
+} // namespace elf
@@ -44,11 +44,12 @@ static inline bool getDynSym(Addr &out, const ELFFile &ctx, const Program &progr
 	} else if (sym.section == 0) {
 		// Look up in map.
 		auto iter = map.find(sym.name);
+		_elf_count_lookup(iter != map.end());
 		if (iter == map.end()) {
 			// Not found.
 			return false;
 		}
-		LOGD("Match found for %s", sym.name.c_str());
+		TRACE(ELF_SYM_IMPORT, index, iter->second);
 		out = iter->second;
 		return true;
 		
@@ -60,23 +61,22 @@ static inline bool getDynSym(Addr &out, const ELFFile &ctx, const Program &progr
 }
 
 // Apply explicit addend relocations.
-static bool relocateExplicit(const ELFFile &ctx, const Program &program, const SectInfo &sect, const SymMap &map) {
-	FILE *fd = ctx.fd;
+static bool relocateExplicit(const ELFFile &ctx, const Program &program, const SectInfo &sect, const SymMap &map, const SymMap *slots) {
+	_ElfReader io(ctx.fd, &ctx.getPlan());
 	
 	// Read relocation datas from the SECTION.
-	LOGD("Relocating %lu entries", sect.file_size / sect.entry_size);
+	TRACE(ELF_RELOC_SECT, sect.offset, sect.file_size / sect.entry_size);
 	for (size_t i = 0; i < sect.file_size / sect.entry_size; i++) {
 		// Read raw data stuffs.
 		RelaEntry entry;
-		LOGD("%lu", sect.offset + i * sect.entry_size);
 		SEEK(sect.offset + i * sect.entry_size);
 		READ(&entry, sizeof(entry));
-		LOGD("Read entry %zu/%lu", i+1, sect.file_size / sect.entry_size);
 		
 		// Bounds check.
 		auto index = entry.symIndex();
 		if (index >= ctx.getDynSym().size()) {
 			LOGE("ELF file invalid (r_sym = 0x%x)", (int) index);
+			return false;
 		}
 		
 		// Look up symbol value.
@@ -88,14 +88,16 @@ static bool relocateExplicit(const ELFFile &ctx, const Program &program, const S
 			return false;
 		}
 		
+		// PLT slots may be redirected, e.g. to count calls.
+		if (slots && index && relocationKind(entry.type()) == RelKind::SLOT) {
+			auto iter = slots->find(ctx.getDynSym()[index].name);
+			if (iter != slots->end()) symVal = iter->second;
+		}
+		
 		// Calculate relocated address.
 		Addr relocAddr = entry.offset + program.vaddr_offset();
-		LOGD("Rela:\n  Offs: 0x%x (0x%x)\n  Type: 0x%x\n  Sym:  0x%d\n  Add.: 0x%d",
-			(int) entry.offset, (int) relocAddr,
-			(int) entry.type(),
-			(int) entry.symIndex(),
-			(int) entry.addend
-		);
+		TRACE(ELF_RELOC, entry.type(), entry.offset, entry.symIndex(), entry.addend);
+		if (ctx.stats) ctx.stats->relocs[entry.type()]++;
 		bool res = applyRelocation(ctx, program, entry.type(), symVal, entry.addend, (uint8_t *) relocAddr);
 		
 		if (!res) return false;
@@ -105,8 +107,9 @@ static bool relocateExplicit(const ELFFile &ctx, const Program &program, const S
 }
 
 // Apply all relocations for the loaded program.
-bool relocate(const ELFFile &ctx, const Program &program, const SymMap &map) {
+bool relocate(const ELFFile &ctx, const Program &program, const SymMap &map, const SymMap *slots) {
 	if (!ctx.isValid()) return false;
+	PHASE(ctx.stats, RELOCATE);
 	
 	// Iterate sections looking for relocation sections.
 	for (auto &sect: ctx.getSect()) {
@@ -117,36 +120,57 @@ bool relocate(const ELFFile &ctx, const Program &program, const SymMap &map) {
 			return false;
 		} else if (sect.type == (int) SHT::RELA) {
 			// Relocation (explicit addend).
-			if (!relocateExplicit(ctx, program, sect, map)) return false;
+			if (!relocateExplicit(ctx, program, sect, map, slots)) return false;
 		}
 	}
 	
 	return true;
 }
 
+// Rewrite the PLT entries of a relocated program into direct jumps.
+size_t patchPlt(const ELFFile &ctx, const Program &program) {
+	if (!ctx.isValid()) return 0;
+	PHASE(ctx.stats, RELOCATE);
+	
+	size_t header, entry = pltEntrySize(header);
+	auto plt = ctx.findSect(".plt");
+	if (!entry || !plt || plt->file_size < header) return 0;
+	
+	size_t patched = 0;
+	auto mem = (uint8_t *) (plt->vaddr + program.vaddr_offset());
+	for (Addr offset = header; offset + entry <= plt->file_size; offset += entry) {
+		patched += patchPltEntry(program, mem + offset);
+	}
+	LOGD("Patched %zu of %zu PLT entries", patched, (size_t) ((plt->file_size - header) / entry));
+	return patched;
+}
+
 
-// Predicate for exporting le symbolé.
-static bool filter(const SymInfo &sym, const SymMap &map) {
+// Predicate for exporting le symbolé, not considering the symbols already in the map.
+static bool filter(const SymInfo &sym) {
 	if (sym.section >= 0xff00 || sym.section == 0) {
 		return false;
 	} else if (!sym.isFunction() && !sym.isObject()) {
 		return false;
-	} else if (sym.bind() == (int) STB::WEAK) {
-		auto iter = map.find(sym.name);
-		return iter == map.end();
 	} else {
-		return sym.bind() == (int) STB::GLOBAL;
+		return sym.bind() == (int) STB::WEAK || sym.bind() == (int) STB::GLOBAL;
 	}
 }
 
 // Extract symbols from a loaded program into the map.
 bool exportSymbols(const ELFFile &ctx, const Program &program, SymMap &map) {
 	if (!ctx.isValid()) return false;
+	PHASE(ctx.stats, EXPORT);
 	
-	// Check against duplication.
+	// Check against duplication; weak symbols only fill in missing ones.
+	std::vector<const SymInfo *> exports;
 	for (auto &sym: ctx.getDynSym()) {
+		if (!filter(sym)) continue;
 		auto existing = map.find(sym.name);
-		if (filter(sym, map) && existing != map.end()) {
+		_elf_count_lookup(existing != map.end());
+		if (existing == map.end()) {
+			exports.push_back(&sym);
+		} else if (sym.bind() == (int) STB::GLOBAL) {
 			LOGE("Duplicate symbol '%s'", sym.name.c_str());
 			LOGD("0x%04x  0x%08x  0x%08x  0x%02x", sym.section, (int) sym.size, (int) sym.value, sym.info);
 			return false;
@@ -154,10 +178,8 @@ bool exportSymbols(const ELFFile &ctx, const Program &program, SymMap &map) {
 	}
 	
 	// Copy addresses into the map.
-	for (auto &sym: ctx.getDynSym()) {
-		if (filter(sym, map)) {
-			map[sym.name] = sym.value + program.vaddr_offset();
-		}
+	for (auto sym: exports) {
+		map[sym->name] = sym->value + program.vaddr_offset();
 	}
 	
 	return true;
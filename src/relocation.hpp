@@ -25,9 +25,25 @@
 #pragma once
 
 #include "elfloader.hpp"
+#include "relobject.hpp"
 
 namespace elf {
 
+// How a relocation type computes its value, for converting relocations ahead of time.
+enum class RelKind {
+	// Anything else; can only be applied with `applyRelocation`.
+	OTHER,
+	// Stores a pointer-sized B + A.
+	RELATIVE,
+	// Stores a pointer-sized S + A.
+	SYMBOL,
+	// Stores a pointer-sized S.
+	SLOT,
+};
+
+// Determine how a relocation type computes its value.
+RelKind relocationKind(uint32_t relType);
+
 // Reads an ADDEND for a relocation.
 Addr getAddend(const ELFFile &ctx, uint32_t relType, uint8_t *ptr);
 
@@ -35,7 +51,50 @@ Addr getAddend(const ELFFile &ctx, uint32_t relType, uint8_t *ptr);
 bool applyRelocation(const ELFFile &ctx, const Program &program, uint32_t relType, Addr symVal, Addr addend, uint8_t *ptr);
 
 // Apply all relocations for the loaded program.
-bool relocate(const ELFFile &ctx, const Program &program, const SymMap &map);
+// If `slots` is given, symbols found in it are used instead of those in `map` for PLT slots; see `CallProfile`.
+bool relocate(const ELFFile &ctx, const Program &program, const SymMap &map, const SymMap *slots = nullptr);
+
+// Rewrite the PLT entries of a relocated program to jump straight to the functions their GOT slots point at,
+// saving the load from the GOT on every call. Entries whose target is out of direct range are left as they are;
+// they already reach it from anywhere. Call after `relocate`, before the program runs and before MPU protection
+// makes the PLT read-only; the PLT is rewritten as data, so synchronise the instruction cache (`fence.i`) afterwards.
+// Returns the number of entries rewritten.
+size_t patchPlt(const ELFFile &ctx, const Program &program);
+// Get the size of a PLT entry and of the header before the first, or 0 if PLT entries cannot be patched for this machine.
+size_t pltEntrySize(size_t &headerSize);
+// Rewrite the PLT entry at `ptr` of `program` to jump straight to the function its GOT slot points at, if in range.
+// Returns whether the entry was rewritten.
+bool patchPltEntry(const Program &program, uint8_t *ptr);
+
+// Determine whether a static relocation type needs a global offset table slot for its symbol.
+bool needsGotSlot(uint32_t relType);
+// Determine whether a static relocation type is a call that can be sent through a veneer if its target is out of range.
+bool canUseVeneer(uint32_t relType);
+// Determine whether a call sequence at `from` can reach `to` without a veneer.
+bool callReaches(Addr from, Addr to);
+// Get the size of a veneer, or 0 if there are none for this machine.
+size_t veneerSize();
+// Write a veneer to `ptr` that jumps to `target` from anywhere.
+// `ptr` must be aligned to the size of `Addr`.
+// Returns success status.
+bool makeVeneer(uint8_t *ptr, Addr target);
+// Shrink code sequences in a section of a relocatable object whose targets are in range of shorter ones.
+// Sequences are only shrunk if they stay in range when addresses change by up to `slack` bytes.
+// Returns success status.
+bool relaxSection(RelObject &obj, RelObject::Section &sect, Addr slack);
+// Remove alignment padding that is not needed where the code of a section of a relocatable object ended up.
+// Returns success status; fails if there is not enough padding.
+bool alignSection(RelObject &obj, RelObject::Section &sect);
+// Apply the static relocations of a section of a relocatable object to its copy at `mem`.
+// Returns success status.
+bool relocateSection(const RelObject &obj, const RelObject::Section &sect, uint8_t *mem);
+
+// Get the size of a call-counting thunk, or 0 if there are none for this machine.
+size_t callThunkSize();
+// Write a thunk to `ptr` that adds one to the `Addr`-sized counter at `counter` and then jumps to `target`.
+// `ptr` must be aligned to the size of `Addr`.
+// Returns success status.
+bool makeCallThunk(uint8_t *ptr, Addr counter, Addr target);
 
 // Extract symbols from a loaded program into the map.
 bool exportSymbols(const ELFFile &ctx, const Program &program, SymMap &map);
@@ -25,6 +25,8 @@
 #include "relocation.hpp"
 #include "elfloader_int.hpp"
 
+#include <algorithm>
+
 /*
 A			Addend field in the relocation entry associated with the symbol
 B			Base address of a shared object loaded into memory
@@ -53,6 +55,36 @@ enum class Reloc {
 	TLS_DTPREL64 = 9,
 	TLS_TPREL32  = 10,
 	TLS_TPREL64  = 11,
+	// Static relocations, found in relocatable objects.
+	BRANCH       = 16,
+	JAL          = 17,
+	CALL         = 18,
+	CALL_PLT     = 19,
+	GOT_HI20     = 20,
+	PCREL_HI20   = 23,
+	PCREL_LO12_I = 24,
+	PCREL_LO12_S = 25,
+	HI20         = 26,
+	LO12_I       = 27,
+	LO12_S       = 28,
+	ADD8         = 33,
+	ADD16        = 34,
+	ADD32        = 35,
+	ADD64        = 36,
+	SUB8         = 37,
+	SUB16        = 38,
+	SUB32        = 39,
+	SUB64        = 40,
+	ALIGN        = 43,
+	RVC_BRANCH   = 44,
+	RVC_JUMP     = 45,
+	RELAX        = 51,
+	SUB6         = 52,
+	SET6         = 53,
+	SET8         = 54,
+	SET16        = 55,
+	SET32        = 56,
+	PCREL32      = 57,
 	IRELATIVE    = 58,
 };
 
@@ -64,6 +96,32 @@ void store(uint8_t *ptr, T in) {
 	}
 }
 
+// LOAD TEMPLATE.
+template<typename T>
+T load(const uint8_t *ptr) {
+	T out = 0;
+	for (int i = 0; i < sizeof(T); i++) {
+		out |= (T) ptr[i] << (8 * i);
+	}
+	return out;
+}
+
+
+
+// Determine how a relocation type computes its value.
+RelKind relocationKind(uint32_t relType) {
+	switch ((Reloc) relType) {
+		case Reloc::RELATIVE:  return RelKind::RELATIVE;
+		case Reloc::JUMP_SLOT: return RelKind::SLOT;
+		#ifdef ELFLOADER_ELF_IS_ELF64
+		case Reloc::ABS64:     return RelKind::SYMBOL;
+		#else
+		case Reloc::ABS32:     return RelKind::SYMBOL;
+		#endif
+		default:               return RelKind::OTHER;
+	}
+}
+
 
 
 // Reads an ADDEND for a relocation.
@@ -82,22 +140,18 @@ Addr getAddend(const ELFFile &ctx, uint32_t relType, uint8_t *ptr) {
 bool applyRelocation(const ELFFile &ctx, const Program &program, uint32_t relType, Addr symVal, Addr addend, uint8_t *ptr) {
 	switch ((Reloc) relType) {
 		case Reloc::ABS32:
-			LOGD("Reloc R_RISCV_32");
 			store<uint32_t>(ptr, S + A);
 			return true;
 			
 		case Reloc::ABS64:
-			LOGD("Reloc R_RISCV_64");
 			store<uint64_t>(ptr, S + A);
 			return true;
 			
 		case Reloc::RELATIVE:
-			LOGD("Reloc R_RISCV_RELATIVE");
 			store<Addr>(ptr, B + A);
 			return true;
 			
 		case Reloc::JUMP_SLOT:
-			LOGD("Reloc R_RISCV_JUMP_SLOT");
 			store<Addr>(ptr, S);
 			return true;
 			
@@ -111,4 +165,399 @@ bool applyRelocation(const ELFFile &ctx, const Program &program, uint32_t relTyp
 
 
 
+// Registers used by thunks; all are temporaries, free to use between a call and its callee.
+static const uint32_t T0 = 5, T1 = 6, T2 = 7;
+#ifdef ELFLOADER_ELF_IS_ELF64
+static const uint32_t LOAD = 3, STORE = 3;
+#else
+static const uint32_t LOAD = 2, STORE = 2;
+#endif
+
+// Encode an I-type instruction.
+static constexpr uint32_t iType(uint32_t opcode, uint32_t funct3, uint32_t rd, uint32_t rs1, int32_t imm) {
+	return (uint32_t) imm << 20 | rs1 << 15 | funct3 << 12 | rd << 7 | opcode;
+}
+
+// Encode an S-type instruction.
+static constexpr uint32_t sType(uint32_t opcode, uint32_t funct3, uint32_t rs1, uint32_t rs2, int32_t imm) {
+	return ((uint32_t) imm >> 5 & 0x7f) << 25 | rs2 << 20 | rs1 << 15 | funct3 << 12 | (imm & 0x1f) << 7 | opcode;
+}
+
+// Offset of the data words in a thunk.
+static const int32_t THUNK_DATA = 32;
+
+// Get the size of a call-counting thunk.
+size_t callThunkSize() {
+	return THUNK_DATA + 2 * sizeof(Addr);
+}
+
+// Write a thunk that adds one to the counter at `counter` and then jumps to `target`.
+// The increment is not atomic, so that it does not need the A extension; concurrent calls may be counted once.
+bool makeCallThunk(uint8_t *ptr, Addr counter, Addr target) {
+	const uint32_t code[] = {
+		0x00000017 | T0 << 7,                                  // auipc t0, 0
+		iType(0x03, LOAD,  T1, T0, THUNK_DATA),                // l[wd] t1, counter
+		iType(0x03, LOAD,  T2, T1, 0),                         // l[wd] t2, 0(t1)
+		iType(0x13, 0,     T2, T2, 1),                         // addi  t2, t2, 1
+		sType(0x23, STORE, T1, T2, 0),                         // s[wd] t2, 0(t1)
+		iType(0x03, LOAD,  T1, T0, THUNK_DATA + sizeof(Addr)), // l[wd] t1, target
+		iType(0x67, 0,     0,  T1, 0),                         // jr    t1
+		0x00000013,                                            // nop
+	};
+	static_assert(sizeof(code) == THUNK_DATA, "Thunk code does not match THUNK_DATA");
+	for (size_t i = 0; i < sizeof(code) / sizeof(code[0]); i++) {
+		store<uint32_t>(ptr + 4 * i, code[i]);
+	}
+	store<Addr>(ptr + THUNK_DATA, counter);
+	store<Addr>(ptr + THUNK_DATA + sizeof(Addr), target);
+	return true;
+}
+
+
+
+// Whether a signed value fits in `bits` bits.
+static bool fits(SAddr value, int bits) {
+	return value >= -((SAddr) 1 << (bits - 1)) && value < ((SAddr) 1 << (bits - 1));
+}
+
+// Make the info field of a relocation.
+static Addr relInfo(uint32_t sym, uint32_t type) {
+#ifdef ELFLOADER_ELF_IS_ELF64
+	return (Addr) sym << 32 | type;
+#else
+	return (Addr) sym << 8 | type;
+#endif
+}
+
+// Set the immediate of a U-type instruction to the upper part of `value`, rounded for a following I or S-type.
+static void patchU(uint8_t *ptr, Addr value) {
+	store<uint32_t>(ptr, (load<uint32_t>(ptr) & 0x00000fff) | ((value + 0x800) & 0xfffff000));
+}
+
+// Set the immediate of an I-type instruction to the lower 12 bits of `value`.
+static void patchI(uint8_t *ptr, Addr value) {
+	store<uint32_t>(ptr, (load<uint32_t>(ptr) & 0x000fffff) | (value & 0xfff) << 20);
+}
+
+// Set the immediate of an S-type instruction to the lower 12 bits of `value`.
+static void patchS(uint8_t *ptr, Addr value) {
+	store<uint32_t>(ptr, (load<uint32_t>(ptr) & 0x01fff07f) | (value & 0xfe0) << 20 | (value & 0x1f) << 7);
+}
+
+// Set the offset of a B-type instruction.
+static void patchB(uint8_t *ptr, Addr value) {
+	store<uint32_t>(ptr, (load<uint32_t>(ptr) & 0x01fff07f) | (value >> 12 & 1) << 31 | (value >> 5 & 0x3f) << 25
+		| (value >> 1 & 0xf) << 8 | (value >> 11 & 1) << 7);
+}
+
+// Set the offset of a J-type instruction.
+static void patchJ(uint8_t *ptr, Addr value) {
+	store<uint32_t>(ptr, (load<uint32_t>(ptr) & 0x00000fff) | (value >> 20 & 1) << 31 | (value >> 1 & 0x3ff) << 21
+		| (value >> 11 & 1) << 20 | (value >> 12 & 0xff) << 12);
+}
+
+// Set the offset of a CB-type instruction.
+static void patchCB(uint8_t *ptr, Addr value) {
+	store<uint16_t>(ptr, (load<uint16_t>(ptr) & 0xe383) | (value >> 8 & 1) << 12 | (value >> 3 & 3) << 10
+		| (value >> 6 & 3) << 5 | (value >> 1 & 3) << 3 | (value >> 5 & 1) << 2);
+}
+
+// Set the offset of a CJ-type instruction.
+static void patchCJ(uint8_t *ptr, Addr value) {
+	store<uint16_t>(ptr, (load<uint16_t>(ptr) & 0xe003) | (value >> 11 & 1) << 12 | (value >> 4 & 1) << 11
+		| (value >> 8 & 3) << 9 | (value >> 10 & 1) << 8 | (value >> 6 & 1) << 7 | (value >> 7 & 1) << 6
+		| (value >> 1 & 7) << 3 | (value >> 5 & 1) << 2);
+}
+
+// Size of a PLT entry and of the PLT header, as emitted by the GNU and LLVM linkers.
+static const size_t PLT_ENTRY = 16, PLT_HEADER = 32;
+
+// Get the size of a PLT entry and of the header before the first, or 0 if PLT entries cannot be patched for this machine.
+size_t pltEntrySize(size_t &headerSize) {
+	headerSize = PLT_HEADER;
+	return PLT_ENTRY;
+}
+
+// Rewrite the PLT entry at `ptr` of `program` to jump straight to the function its GOT slot points at, if in range.
+// The entry is `auipc t3, slot; l[wd] t3, slot(t3); jalr t1, t3; nop`, which becomes `jal zero, target` within 1 MiB
+// or `auipc t3, target; jr target(t3)` within 2 GiB; the rest of the entry is left as it was.
+bool patchPltEntry(const Program &program, uint8_t *ptr) {
+	uint32_t auipc = load<uint32_t>(ptr), ld = load<uint32_t>(ptr + 4), jalr = load<uint32_t>(ptr + 8);
+	uint32_t reg   = auipc >> 7 & 31;
+	if ((auipc & 0x7f) != 0x17 || (ld & 0x707f) != (0x03 | LOAD << 12) || (ld >> 15 & 31) != reg) return false;
+	if ((jalr & 0x707f) != 0x67 || (jalr >> 15 & 31) != (ld >> 7 & 31)) return false;
+	
+	// Find the GOT slot the entry loads.
+	Addr pc   = (Addr) ptr;
+	Addr slot = pc + (SAddr) (int32_t) (auipc & 0xfffff000) + (SAddr) ((int32_t) ld >> 20);
+	Addr base = (Addr) program.memory;
+	if (slot < base || slot + sizeof(Addr) > base + program.size || slot % sizeof(Addr)) return false;
+	Addr target = *(const Addr *) slot;
+	if (!target) return false;
+	
+	SAddr dist = target - pc;
+	if (fits(dist, 21) && !(dist % 2)) {
+		store<uint32_t>(ptr, 0x6f);
+		patchJ(ptr, dist);
+	} else if (fits(dist + 0x800, 32)) {
+		store<uint32_t>(ptr,     0x17 | reg << 7);
+		store<uint32_t>(ptr + 4, iType(0x67, 0, 0, reg, 0));
+		patchU(ptr, dist);
+		patchI(ptr + 4, dist);
+	} else {
+		return false;
+	}
+	return true;
+}
+
+// Determine whether a call sequence at `from` can reach `to` without a veneer.
+bool callReaches(Addr from, Addr to) {
+	return fits(to - from + 0x800, 32);
+}
+
+// Determine whether a static relocation type is a call that can be sent through a veneer if its target is out of range.
+bool canUseVeneer(uint32_t relType) {
+	return (Reloc) relType == Reloc::CALL || (Reloc) relType == Reloc::CALL_PLT;
+}
+
+// Offset of the target address in a veneer.
+static const int32_t VENEER_DATA = 16;
+
+// Get the size of a veneer, or 0 if there are none for this machine.
+size_t veneerSize() {
+	return VENEER_DATA + sizeof(Addr);
+}
+
+// Write a veneer that jumps to `target` from anywhere.
+// Like the PLT, it uses t1, which the calling convention leaves free between a call and its callee.
+bool makeVeneer(uint8_t *ptr, Addr target) {
+	const uint32_t code[] = {
+		0x00000017 | T1 << 7,                   // auipc t1, 0
+		iType(0x03, LOAD, T1, T1, VENEER_DATA), // l[wd] t1, target
+		iType(0x67, 0,    0,  T1, 0),           // jr    t1
+		0x00000013,                             // nop
+	};
+	static_assert(sizeof(code) == VENEER_DATA, "Veneer code does not match VENEER_DATA");
+	for (size_t i = 0; i < sizeof(code) / sizeof(code[0]); i++) {
+		store<uint32_t>(ptr + 4 * i, code[i]);
+	}
+	store<Addr>(ptr + VENEER_DATA, target);
+	return true;
+}
+
+// Determine whether a static relocation type needs a global offset table slot for its symbol.
+bool needsGotSlot(uint32_t relType) {
+	return (Reloc) relType == Reloc::GOT_HI20;
+}
+
+// Shrink code sequences in a section of a relocatable object whose targets are in range of shorter ones.
+// Only `auipc` + `jalr` pairs marked relaxable are shrunk, to `jal`.
+// Global pointer relaxation does not apply, since the global pointer belongs to the host.
+bool relaxSection(RelObject &obj, RelObject::Section &sect, Addr slack) {
+	std::vector<std::pair<Addr, Addr>> deleted;
+	auto &relocs = sect.relocs;
+	for (size_t i = 0; i + 1 < relocs.size(); i++) {
+		auto &rel = relocs[i];
+		if ((Reloc) rel.type() != Reloc::CALL && (Reloc) rel.type() != Reloc::CALL_PLT) continue;
+		if ((Reloc) relocs[i+1].type() != Reloc::RELAX || relocs[i+1].offset != rel.offset) continue;
+		if (rel.offset + 8 > sect.data.size()) continue;
+		
+		// A `jal` reaches 1 MiB either way.
+		SAddr dist = obj.symbolAddr(rel.symIndex()) + rel.addend - (obj.sectionAddr(sect) + rel.offset);
+		if (!fits(dist < 0 ? dist - slack : dist + slack, 21)) continue;
+		
+		// `jal` links to the register the `jalr` did, ra for a call and zero for a tail call.
+		uint32_t rd = load<uint32_t>(&sect.data[rel.offset + 4]) >> 7 & 31;
+		store<uint32_t>(&sect.data[rel.offset], 0x6f | rd << 7);
+		rel.info = relInfo(rel.symIndex(), (uint32_t) Reloc::JAL);
+		deleted.push_back({rel.offset + 4, 4});
+	}
+	
+	if (!deleted.empty()) LOGD("Relaxed %zu calls", deleted.size());
+	obj.deleteBytes(sect, deleted);
+	return true;
+}
+
+// Remove alignment padding that is not needed where the code of a section ended up.
+bool alignSection(RelObject &obj, RelObject::Section &sect) {
+	std::vector<std::pair<Addr, Addr>> deleted;
+	Addr removed = 0;
+	for (const auto &rel: sect.relocs) {
+		if ((Reloc) rel.type() != Reloc::ALIGN) continue;
+		
+		// The assembler emitted `addend` bytes of NOPs, enough for the worst case.
+		Addr align = 1;
+		while (align <= (Addr) rel.addend) align *= 2;
+		if (align > sect.align || rel.offset + rel.addend > sect.data.size()) {
+			LOGE("Invalid R_RISCV_ALIGN at 0x%zx", (size_t) rel.offset);
+			return false;
+		}
+		Addr offset = rel.offset - removed;
+		Addr keep   = (align - offset % align) % align;
+		if (keep > (Addr) rel.addend || keep % 2) {
+			LOGE("Not enough padding for R_RISCV_ALIGN at 0x%zx", (size_t) rel.offset);
+			return false;
+		}
+		
+		// The NOPs that are kept must add up to exactly the padding needed.
+		uint8_t *ptr = &sect.data[rel.offset];
+		for (Addr i = 0; i + 4 <= keep; i += 4) store<uint32_t>(ptr + i, 0x00000013);
+		if (keep % 4) store<uint16_t>(ptr + keep - 2, 0x0001);
+		if (keep < (Addr) rel.addend) {
+			deleted.push_back({rel.offset + keep, rel.addend - keep});
+			removed += rel.addend - keep;
+		}
+	}
+	
+	obj.deleteBytes(sect, deleted);
+	return true;
+}
+
+#define P pc
+
+// Apply the static relocations of a section of a relocatable object to its copy at `mem`.
+bool relocateSection(const RelObject &obj, const RelObject::Section &sect, uint8_t *mem) {
+	const auto &relocs = sect.relocs;
+	for (const auto &rel: relocs) {
+		uint8_t *ptr   = mem + rel.offset;
+		Addr     pc    = obj.sectionAddr(sect) + rel.offset;
+		Addr     symVal = obj.symbolAddr(rel.symIndex());
+		Addr     addend = rel.addend;
+		TRACE(ELF_RELOC, rel.type(), rel.offset, rel.symIndex(), rel.addend);
+		if (obj.ctx.stats) obj.ctx.stats->relocs[rel.type()]++;
+		
+		// Check that a PC-relative value fits and is aligned.
+		auto inRange = [&](SAddr value, int bits, int align) {
+			if (fits(value, bits) && !(value % align)) return true;
+			LOGE("Relocation type %u at 0x%zx out of range", (unsigned) rel.type(), (size_t) rel.offset);
+			return false;
+		};
+		
+		switch ((Reloc) rel.type()) {
+			case Reloc::ABS32:
+				store<uint32_t>(ptr, S + A);
+				break;
+				
+			case Reloc::ABS64:
+				store<uint64_t>(ptr, S + A);
+				break;
+				
+			case Reloc::PCREL32:
+				store<uint32_t>(ptr, S + A - P);
+				break;
+				
+			case Reloc::BRANCH:
+				if (!inRange(S + A - P, 13, 2)) return false;
+				patchB(ptr, S + A - P);
+				break;
+				
+			case Reloc::JAL:
+				if (!inRange(S + A - P, 21, 2)) return false;
+				patchJ(ptr, S + A - P);
+				break;
+				
+			case Reloc::RVC_BRANCH:
+				if (!inRange(S + A - P, 9, 2)) return false;
+				patchCB(ptr, S + A - P);
+				break;
+				
+			case Reloc::RVC_JUMP:
+				if (!inRange(S + A - P, 12, 2)) return false;
+				patchCJ(ptr, S + A - P);
+				break;
+				
+			case Reloc::CALL:
+			case Reloc::CALL_PLT: {
+				// Imports out of range are called through their veneer.
+				Addr target = S + A;
+				auto veneer = obj.veneers.find(rel.symIndex());
+				if (veneer != obj.veneers.end() && !A && !callReaches(P, target)) {
+					target = obj.base + obj.veneerOffset + veneer->second * veneerSize();
+				}
+				if (!inRange(target - P + 0x800, 32, 1)) return false;
+				patchU(ptr, target - P);
+				patchI(ptr + 4, target - P);
+			} break;
+				
+			case Reloc::PCREL_HI20:
+				if (!inRange(S + A - P + 0x800, 32, 1)) return false;
+				patchU(ptr, S + A - P);
+				break;
+				
+			case Reloc::GOT_HI20: {
+				Addr got = obj.base + obj.gotOffset + obj.got.at(rel.symIndex()) * sizeof(Addr);
+				if (!inRange(got - P + 0x800, 32, 1)) return false;
+				patchU(ptr, got - P);
+			} break;
+				
+			case Reloc::PCREL_LO12_I:
+			case Reloc::PCREL_LO12_S: {
+				// The symbol is the `auipc` with the upper part, whose relocation has the actual target.
+				Addr hiOffset = S - obj.sectionAddr(sect);
+				auto hi = std::lower_bound(relocs.begin(), relocs.end(), hiOffset, [](const RelaEntry &rel, Addr offset) {
+					return rel.offset < offset;
+				});
+				while (hi != relocs.end() && hi->offset == hiOffset && (Reloc) hi->type() != Reloc::PCREL_HI20
+						&& (Reloc) hi->type() != Reloc::GOT_HI20) {
+					hi++;
+				}
+				if (hi == relocs.end() || hi->offset != hiOffset) {
+					LOGE("No R_RISCV_PCREL_HI20 for R_RISCV_PCREL_LO12 at 0x%zx", (size_t) rel.offset);
+					return false;
+				}
+				Addr value;
+				if ((Reloc) hi->type() == Reloc::GOT_HI20) {
+					value = obj.base + obj.gotOffset + obj.got.at(hi->symIndex()) * sizeof(Addr) - S;
+				} else {
+					value = obj.symbolAddr(hi->symIndex()) + hi->addend - S;
+				}
+				if ((Reloc) rel.type() == Reloc::PCREL_LO12_I) patchI(ptr, value);
+				else patchS(ptr, value);
+			} break;
+				
+			case Reloc::HI20:
+				if (!inRange(S + A + 0x800, 32, 1)) return false;
+				patchU(ptr, S + A);
+				break;
+				
+			case Reloc::LO12_I:
+				patchI(ptr, S + A);
+				break;
+				
+			case Reloc::LO12_S:
+				patchS(ptr, S + A);
+				break;
+				
+			case Reloc::ADD8:  store<uint8_t> (ptr, load<uint8_t> (ptr) + S + A); break;
+			case Reloc::ADD16: store<uint16_t>(ptr, load<uint16_t>(ptr) + S + A); break;
+			case Reloc::ADD32: store<uint32_t>(ptr, load<uint32_t>(ptr) + S + A); break;
+			case Reloc::ADD64: store<uint64_t>(ptr, load<uint64_t>(ptr) + S + A); break;
+			case Reloc::SUB8:  store<uint8_t> (ptr, load<uint8_t> (ptr) - S - A); break;
+			case Reloc::SUB16: store<uint16_t>(ptr, load<uint16_t>(ptr) - S - A); break;
+			case Reloc::SUB32: store<uint32_t>(ptr, load<uint32_t>(ptr) - S - A); break;
+			case Reloc::SUB64: store<uint64_t>(ptr, load<uint64_t>(ptr) - S - A); break;
+			case Reloc::SUB6:  store<uint8_t> (ptr, (*ptr & 0xc0) | ((*ptr - S - A) & 0x3f)); break;
+			case Reloc::SET6:  store<uint8_t> (ptr, (*ptr & 0xc0) | ((S + A) & 0x3f)); break;
+			case Reloc::SET8:  store<uint8_t> (ptr, S + A); break;
+			case Reloc::SET16: store<uint16_t>(ptr, S + A); break;
+			case Reloc::SET32: store<uint32_t>(ptr, S + A); break;
+				
+			case Reloc::RELAX:
+			case Reloc::ALIGN:
+				// Handled by `relaxSection` and `alignSection`.
+				break;
+				
+			default:
+				LOGE("Invalid static relocation type 0x%x", (int) rel.type());
+				return false;
+		}
+	}
+	
+	return true;
+}
+
+#undef P
+
+
+
 } // namespace elf
@@ -0,0 +1,297 @@
+/*
+	MIT License
+
+	Copyright (c) 2023 Julian Scheffers
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy
+	of this software and associated documentation files (the "Software"), to deal
+	in the Software without restriction, including without limitation the rights
+	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+	copies of the Software, and to permit persons to whom the Software is
+	furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+
+
+#include "snapshot.hpp"
+#include "elfloader_int.hpp"
+
+namespace elf::snapshot {
+
+// Whether a dynamic symbol is exported, ignoring symbols already present in the map.
+static bool isExport(const SymInfo &sym) {
+	if (sym.section >= 0xff00 || sym.section == 0) return false;
+	if (!sym.isFunction() && !sym.isObject()) return false;
+	return sym.bind() == (int) STB::GLOBAL || sym.bind() == (int) STB::WEAK;
+}
+
+// Appends records and strings to a snapshot.
+class SnapshotWriter {
+	public:
+		// Snapshot under construction.
+		std::vector<uint8_t> blob;
+		// String pool.
+		std::vector<char>    strings;
+		
+		// Append a table of records, aligned to 8 bytes.
+		template<typename T>
+		Table table(const std::vector<T> &records) {
+			blob.resize((blob.size() + 7) & ~7, 0);
+			Table out = { (uint32_t) blob.size(), (uint32_t) records.size() };
+			auto ptr = (const uint8_t *) records.data();
+			blob.insert(blob.end(), ptr, ptr + records.size() * sizeof(T));
+			return out;
+		}
+		
+		// Add a string to the pool.
+		String string(const std::string &str) {
+			String out = { (uint32_t) strings.size(), (uint32_t) str.size() };
+			strings.insert(strings.end(), str.begin(), str.end());
+			strings.push_back(0);
+			return out;
+		}
+};
+
+// Snapshot a loaded, relocated program.
+std::vector<uint8_t> save(const ELFFile &ctx, const Program &program, const SymMap &map, uint64_t key) {
+	if (!ctx.isValid() || !program) return {};
+	SnapshotWriter writer;
+	Header head = {};
+	memcpy(head.magic, MAGIC, sizeof(MAGIC));
+	head.version   = VERSION;
+	head.machine   = ctx.getHeader().machine;
+	head.addrSize  = sizeof(Addr);
+	head.key       = key;
+	head.vaddrReq  = program.vaddr_req;
+	head.vaddrReal = program.vaddr_real;
+	head.size      = program.size;
+	head.padding   = program.padding;
+	head.regionGranularity = program.region_granularity;
+	head.entry     = (Addr) program.entry - program.vaddr_real;
+	head.dynamic   = program.dynamic ? (Addr) program.dynamic - program.vaddr_real : UINT64_MAX;
+	head.align     = program.align;
+	
+	// Imported symbols, and the values they were relocated with.
+	std::vector<Import> imports;
+	for (const auto &sym: ctx.getDynSym()) {
+		if (sym.section != 0 || sym.name.empty()) continue;
+		auto iter = map.find(sym.name);
+		_elf_count_lookup(iter != map.end());
+		if (iter == map.end()) {
+			LOGE("Symbol '%s' not in symbol map", sym.name.c_str());
+			return {};
+		}
+		imports.push_back({writer.string(sym.name), iter->second});
+	}
+	
+	// Exported symbols.
+	std::vector<Export> exports;
+	for (const auto &sym: ctx.getDynSym()) {
+		if (!isExport(sym)) continue;
+		exports.push_back({sym.value - program.vaddr_req, writer.string(sym.name), sym.bind(), 0});
+	}
+	
+	// Segment protection, as `mpu::applyPH` sets it.
+	std::vector<Region> regions;
+	auto segs = program.region_granularity ? ctx.napotSegments(program.region_granularity) : ctx.getProg();
+	for (const auto &prog: segs) {
+		if (prog.type != (int) PT::LOAD) continue;
+		regions.push_back({prog.vaddr - program.vaddr_req, prog.mem_size, prog.flags, 0});
+	}
+	
+	writer.blob.resize(sizeof(Header));
+	head.imports     = writer.table(imports);
+	head.exports     = writer.table(exports);
+	head.regions     = writer.table(regions);
+	head.strings     = writer.blob.size();
+	head.stringsSize = writer.strings.size();
+	writer.blob.insert(writer.blob.end(), writer.strings.begin(), writer.strings.end());
+	
+	// Memory image, without the trailing zeroes.
+	auto mem = (const uint8_t *) program.memory;
+	size_t dataSize = program.size;
+	while (dataSize && !mem[dataSize - 1]) dataSize--;
+	writer.blob.resize((writer.blob.size() + 7) & ~7, 0);
+	head.dataOffset = writer.blob.size();
+	head.dataSize   = dataSize;
+	writer.blob.insert(writer.blob.end(), mem, mem + dataSize);
+	
+	memcpy(writer.blob.data(), &head, sizeof(Header));
+	return writer.blob;
+}
+
+
+
+// Check that a table lies within the first `size` bytes of a snapshot.
+template<typename T>
+static bool checkTable(Table table, size_t size) {
+	return !(table.offset % alignof(T)) && table.offset <= size && (size - table.offset) / sizeof(T) >= table.count;
+}
+
+// Check a snapshot made by `save` for the ELF file identified by `key`.
+Snapshot::Snapshot(const void *blobPtr, size_t size, uint64_t key, LoadStats *stats): stats(stats), valid(false), blob((const uint8_t *) blobPtr) {
+	PHASE(stats, HEADER);
+	if ((size_t) blob % 8 || size < sizeof(Header)) {
+		LOGW("Snapshot invalid (size or alignment)");
+		return;
+	}
+	memcpy(&header, blob, sizeof(Header));
+	
+	// Validate the key and layout.
+	if (memcmp(header.magic, MAGIC, sizeof(MAGIC)) || header.version != VERSION || header.addrSize != sizeof(Addr)) {
+		LOGW("Snapshot invalid (magic or version)");
+		return;
+	} else if (header.key != key) {
+		LOGD("Snapshot is stale");
+		return;
+	} else if (machineType && header.machine != machineType) {
+		LOGW("Snapshot has machine type 0x%04x", header.machine);
+		return;
+	} else if (header.dataOffset > size || size - header.dataOffset < header.dataSize || header.dataSize > header.size
+		|| header.entry > header.size || (header.dynamic != UINT64_MAX && header.dynamic > header.size)) {
+		LOGW("Snapshot invalid (size)");
+		return;
+	}
+	
+	// Validate the tables.
+	size_t metaSize = header.dataOffset;
+	if (!checkTable<Import>(header.imports, metaSize) || !checkTable<Export>(header.exports, metaSize)
+		|| !checkTable<Region>(header.regions, metaSize)
+		|| header.strings > metaSize || metaSize - header.strings < header.stringsSize) {
+		LOGW("Snapshot invalid (table bounds)");
+		return;
+	}
+	bool ok = true;
+	auto checkString = [&](String str) {
+		ok &= str.offset <= header.stringsSize && header.stringsSize - str.offset > str.length;
+	};
+	for (uint32_t i = 0; i < header.imports.count; i++) {
+		checkString(table<Import>(header.imports)[i].name);
+	}
+	for (uint32_t i = 0; i < header.exports.count; i++) {
+		checkString(table<Export>(header.exports)[i].name);
+	}
+	for (uint32_t i = 0; i < header.regions.count; i++) {
+		auto region = table<Region>(header.regions)[i];
+		ok &= region.offset <= header.size && header.size - region.offset >= region.size;
+	}
+	if (!ok) {
+		LOGW("Snapshot invalid (record bounds)");
+		return;
+	}
+	
+	valid = true;
+}
+
+// Whether the imported symbols in `map` have the values the snapshot was made with.
+bool Snapshot::matches(const SymMap &map) const {
+	if (!valid) return false;
+	auto imports = table<Import>(header.imports);
+	for (uint32_t i = 0; i < header.imports.count; i++) {
+		auto iter = map.find(std::string(string(imports[i].name), imports[i].name.length));
+		_elf_count_lookup(iter != map.end());
+		if (iter == map.end() || iter->second != imports[i].value) return false;
+	}
+	return true;
+}
+
+// Allocate memory at the address the snapshot was made for and copy the memory image in.
+bool Snapshot::restore(ELFFile::Allocator alloc, const SymMap &map, Program &out) const {
+	out = Program();
+	if (!valid) return false;
+	PHASE(stats, LOAD);
+	if (!matches(map)) {
+		LOGD("Snapshot was made with other imported symbols");
+		return false;
+	}
+	
+	// Get memory.
+	if (_elf_phase) _elf_phase->allocations++;
+	auto allocation = alloc(header.vaddrReq, header.size, header.align);
+	out.memory = (void *) allocation.first;
+	out.memory_cookie = (void *) allocation.second;
+	out.vaddr_req  = header.vaddrReq;
+	out.vaddr_real = allocation.first;
+	out.size       = header.size;
+	out.align      = header.align;
+	out.padding    = header.padding;
+	out.region_granularity = header.regionGranularity;
+	if (!out) {
+		LOGE("Unable to allocate %zu bytes for loading", (size_t) header.size);
+		return false;
+	}
+	out.entry   = (void *) (out.vaddr_real + header.entry);
+	out.dynamic = header.dynamic != UINT64_MAX ? (void *) (out.vaddr_real + header.dynamic) : nullptr;
+	if (out.vaddr_real != header.vaddrReal) {
+		LOGD("Snapshot was made for 0x%zx, not 0x%zx", (size_t) header.vaddrReal, (size_t) out.vaddr_real);
+		return false;
+	}
+	
+	// Copy the memory image in.
+	memcpy(out.memory, blob + header.dataOffset, header.dataSize);
+	memset((uint8_t *) out.memory + header.dataSize, 0, header.size - header.dataSize);
+	TRACE(ELF_SEGMENT, out.vaddr_real, header.dataSize, header.size, 0);
+	
+	return true;
+}
+
+// Extract exported symbols into the map, like `exportSymbols`.
+bool Snapshot::exportSymbols(const Program &program, SymMap &map) const {
+	if (!valid) return false;
+	PHASE(stats, EXPORT);
+	auto exports = table<Export>(header.exports);
+	
+	// Check for duplicates before changing the map.
+	for (uint32_t i = 0; i < header.exports.count; i++) {
+		if (exports[i].bind != (int) STB::GLOBAL) continue;
+		std::string name(string(exports[i].name), exports[i].name.length);
+		auto existing = map.find(name);
+		_elf_count_lookup(existing != map.end());
+		if (existing != map.end()) {
+			LOGE("Duplicate symbol '%s'", name.c_str());
+			return false;
+		}
+	}
+	
+	// Weak symbols do not replace existing ones.
+	for (uint32_t i = 0; i < header.exports.count; i++) {
+		map.emplace(std::string(string(exports[i].name), exports[i].name.length), program.vaddr_real + exports[i].offset);
+	}
+	
+	return true;
+}
+
+// Get the MPU regions that protect the restored program.
+std::vector<mpu::Region> Snapshot::regions(const Program &program) const {
+	std::vector<mpu::Region> out;
+	if (!valid) return out;
+	auto regions = table<Region>(header.regions);
+	for (uint32_t i = 0; i < header.regions.count; i++) {
+		out.push_back({
+			// Compute address.
+			regions[i].offset + program.vaddr_real,
+			regions[i].size,
+			// Default privilege.
+			mpu::PRIV_MIN,
+			// Forwards permission flags.
+			!!(regions[i].flags & 0x4),
+			!!(regions[i].flags & 0x2),
+			!!(regions[i].flags & 0x1),
+			// Active region.
+			1
+		});
+	}
+	return mpu::pureMerge(out);
+}
+
+} // namespace elf::snapshot
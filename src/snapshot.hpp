@@ -0,0 +1,192 @@
+/*
+	MIT License
+
+	Copyright (c) 2023 Julian Scheffers
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy
+	of this software and associated documentation files (the "Software"), to deal
+	in the Software without restriction, including without limitation the rights
+	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+	copies of the Software, and to permit persons to whom the Software is
+	furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <vector>
+
+#include "elfloader.hpp"
+#include "mpu.hpp"
+
+// Snapshots of loaded programs: the memory of a program after loading, relocation and exporting,
+// saved so that it can be copied back in on the next start instead of parsing and linking the ELF file again.
+//
+// A snapshot holds the relocated memory image, the symbols the program exports and the protection of each segment.
+// It is only valid for the same ELF file, load address and values of imported symbols;
+// the first is identified by a key such as `contentHash`, the others are checked when it is restored.
+namespace elf::snapshot {
+
+// Version of the snapshot layout; bump when any of the structures below change.
+static const uint32_t VERSION = 1;
+
+// Location of a table in a snapshot.
+struct Table {
+	// Offset from the start of the snapshot.
+	uint32_t offset;
+	// Number of records.
+	uint32_t count;
+};
+
+// A string in the string pool.
+struct String {
+	// Offset in the string pool.
+	uint32_t offset;
+	// Length excluding the NUL terminator.
+	uint32_t length;
+};
+
+// An imported symbol.
+struct Import {
+	// Name.
+	String   name;
+	// Value the program was relocated with.
+	uint64_t value;
+};
+
+// An exported symbol.
+struct Export {
+	// Address relative to the start of the memory image.
+	uint64_t offset;
+	// Name.
+	String   name;
+	// ELF symbol binding.
+	uint32_t bind;
+	// Padding bytes.
+	uint32_t _padding0;
+};
+
+// Protection of part of the memory image.
+struct Region {
+	// Offset from the start of the memory image.
+	uint64_t offset;
+	// Size in bytes.
+	uint64_t size;
+	// ELF segment flags: execute is bit 0, write bit 1 and read bit 2.
+	uint32_t flags;
+	// Padding bytes.
+	uint32_t _padding0;
+};
+
+// Header of a snapshot.
+struct Header {
+	// Magic: "ELFSNAP\0".
+	char     magic[8];
+	// Layout version.
+	uint32_t version;
+	// ELF machine type.
+	uint16_t machine;
+	// Size of `Addr` the snapshot was made for.
+	uint16_t addrSize;
+	// Key of the ELF file the snapshot was made from.
+	uint64_t key;
+	// Link-time address of the start of the memory image.
+	uint64_t vaddrReq;
+	// Address the memory image was relocated for.
+	uint64_t vaddrReal;
+	// Size of the memory image.
+	uint64_t size;
+	// Alignment of the memory image.
+	uint64_t align;
+	// Padding added for MPU regions; see `Program::padding`.
+	uint64_t padding;
+	// MPU region granularity; see `Program::region_granularity`.
+	uint64_t regionGranularity;
+	// Entrypoint, relative to the start of the memory image.
+	uint64_t entry;
+	// Dynamic segment, relative to the start of the memory image, or UINT64_MAX if none.
+	uint64_t dynamic;
+	// Offset of the memory image data.
+	uint64_t dataOffset;
+	// Size of the data; the rest of the memory image is zeroed.
+	uint64_t dataSize;
+	// Imported symbols, as `Import`.
+	Table    imports;
+	// Exported symbols, as `Export`.
+	Table    exports;
+	// Segment protection, as `Region`.
+	Table    regions;
+	// Offset of the string pool.
+	uint32_t strings;
+	// Size of the string pool.
+	uint32_t stringsSize;
+};
+
+// Magic at the start of a snapshot.
+static const char MAGIC[8] = { 'E', 'L', 'F', 'S', 'N', 'A', 'P', 0 };
+
+// Snapshot a program that was loaded from `ctx`, relocated with the symbols in `map` and had its symbols exported.
+// `key` identifies the ELF file; see `contentHash`.
+// Returns an empty snapshot on failure.
+std::vector<uint8_t> save(const ELFFile &ctx, const Program &program, const SymMap &map, uint64_t key);
+
+// A snapshot opened for restoring.
+// The snapshot is used in place, so it must stay valid while this is in use; it may be a memory mapping.
+class Snapshot {
+	public:
+		// Optional instrumentation, filled in as the snapshot is restored.
+		// Not owned by this class.
+		LoadStats *stats;
+		
+	protected:
+		// This is a valid snapshot for this machine.
+		bool valid;
+		// The snapshot.
+		const uint8_t *blob;
+		// Snapshot header.
+		Header header;
+		
+		// Get a table of the snapshot.
+		template<typename T>
+		const T *table(Table table) const { return (const T *) (blob + table.offset); }
+		// Get a string from the string pool.
+		const char *string(String str) const { return (const char *) blob + header.strings + str.offset; }
+		
+	public:
+		// Check a snapshot made by `save` for the ELF file identified by `key`.
+		// The snapshot must be aligned to 8 bytes.
+		Snapshot(const void *blob, size_t size, uint64_t key, LoadStats *stats = nullptr);
+		
+		// Is this a VALID?
+		bool isValid() const { return valid; }
+		// Get read-only copy of header.
+		const auto &getHeader() const { return header; }
+		
+		// Whether the imported symbols in `map` have the values the snapshot was made with.
+		bool matches(const SymMap &map) const;
+		// Allocate memory at the address the snapshot was made for and copy the memory image in.
+		// Fails if the symbols in `map` do not match or the allocator returns another address;
+		// if memory was allocated, `out` is still set so that it can be released.
+		// Returns success status.
+		bool restore(ELFFile::Allocator alloc, const SymMap &map, Program &out) const;
+		// Extract exported symbols into the map, like `exportSymbols`.
+		bool exportSymbols(const Program &program, SymMap &map) const;
+		// Get the MPU regions that protect the restored program.
+		std::vector<mpu::Region> regions(const Program &program) const;
+};
+
+} // namespace elf::snapshot
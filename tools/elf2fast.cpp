@@ -0,0 +1,103 @@
+/*
+	MIT License
+
+	Copyright (c) 2023 Julian Scheffers
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy
+	of this software and associated documentation files (the "Software"), to deal
+	in the Software without restriction, including without limitation the rights
+	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+	copies of the Software, and to permit persons to whom the Software is
+	furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+
+
+#include "elfloader.hpp"
+#include "fastload.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Read a symbol map from a file with a name and an address on every line.
+// Returns success status.
+static bool readSymbols(const char *path, elf::SymMap &map) {
+	FILE *fd = fopen(path, "r");
+	if (!fd) {
+		perror(path);
+		return false;
+	}
+	char name[256];
+	char value[32];
+	while (fscanf(fd, "%255s %31s", name, value) == 2) {
+		map[name] = strtoull(value, nullptr, 0);
+	}
+	bool ok = feof(fd);
+	fclose(fd);
+	if (!ok) fprintf(stderr, "%s: Invalid symbol map\n", path);
+	return ok;
+}
+
+// Converts a shared object into a fast-load image, optionally prelinked.
+// Images are made for the word size and machine type the loader was built for.
+int main(int argc, char **argv) {
+	const char *base    = nullptr;
+	const char *symbols = nullptr;
+	int arg = 1;
+	for (; arg + 1 < argc && argv[arg][0] == '-'; arg += 2) {
+		if (!strcmp(argv[arg], "--base")) base = argv[arg+1];
+		else if (!strcmp(argv[arg], "--symbols")) symbols = argv[arg+1];
+		else break;
+	}
+	if (argc - arg != 2 || (!base && symbols)) {
+		fprintf(stderr, "Usage: %s [--base <address> [--symbols <file>]] <input.so> <output>\n", argv[0]);
+		return 1;
+	}
+	
+	FILE *in = fopen(argv[arg], "rb");
+	if (!in) {
+		perror(argv[arg]);
+		return 1;
+	}
+	elf::ELFFile file(in);
+	std::vector<uint8_t> image;
+	bool ok = elf::fastload::convert(file, image);
+	fclose(in);
+	if (!ok) {
+		fprintf(stderr, "%s: Conversion failed\n", argv[arg]);
+		return 1;
+	}
+	
+	// Prelink for the expected address and host symbols.
+	elf::SymMap map;
+	if (symbols && !readSymbols(symbols, map)) return 1;
+	if (base && !elf::fastload::prelink(image, strtoull(base, nullptr, 0), map)) {
+		fprintf(stderr, "%s: Prelinking failed\n", argv[arg]);
+		return 1;
+	}
+	
+	FILE *out = fopen(argv[arg+1], "wb");
+	if (!out) {
+		perror(argv[arg+1]);
+		return 1;
+	}
+	ok = fwrite(image.data(), 1, image.size(), out) == image.size();
+	ok &= !fclose(out);
+	if (!ok) {
+		perror(argv[arg+1]);
+		return 1;
+	}
+	
+	return 0;
+}